@@ -0,0 +1,79 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "bucket.h"
+
+void bucket_init(bucket_t *b, unsigned long rate, unsigned long burst, unsigned long now)
+{
+    if (!b)
+        return;
+    b->rate = rate;
+    b->burst = burst > 0 ? burst : 1;
+    b->tokens = b->burst;                                           /* Start with a full bucket */
+    b->stamp = now;
+}
+
+/* Add what trickled in since the last count, the remainder of a token is kept for later */
+static void bucket_refill(bucket_t *b, unsigned long now)
+{
+    unsigned long full, added;
+
+    if (b->tokens >= b->burst) {
+        b->stamp = now;
+        return;
+    }
+    full = (b->burst - b->tokens) * 1000000UL / b->rate + 1;        /* Microseconds until the bucket is full */
+    if (now - b->stamp >= full) {
+        b->tokens = b->burst;
+        b->stamp = now;
+        return;
+    }
+    added = (now - b->stamp) * b->rate / 1000000UL;
+    b->tokens = b->tokens + added > b->burst ? b->burst : b->tokens + added;
+    b->stamp += added * 1000000UL / b->rate;
+}
+
+/*
+ * Microseconds until n tokens can be taken, 0 if they can be right now.
+ */
+unsigned long bucket_wait(bucket_t *b, unsigned long n, unsigned long now)
+{
+    if (!b || b->rate == 0)
+        return 0;
+    if (n > b->burst)
+        n = b->burst;
+    bucket_refill(b, now);
+    if (b->tokens >= n)
+        return 0;
+    return (n - b->tokens) * 1000000UL / b->rate + 1;
+}
+
+/* Take n tokens, after bucket_wait() said they are there */
+void bucket_take(bucket_t *b, unsigned long n)
+{
+    if (!b || b->rate == 0)
+        return;
+    b->tokens -= n < b->tokens ? n : b->tokens;
+}
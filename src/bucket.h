@@ -0,0 +1,47 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef BUCKET_H
+#define BUCKET_H
+
+/*
+ * Token bucket. Tokens trickle in at a fixed rate up to a burst, whoever
+ * spends them must wait for more once the bucket is empty. Time is given
+ * by the caller in microseconds on a monotonic clock. Spending more than
+ * the burst at once needs a full bucket. Not thread-safe.
+ */
+typedef struct bucket {
+    unsigned long rate;             /* Tokens per second, 0 if unlimited */
+    unsigned long burst;            /* Most tokens the bucket holds */
+    unsigned long tokens;
+    unsigned long stamp;            /* Time the tokens were counted at */
+} bucket_t;
+
+void bucket_init(bucket_t *b, unsigned long rate, unsigned long burst, unsigned long now);
+
+unsigned long bucket_wait(bucket_t *b, unsigned long n, unsigned long now);
+void bucket_take(bucket_t *b, unsigned long n);
+
+#endif
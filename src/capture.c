@@ -0,0 +1,207 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE 1
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+#include "log.h"
+
+#define CAPTURE_RING_SIZE (4 * 1024 * 1024)     /* Bytes per shard, a power of two */
+#define CAPTURE_IDLE_NS 5000000                 /* Writer nap when all rings are empty */
+
+typedef struct capture_head {
+    unsigned long time;                         /* Microseconds on the monotonic clock */
+    unsigned long conn;
+    size_t len;
+    int type;
+} capture_head_t;
+
+/* Single producer, the owning shard, and single consumer, the writer */
+struct capture_ring {
+    unsigned long _head, _tail;                 /* Bytes taken out and put in so far */
+    unsigned long dropped;
+    char data[CAPTURE_RING_SIZE];
+};
+
+static capture_ring_t *capture_rings;
+static int capture_ring_count = 0;
+static FILE *capture_file;
+static unsigned long capture_last;              /* Time of the record written last */
+static unsigned long capture_reported = 0;
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long capture_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000UL + now.tv_nsec / 1000;
+}
+
+static void capture_put(capture_ring_t *ring, unsigned long pos, const void *src, size_t len)
+{
+    size_t off = pos & (CAPTURE_RING_SIZE - 1), first = len < CAPTURE_RING_SIZE - off ? len : CAPTURE_RING_SIZE - off;
+
+    memcpy(ring->data + off, src, first);
+    memcpy(ring->data, (const char *)src + first, len - first);
+}
+
+static void capture_get(const capture_ring_t *ring, unsigned long pos, void *dst, size_t len)
+{
+    size_t off = pos & (CAPTURE_RING_SIZE - 1), first = len < CAPTURE_RING_SIZE - off ? len : CAPTURE_RING_SIZE - off;
+
+    memcpy(dst, ring->data + off, first);
+    memcpy((char *)dst + first, ring->data, len - first);
+}
+
+static void capture_write(capture_ring_t *ring, unsigned long pos, size_t len)
+{
+    size_t off = pos & (CAPTURE_RING_SIZE - 1), first = len < CAPTURE_RING_SIZE - off ? len : CAPTURE_RING_SIZE - off;
+
+    fwrite(ring->data + off, 1, first, capture_file);
+    fwrite(ring->data, 1, len - first, capture_file);
+}
+
+static void capture_varint(unsigned long v)
+{
+    while (v >= 0x80) {
+        putc((int)(v & 0x7f) | 0x80, capture_file);
+        v >>= 7;
+    }
+    putc((int)v, capture_file);
+}
+
+/* Only the shard owning the ring may record */
+void capture_record(capture_ring_t *ring, int type, unsigned long conn, const char *data, size_t len)
+{
+    capture_head_t head;
+    unsigned long tail;
+
+    if (!ring)
+        return;
+    tail = ring->_tail;
+    if (tail + sizeof(head) + len - __atomic_load_n(&ring->_head, __ATOMIC_ACQUIRE) > CAPTURE_RING_SIZE) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    head.time = capture_now();
+    head.conn = conn;
+    head.len = len;
+    head.type = type;
+    capture_put(ring, tail, &head, sizeof(head));
+    capture_put(ring, tail + sizeof(head), data, len);
+    __atomic_store_n(&ring->_tail, tail + sizeof(head) + len, __ATOMIC_RELEASE);
+}
+
+/* Append everything recorded so far to the file, returns the number of records */
+static unsigned long capture_drain(void)
+{
+    unsigned long records = 0, dropped = 0, pos, tail;
+    capture_head_t head;
+    long delta;
+    int i;
+
+    pthread_mutex_lock(&capture_mutex);
+    for (i = 0; i < capture_ring_count; i++) {
+        capture_ring_t *ring = &capture_rings[i];
+
+        tail = __atomic_load_n(&ring->_tail, __ATOMIC_ACQUIRE);
+        for (pos = ring->_head; pos != tail; pos += sizeof(head) + head.len, records++) {
+            capture_get(ring, pos, &head, sizeof(head));
+            delta = (long)(head.time - capture_last);
+            capture_last = head.time;
+            putc(head.type, capture_file);
+            capture_varint(((unsigned long)delta << 1) ^ (unsigned long)(delta < 0 ? -1L : 0L));  /* Zigzag, small either way */
+            capture_varint(head.conn);
+            if (head.type == CAPTURE_DATA) {
+                capture_varint(head.len);
+                capture_write(ring, pos + sizeof(head), head.len);
+            }
+        }
+        __atomic_store_n(&ring->_head, tail, __ATOMIC_RELEASE);
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+    if (records > 0)
+        fflush(capture_file);
+    if (dropped != capture_reported) {
+        LOG_WARN(("Capture: dropped %lu records, writing the file can't keep up\n", dropped - capture_reported));
+        capture_reported = dropped;
+    }
+    pthread_mutex_unlock(&capture_mutex);
+    return records;
+}
+
+static void *capture_thread(void *arg)
+{
+    struct timespec idle;
+
+    idle.tv_sec = 0;
+    idle.tv_nsec = CAPTURE_IDLE_NS;
+    while (1) {
+        if (capture_drain() == 0)
+            nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+/* Create the capture file with a ring per shard and start the writer */
+int capture_open(const char *path, int rings)
+{
+    pthread_t tid;
+
+    if (!(capture_file = fopen(path, "wb")))
+        return -1;
+    if (fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_SIZE, capture_file) != CAPTURE_MAGIC_SIZE ||
+        !(capture_rings = (capture_ring_t *)calloc(rings, sizeof(capture_ring_t)))) {
+        fclose(capture_file);
+        capture_file = NULL;
+        return -1;
+    }
+    capture_last = capture_now();
+    capture_ring_count = rings;
+    if (pthread_create(&tid, NULL, capture_thread, NULL) != 0)
+        return -1;
+    pthread_detach(tid);
+    return 0;
+}
+
+/* Returns the ring of a shard or NULL while not capturing */
+capture_ring_t *capture_ring(int index)
+{
+    return index < capture_ring_count ? &capture_rings[index] : NULL;
+}
+
+/* Write out everything recorded so far, eg. before exiting */
+void capture_flush(void)
+{
+    if (capture_file)
+        capture_drain();
+}
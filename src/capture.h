@@ -0,0 +1,59 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+
+/*
+ * Capture of what clients send, to drive a server with it again later,
+ * see replay.c. Every shard records into a ring of its own which a
+ * background thread appends to the capture file. Nothing blocks: a full
+ * ring drops the record and counts it.
+ *
+ * The file starts with CAPTURE_MAGIC followed by records of a type byte,
+ * the microseconds since the record before as a zigzag varint, the
+ * connection id as a varint and, for CAPTURE_DATA, the length as a
+ * varint and the bytes as received. Records of different shards may be
+ * out of order by a few microseconds, hence the sign.
+ */
+#define CAPTURE_MAGIC "KCAP\001\000\000\000"
+#define CAPTURE_MAGIC_SIZE 8
+
+enum capture_type {
+    CAPTURE_CONNECT = 1,
+    CAPTURE_DATA,
+    CAPTURE_CLOSE
+};
+
+typedef struct capture_ring capture_ring_t;
+
+int capture_open(const char *path, int rings);
+capture_ring_t *capture_ring(int index);
+void capture_record(capture_ring_t *ring, int type, unsigned long conn, const char *data, size_t len);
+void capture_flush(void);
+
+#endif
@@ -23,12 +23,14 @@
     THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
-#define _POSIX_SOURCE 1
+#define _POSIX_C_SOURCE 200112L
 
 #include <sys/select.h>
+#include <sys/time.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <signal.h>
@@ -37,6 +39,10 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "frame.h"
+#include "proto.h"
+#include "shm.h"
+
 #ifndef SERVER_LISTEN_PORT
 #   define SERVER_LISTEN_PORT 9900
 #endif
@@ -44,22 +50,362 @@
 #   define BUFFER_SIZE 512
 #endif
 #define IPADDR_SIZE 15
+#define CLIENT_BULK_SIZE 65536      /* Batches of lines each way in bulk mode */
 
 static int client_sock, client_connected = 0;
 static char buf[BUFFER_SIZE];
+static shm_t shm;                   /* Rings shared with a server on this host */
+static int local = 0;
+static frame_t lines;               /* Lines from the server, PINGs among the messages */
+static char lines_buf[4 * BUFFER_SIZE];
+
+/*
+ * Bulk mode streams lines from stdin or a file into the room and prints
+ * what comes back, both through large buffers, until the input ends and
+ * the server acknowledged the QUIT. Only complete lines are sent, the up
+ * buffer holds them in front of the partial one being read. Every line
+ * is a message, one the server would take for a command, like QUIT or
+ * NICK name, goes out with a space in front.
+ */
+static int bulk = 0;
+static volatile sig_atomic_t bulk_interrupted = 0;
+static char bulk_up[CLIENT_BULK_SIZE], bulk_down[CLIENT_BULK_SIZE], bulk_out[CLIENT_BULK_SIZE];
+static size_t bulk_up_len = 0, bulk_up_ready = 0, bulk_out_len = 0;
+static unsigned long bulk_sent = 0, bulk_received = 0, bulk_bytes_out = 0, bulk_bytes_in = 0;
+static struct timeval bulk_start;
+static double bulk_input = -1.0;    /* Seconds until the server took all input, -1 before */
+static double bulk_last = 0.0;      /* Seconds until the last message arrived */
+
+static double bulk_since(const struct timeval *since)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - since->tv_sec) + (now.tv_usec - since->tv_usec) / 1e6;
+}
+
+/* Write all of data to a descriptor, blocking or not. Returns -1 on errors */
+static int write_all(int fd, const char *data, size_t len)
+{
+    ssize_t written;
+    fd_set fds;
+
+    while (len > 0) {
+        if ((written = write(fd, data, len)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                FD_ZERO(&fds);
+                FD_SET(fd, &fds);
+                select(fd + 1, NULL, &fds, NULL, NULL);
+            } else if (errno != EINTR) {
+                return -1;
+            }
+            continue;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+static void bulk_flush(void)
+{
+    if (bulk_out_len > 0 && write_all(STDOUT_FILENO, bulk_out, bulk_out_len) == -1)
+        fprintf(stderr, "Unable to print the messages\n");
+    bulk_out_len = 0;
+}
+
+static void bulk_report(void)
+{
+    double input = bulk_input < 0 ? bulk_since(&bulk_start) : bulk_input;
+
+    bulk_flush();
+    fprintf(stderr, "Sent %lu messages, %lu bytes in %.3f s (%.1f msgs/s, %.2f MB/s)\n", bulk_sent, bulk_bytes_out,
+            input, input > 0 ? bulk_sent / input : 0.0, input > 0 ? bulk_bytes_out / input / 1e6 : 0.0);
+    fprintf(stderr, "Received %lu messages, %lu bytes in %.3f s (%.1f msgs/s, %.2f MB/s)\n", bulk_received, bulk_bytes_in,
+            bulk_last, bulk_last > 0 ? bulk_received / bulk_last : 0.0, bulk_last > 0 ? bulk_bytes_in / bulk_last / 1e6 : 0.0);
+}
+
+/*
+ * Mark the complete lines read so far as ready to be sent, counting them.
+ * A line looking like a command waits while there is no room to escape
+ * it, until the socket took more.
+ */
+static void bulk_lines(void)
+{
+    size_t i, start = bulk_up_ready;
+
+    for (i = start; i < bulk_up_len; i++) {
+        if (bulk_up[i] != '\n')
+            continue;
+        if (proto_is_command(bulk_up + start, i + 1 - start)) {
+            if (bulk_up_len == sizeof(bulk_up))
+                break;
+            memmove(bulk_up + start + 1, bulk_up + start, bulk_up_len - start);
+            bulk_up[start] = ' ';
+            bulk_up_len++;
+            i++;
+        }
+        bulk_up_ready = start = i + 1;
+        bulk_sent++;
+    }
+    if (bulk_up_ready == 0 && bulk_up_len >= sizeof(bulk_up) - 1)
+        bulk_up_ready = bulk_up_len;                            /* Longer than the buffer, the server drops it anyway */
+}
+
+/* Queue a reply in front of the partial line, returns -1 if there is no room */
+static int bulk_reply(const char *line, size_t len)
+{
+    if (bulk_up_len + len > sizeof(bulk_up))
+        return -1;
+    memmove(bulk_up + bulk_up_ready + len, bulk_up + bulk_up_ready, bulk_up_len - bulk_up_ready);
+    memcpy(bulk_up + bulk_up_ready, line, len);
+    bulk_up_len += len;
+    bulk_up_ready += len;
+    return 0;
+}
+
+/*
+ * Run the conversation in bulk mode until the server acknowledged the
+ * QUIT sent once the input ended. Returns -1 if the connection was lost
+ * or on a signal.
+ */
+static int bulk_run(int in)
+{
+    frame_t down;
+    fd_set rfds, wfds, idle_rfds, idle_wfds;
+    struct timeval now = { 0, 0 };
+    ssize_t n;
+    size_t len;
+    char *line;
+    int eof = 0, quit = 0, ready, got;
+
+    frame_init(&down, sizeof(bulk_down), bulk_down, sizeof(bulk_down));
+    fcntl(client_sock, F_SETFL, fcntl(client_sock, F_GETFL) | O_NONBLOCK);
+    gettimeofday(&bulk_start, NULL);
+    while (!bulk_interrupted) {
+        if (eof && !quit && bulk_up_len == 0) {                 /* All sent, leave once the server took it */
+            bulk_reply("QUIT\r\n", 6);
+            quit = 1;
+        }
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        if (!eof && bulk_up_len < sizeof(bulk_up) - 1)          /* The last byte is kept for escaping a line */
+            FD_SET(in, &rfds);
+        FD_SET(client_sock, &rfds);
+        if (bulk_up_ready > 0)
+            FD_SET(client_sock, &wfds);
+        now.tv_sec = now.tv_usec = 0;
+        idle_rfds = rfds;
+        idle_wfds = wfds;
+        if ((ready = select((in > client_sock ? in : client_sock) + 1, &rfds, &wfds, NULL, &now)) == 0) {
+            bulk_flush();                                       /* Idle, print what came so far */
+            rfds = idle_rfds;
+            wfds = idle_wfds;
+            ready = select((in > client_sock ? in : client_sock) + 1, &rfds, &wfds, NULL, NULL);
+        }
+        if (ready == -1) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error in select() syscall\n");
+            return -1;
+        }
+
+        if (FD_ISSET(in, &rfds)) {
+            if ((n = read(in, bulk_up + bulk_up_len, sizeof(bulk_up) - 1 - bulk_up_len)) < 0 && errno != EINTR && errno != EAGAIN) {
+                fprintf(stderr, "Unable to fetch the input ...\n");
+                eof = 1;
+            } else if (n == 0) {
+                eof = 1;
+            } else if (n > 0) {
+                bulk_up_len += n;
+                bulk_lines();
+            }
+        }
+        if (eof && bulk_up_len > bulk_up_ready && bulk_up[bulk_up_len - 1] != '\n' && bulk_up_len < sizeof(bulk_up)) {
+            bulk_up[bulk_up_len++] = '\n';                     /* Last line without a terminator */
+            bulk_lines();
+        }
+        if (bulk_up_ready > 0) {                                /* Whatever the socket takes, it says when it takes more */
+            if ((n = write(client_sock, bulk_up, bulk_up_ready)) < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                fprintf(stderr, "Unable to send the messages to the server\n");
+                return -1;
+            } else if (n > 0) {
+                memmove(bulk_up, bulk_up + n, bulk_up_len - n);
+                bulk_up_len -= n;
+                bulk_up_ready -= n;
+                bulk_bytes_out += n;
+                bulk_lines();                                   /* Room for escaping a line that waited */
+            }
+        }
+        if (FD_ISSET(client_sock, &rfds)) {
+            if ((n = frame_read(&down, client_sock)) < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                fprintf(stderr, "Unable to fetch server messages ...\n");
+                return -1;
+            } else if (n == 0) {
+                fprintf(stderr, "Server closed the connection\n");
+                return quit ? 0 : -1;
+            } else if (n > 0) {
+                bulk_bytes_in += n;
+            }
+            got = 0;
+            while (frame_next(&down, &line, &len)) {
+                if (len == 6 && memcmp(line, "PING\r\n", 6) == 0) {  /* Heartbeat after a quiet spell */
+                    if (bulk_reply("PONG\r\n", 6) == -1)
+                        fprintf(stderr, "Unable to answer the server\n");
+                    continue;
+                }
+                if (len == 5 && memcmp(line, "ACK\r\n", 5) == 0) {
+                    if (quit && got)
+                        bulk_last = bulk_since(&bulk_start);
+                    if (quit) {                                 /* Every line before was taken in by now */
+                        bulk_input = bulk_since(&bulk_start);
+                        return 0;
+                    }
+                } else {
+                    bulk_received++;
+                    got = 1;
+                }
+                if (bulk_out_len + len > sizeof(bulk_out))
+                    bulk_flush();
+                memcpy(bulk_out + bulk_out_len, line, len);
+                bulk_out_len += len;
+            }
+            if (got)                                            /* Once per read, not per message */
+                bulk_last = bulk_since(&bulk_start);
+        }
+    }
+    return -1;
+}
+
+/* Sleep until the server wakes us. Returns -1 if it closed the connection */
+static int local_wait(void)
+{
+    char count[8];
+    fd_set fds;
+
+    FD_ZERO(&fds);
+    FD_SET(shm.evfd, &fds);
+    FD_SET(client_sock, &fds);
+    if (select((shm.evfd > client_sock ? shm.evfd : client_sock) + 1, &fds, NULL, NULL, NULL) == -1)
+        return 0;
+    if (FD_ISSET(client_sock, &fds) && read(client_sock, buf, 1) <= 0)
+        return -1;
+    if (FD_ISSET(shm.evfd, &fds) && read(shm.evfd, count, sizeof(count)) < 0)
+        return 0;
+    return 0;
+}
+
+/* The server sleeps or waits for room, a byte on the socket wakes it */
+static int local_wake(void)
+{
+    return write(client_sock, "", 1) == 1 ? 0 : -1;
+}
+
+/* Put all of data into the up ring, waiting for room as needed */
+static int local_write(const char *data, size_t len)
+{
+    size_t room;
+    char *dst;
+
+    while (len > 0) {
+        if (!(dst = shm_ring_reserve(&shm.up, &room))) {
+            if (shm_ring_stall(&shm.up) && local_wait() == -1)
+                return -1;
+            continue;
+        }
+        if (room > len)
+            room = len;
+        memcpy(dst, data, room);
+        if (shm_ring_commit(&shm.up, room) && local_wake() == -1)
+            return -1;
+        data += room;
+        len -= room;
+    }
+    return 0;
+}
+
+/* Take n bytes out of the down ring */
+static int local_consume(size_t n)
+{
+    return shm_ring_consume(&shm.down, n) ? local_wake() : 0;
+}
+
+/* Like proto_command(), for the rings */
+static int local_command(const char *cmd)
+{
+    char line[8], *data;
+    size_t len = 0, avail, i;
+
+    if (local_write(cmd, strlen(cmd)) == -1)
+        return -1;
+    while (1) {
+        if (!(data = shm_ring_peek(&shm.down, &avail))) {
+            if (shm_ring_idle(&shm.down) && local_wait() == -1)
+                return -1;
+            continue;
+        }
+        for (i = 0; i < avail; i++) {
+            if (len < sizeof(line))
+                line[len] = data[i];
+            len++;
+            if (data[i] == '\n') {
+                if (len == 5 && strncmp(line, "ACK\r\n", 5) == 0)
+                    return local_consume(i + 1);
+                len = 0;
+            }
+        }
+        if (local_consume(avail) == -1)
+            return -1;
+    }
+}
+
+/* Print the complete lines received so far, answering the PINGs among them */
+static void client_lines(void)
+{
+    size_t len;
+    char *line;
+
+    while (frame_next(&lines, &line, &len)) {
+        if (len == 6 && memcmp(line, "PING\r\n", 6) == 0) {     /* Heartbeat after a quiet spell of ours */
+            if ((local ? local_write("PONG\r\n", 6) : write_all(client_sock, "PONG\r\n", 6)) < 0)
+                fprintf(stderr, "Unable to answer the server\n");
+        } else if (write_all(STDOUT_FILENO, line, len) < 0) {
+            fprintf(stderr, "Unable to print the message\n");
+        }
+    }
+}
+
+/* Print what the server put into the down ring until it is empty */
+static void local_read(void)
+{
+    size_t len, fed;
+    char *data;
+
+    while (1) {
+        if (!(data = shm_ring_peek(&shm.down, &len))) {
+            if (shm_ring_idle(&shm.down))
+                return;
+            continue;
+        }
+        fed = frame_feed(&lines, data, len);                    /* What doesn't fit waits for the lines before */
+        client_lines();
+        if (local_consume(fed) == -1)
+            return;
+    }
+}
 
 void sig_handler(int sig)
 {
     int ret = EXIT_FAILURE;
+    if (bulk) {                                                 /* Left by bulk_run(), stdio isn't for handlers */
+        bulk_interrupted = 1;
+        return;
+    }
     if (client_connected) {
-        if (write(client_sock, "QUIT\r\n", 6) < 0) {
+        if ((local ? local_command("QUIT\r\n") : proto_quit(client_sock)) < 0) {
             fprintf(stderr, "Unable to quit the conversation on the server\n");
         } else {
-            if (read(client_sock, buf, BUFFER_SIZE) < 0) {
-                fprintf(stderr, "Unable to receive an acknowledge from the server\n");
-            } else if (strncmp(buf, "ACK\r\n", 5) == 0) {
-                ret = EXIT_SUCCESS;
-            }
+            ret = EXIT_SUCCESS;
         }
     }
     shutdown(client_sock, 2); close(client_sock);
@@ -69,13 +415,39 @@ void sig_handler(int sig)
 int main(int argc, char **argv)
 {
     struct sigaction action; sigset_t sigs;
-    struct sockaddr_in addr;
-    struct hostent *he;
-    int read_bytes;
+    int read_bytes, joined, opt, in = STDIN_FILENO;
+    const char *room, *server = NULL, *input = NULL;
+    char cmd[PROTO_ROOM_SIZE + 8];
+    FILE *status = stdout;
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s [host]\n", argv[0]); exit(EXIT_FAILURE);
+    while ((opt = getopt(argc, argv, "l:bf:")) != -1) {
+        switch (opt) {
+            case 'l':                                           /* Shared memory rings over the local socket */
+                local = 1;
+                server = optarg;
+                break;
+            case 'b':                                           /* Stream the input in, not a conversation */
+                bulk = 1;
+                break;
+            case 'f':                                           /* Bulk input from a file rather than stdin */
+                bulk = 1;
+                input = optarg;
+                break;
+            default:
+                argc = 0;
+        }
+    }
+    if (argc == 0 || (local && (bulk || argc - optind > 1)) || (!local && argc - optind != 1 && argc - optind != 2)) {
+        fprintf(stderr, "Usage: %s [-b] [-f file] host [room]\n       %s -l local_socket [room]\n", argv[0], argv[0]); exit(EXIT_FAILURE);
+    }
+    if (!local)
+        server = argv[optind++];
+    room = optind < argc ? argv[optind] : NULL;
+    if (input && (in = open(input, O_RDONLY)) == -1) {
+        perror(input); exit(EXIT_FAILURE);
     }
+    if (bulk)                                                   /* Keep stdout for the messages */
+        status = stderr;
 
     sigfillset(&sigs);                                          /* Mostly to keep valgrind happy */
     action.sa_flags = 0;
@@ -84,44 +456,61 @@ int main(int argc, char **argv)
     sigaction(SIGINT, &action, NULL);
     sigaction(SIGTERM, &action, NULL);
 
-    if ((client_sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        perror("socket()"); exit(EXIT_FAILURE);
-    }
-    if ((he = gethostbyname(argv[1])) == NULL) {
-        perror("gethostbyname()"); exit(EXIT_FAILURE);
-    }
-
-    fprintf(stdout, "Connecting to server %s ...\n", argv[1]);
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(SERVER_LISTEN_PORT);                  /* Set up listen socket */
-    memcpy(&addr.sin_addr, he->h_addr_list[0], he->h_length);
-    if (connect(client_sock, (struct sockaddr *)&addr, sizeof(struct sockaddr)) == -1) {
+    fprintf(status, "Connecting to server %s ...\n", server);
+    if (local) {
+        if ((client_sock = shm_connect(server)) == -1 || shm_recv(client_sock, &shm) == -1) {
+            perror("connect()"); exit(EXIT_FAILURE);
+        }
+        client_connected = 1;
+    } else if ((client_sock = proto_connect(server, SERVER_LISTEN_PORT)) == -1) {
         perror("connect()"); exit(EXIT_FAILURE);
     } else {
         client_connected = 1;
     }
 
-    fprintf(stdout, "Joining the conversation ...\n");
-    if (write(client_sock, "JOIN\r\n", 6) < 0) {                /* Try to enter conversation */
+    fprintf(status, "Joining the conversation ...\n");
+    if (!local) {
+        joined = proto_join(client_sock, room);
+    } else if (!room) {
+        joined = local_command("JOIN\r\n");
+    } else if (strlen(room) == 0 || strlen(room) > PROTO_ROOM_SIZE) {
+        joined = -1;
+    } else {
+        sprintf(cmd, "JOIN %s\r\n", room);
+        joined = local_command(cmd);
+    }
+    if (joined < 0) {                                           /* Try to enter conversation, if the server */
         fprintf(stderr, "Unable to join the conversation on the server\n");
-    } else {                                                    /* Test if the server responds positively */
-        if (read(client_sock, buf, BUFFER_SIZE) < 0) {
-            fprintf(stderr, "Unable to receive an acknowledge from the server\n");
-            kill(getpid(), SIGTERM);
-        } else if (strncmp(buf, "ACK\r\n", 5) != 0) {           /* If not we gently disconnect and shutdown */
-            kill(getpid(), SIGTERM);
+        kill(getpid(), SIGTERM);                                /* refuses we gently disconnect and shutdown */
+    }
+    if (bulk) {
+        fprintf(status, "Sending %s ...\n", input ? input : "the standard input");
+        joined = bulk_interrupted ? -1 : bulk_run(in);
+        bulk_report();
+        if (bulk_interrupted) {                                 /* Say how far it got, then leave like on Ctrl-C */
+            fcntl(client_sock, F_SETFL, fcntl(client_sock, F_GETFL) & ~O_NONBLOCK);
+            if ((joined = proto_quit(client_sock)) < 0)
+                fprintf(stderr, "Unable to quit the conversation on the server\n");
         }
+        shutdown(client_sock, 2); close(client_sock);
+        return joined == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
     }
     fprintf(stdout, "Ready, feel free to start writing ...\n");
+    fflush(stdout);                                             /* Messages bypass stdio */
+    frame_init(&lines, sizeof(lines_buf), lines_buf, sizeof(lines_buf));
+    if (local)
+        local_read();                                           /* Whatever came after the ACK */
 
     while (2) {
         fd_set fds;
+        int wake = local ? shm.evfd : client_sock;
 
         FD_ZERO(&fds);
         FD_SET(STDIN_FILENO, &fds);
         FD_SET(client_sock, &fds);
+        FD_SET(wake, &fds);
 
-        if (select(client_sock + 1, &fds, NULL, NULL, NULL) == -1) {
+        if (select((wake > client_sock ? wake : client_sock) + 1, &fds, NULL, NULL, NULL) == -1) {
             fprintf(stderr, "Error in select() syscall\n");
             continue;
         }
@@ -130,15 +519,23 @@ int main(int argc, char **argv)
             fflush(stdout);
             if ((read_bytes = read(STDIN_FILENO, buf, BUFFER_SIZE)) < 0) {
                 fprintf(stderr, "Unable to fetch user input ...\n"); continue;
-            } else if (write(client_sock, buf, read_bytes) < 0) {
+            } else if (read_bytes == 0) {                       /* End of input, leave like on Ctrl-C */
+                sig_handler(SIGTERM);
+            } else if ((local ? local_write(buf, read_bytes) : write_all(client_sock, buf, read_bytes)) < 0) {
                 fprintf(stderr, "Unable to send the message to the server\n");
             }
+        } else if (local && !FD_ISSET(client_sock, &fds)) {     /* Woken for output in the ring */
+            if (read(shm.evfd, buf, 8) < 0 && errno != EAGAIN)
+                fprintf(stderr, "Unable to fetch server message ...\n");
+            local_read();
         } else if (FD_ISSET(client_sock, &fds)) {
-            if ((read_bytes = read(client_sock, buf, BUFFER_SIZE)) < 0) {
+            if ((read_bytes = frame_read(&lines, client_sock)) < 0) {
                 fprintf(stderr, "Unable to fetch server message ...\n"); continue;
-            } else if (write(STDOUT_FILENO, buf, read_bytes) < 0) {
-                fprintf(stderr, "Unable to send the message to the server\n");
+            } else if (read_bytes == 0) {
+                fprintf(stderr, "Server closed the connection\n");
+                close(client_sock); exit(EXIT_FAILURE);
             }
+            client_lines();
         }
     }
     return EXIT_SUCCESS;
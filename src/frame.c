@@ -0,0 +1,198 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "frame.h"
+
+#include <string.h>
+#include <unistd.h>
+
+void frame_init(frame_t *f, size_t max, char *buf, size_t size)
+{
+    if (!f)
+        return;
+    f->_buf = buf;
+    f->_size = size;
+    f->_start = f->_len = f->_last = 0;
+    f->_discard = 0;
+    f->_skip = 0;
+    f->max = max < size ? max : size;
+    f->oversized = 0;
+}
+
+/* Move the unparsed input to the front of the buffer, making room behind it */
+static void frame_compact(frame_t *f)
+{
+    if (f->_start > 0) {                            /* Move the partial line to the front */
+        memmove(f->_buf, f->_buf + f->_start, f->_len - f->_start);
+        f->_len -= f->_start;
+        f->_start = 0;
+    }
+}
+
+/*
+ * Read whatever fd has, up to the free space of the buffer. Lines handed
+ * out by frame_next() are invalid afterwards. Returns like read().
+ */
+ssize_t frame_read(frame_t *f, int fd)
+{
+    ssize_t read_bytes;
+
+    frame_compact(f);
+    if ((read_bytes = read(fd, f->_buf + f->_len, f->_size - f->_len)) > 0)
+        f->_len += read_bytes;
+    return read_bytes;
+}
+
+/*
+ * Append input that was received elsewhere. Returns how many of the len
+ * bytes fit, the rest has to be fed again once frames were taken out.
+ */
+size_t frame_feed(frame_t *f, const char *data, size_t len)
+{
+    frame_compact(f);
+    if (len > f->_size - f->_len)
+        len = f->_size - f->_len;
+    memcpy(f->_buf + f->_len, data, len);
+    f->_len += len;
+    return len;
+}
+
+/*
+ * Hand out the next complete line including its terminator. Returns 1 if
+ * there is one and 0 if more input is needed.
+ */
+int frame_next(frame_t *f, char **line, size_t *len)
+{
+    char *end;
+
+    while (f->_start < f->_len) {
+        if (!(end = (char *)memchr(f->_buf + f->_start, '\n', f->_len - f->_start))) {
+            if (f->_discard || f->_len - f->_start >= f->max) {
+                if (!f->_discard)
+                    f->oversized++;
+                f->_discard = 1;                    /* Throw away until the terminator shows up */
+                f->_start = f->_len;
+            }
+            return 0;
+        }
+        *line = f->_buf + f->_start;
+        *len = end - *line + 1;
+        f->_last = f->_start;
+        f->_start += *len;
+        if (f->_discard) {                          /* Tail of an oversized line */
+            f->_discard = 0;
+            continue;
+        }
+        if (*len > f->max) {
+            f->oversized++;
+            continue;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+static unsigned long frame_get32(const char *p)
+{
+    const unsigned char *u = (const unsigned char *)p;
+
+    return (unsigned long)u[0] << 24 | (unsigned long)u[1] << 16 | (unsigned long)u[2] << 8 | u[3];
+}
+
+static void frame_put32(char *p, unsigned long v)
+{
+    p[0] = (char)(v >> 24 & 0xff);
+    p[1] = (char)(v >> 16 & 0xff);
+    p[2] = (char)(v >> 8 & 0xff);
+    p[3] = (char)(v & 0xff);
+}
+
+/*
+ * Hand out the payload of the next complete binary frame. Returns 1 if
+ * there is one and 0 if more input is needed.
+ */
+int frame_next_binary(frame_t *f, int *type, unsigned long *sender, char **payload, size_t *len)
+{
+    char *header;
+    size_t total;
+
+    while (f->_start < f->_len) {
+        if (f->_skip > 0) {                         /* Tail of an oversized frame */
+            total = f->_len - f->_start < f->_skip ? f->_len - f->_start : f->_skip;
+            f->_start += total;
+            f->_skip -= total;
+            continue;
+        }
+        if (f->_len - f->_start < FRAME_HEADER_SIZE)
+            return 0;
+        header = f->_buf + f->_start;
+        total = FRAME_HEADER_SIZE + frame_get32(header + 6);
+        if (total > f->_size) {
+            f->oversized++;
+            f->_skip = total;
+            continue;
+        }
+        if (f->_len - f->_start < total)
+            return 0;
+        *type = (unsigned char)header[0];
+        *sender = frame_get32(header + 2);
+        *payload = header + FRAME_HEADER_SIZE;
+        *len = total - FRAME_HEADER_SIZE;
+        f->_last = f->_start;
+        f->_start += total;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Put back the frame handed out last, the next call hands it out again.
+ * Only valid before the buffer takes more input.
+ */
+void frame_unget(frame_t *f)
+{
+    f->_start = f->_last;
+}
+
+/* Bytes the buffer takes before frames have to be taken out */
+size_t frame_room(const frame_t *f)
+{
+    return f->_size - (f->_len - f->_start);
+}
+
+/* Input not handed out yet, including partial frames */
+const char *frame_unparsed(const frame_t *f, size_t *len)
+{
+    *len = f->_len - f->_start;
+    return f->_buf + f->_start;
+}
+
+void frame_header(char *header, int type, unsigned long sender, size_t len)
+{
+    header[0] = (char)type;
+    header[1] = 0;
+    frame_put32(header + 2, sender);
+    frame_put32(header + 6, (unsigned long)len);
+}
@@ -0,0 +1,82 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <sys/types.h>
+
+/*
+ * Incremental line framing of a connection's input. Each read appends
+ * to the buffer, frame_next() then hands out every complete line, which
+ * ends in LF (commands in CRLF). A partial line is kept for the next
+ * read, a line longer than max is discarded up to its terminator. The
+ * buffer is provided by the caller and must hold at least max bytes.
+ *
+ * A connection may switch to binary frames instead, a header of
+ * FRAME_HEADER_SIZE bytes holding type, a reserved byte, sender id and
+ * payload length in network byte order, followed by the payload. Frames
+ * larger than the buffer are discarded.
+ */
+#define FRAME_HEADER_SIZE 10
+
+enum frame_type {
+    FRAME_MSG = 1,                  /* Message to the room */
+    FRAME_DIRECT,                   /* Message to a single client, sent with the nickname in front */
+    FRAME_JOIN,                     /* Enter the room named by the payload */
+    FRAME_NICK,                     /* Register the nickname in the payload */
+    FRAME_QUIT,
+    FRAME_ACK,
+    FRAME_ERROR,                    /* Payload tells what went wrong */
+    FRAME_PING,                     /* Heartbeat, answered with FRAME_PONG */
+    FRAME_PONG,
+    FRAME_RELAY,                    /* Message passed on by a peer node, see relay.h */
+    FRAME_DEFLATE                   /* Room message with its payload compressed, see zip.h, empty to ask for them */
+};
+
+typedef struct frame {
+    char *_buf;
+    size_t _size;                   /* Capacity of the buffer */
+    size_t _start;                  /* Offset of the first unparsed byte */
+    size_t _len;                    /* Bytes in the buffer */
+    size_t _last;                   /* Offset of the frame handed out last */
+    int _discard;                   /* Skipping the rest of an oversized line */
+    size_t _skip;                   /* Bytes of an oversized binary frame still to skip */
+    size_t max;                     /* Maximum line length including terminator */
+    unsigned long oversized;        /* Number of discarded lines */
+} frame_t;
+
+void frame_init(frame_t *f, size_t max, char *buf, size_t size);
+
+ssize_t frame_read(frame_t *f, int fd);
+size_t frame_feed(frame_t *f, const char *data, size_t len);
+int frame_next(frame_t *f, char **line, size_t *len);
+int frame_next_binary(frame_t *f, int *type, unsigned long *sender, char **payload, size_t *len);
+void frame_unget(frame_t *f);
+size_t frame_room(const frame_t *f);
+const char *frame_unparsed(const frame_t *f, size_t *len);
+void frame_header(char *header, int type, unsigned long sender, size_t len);
+
+#endif
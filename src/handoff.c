@@ -0,0 +1,212 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE 1
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "handoff.h"
+
+#define HANDOFF_IOV_MAX 8
+
+static int handoff_address(struct sockaddr_un *addr, const char *path)
+{
+    if (!path || strlen(path) >= sizeof(addr->sun_path))
+        return -1;
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/* Listen for a successor on path, replacing whatever was bound there */
+int handoff_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    int sock;
+
+    if (handoff_address(&addr, path) == -1 || (sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+        return -1;
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(sock, 1) == -1) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/* Connect to the server listening on path. Returns -1 if there is none */
+int handoff_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    int sock;
+
+    if (handoff_address(&addr, path) == -1 || (sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+        return -1;
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/*
+ * Send a record with the rec->fds descriptors in fds attached and the
+ * iovcnt buffers of its data. Blocks until everything is sent. Returns
+ * -1 on errors.
+ */
+int handoff_send(int sock, const handoff_record_t *rec, const int *fds, const struct iovec *iov, int iovcnt)
+{
+    struct iovec vec[HANDOFF_IOV_MAX + 1];
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(HANDOFF_FDS_MAX * sizeof(int))];
+    } control;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    ssize_t sent;
+    int i, n = 0;
+
+    if (!rec || iovcnt > HANDOFF_IOV_MAX || rec->fds < 0 || rec->fds > HANDOFF_FDS_MAX)
+        return -1;
+    vec[n].iov_base = (void *)rec;
+    vec[n++].iov_len = sizeof(*rec);
+    for (i = 0; i < iovcnt; i++)
+        if (iov[i].iov_len > 0)
+            vec[n++] = iov[i];
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vec;
+    msg.msg_iovlen = n;
+    if (rec->fds > 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(rec->fds * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(rec->fds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, rec->fds * sizeof(int));
+    }
+    while (msg.msg_iovlen > 0) {
+        if ((sent = sendmsg(sock, &msg, MSG_NOSIGNAL)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        msg.msg_control = NULL;                     /* The descriptor went with the first byte */
+        msg.msg_controllen = 0;
+        while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len) {
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+/* Read exactly len bytes. Returns -1 on errors or if the peer went away */
+int handoff_read(int sock, void *buf, size_t len)
+{
+    ssize_t got;
+
+    while (len > 0) {
+        if ((got = read(sock, buf, len)) <= 0) {
+            if (got == -1 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf = (char *)buf + got;
+        len -= got;
+    }
+    return 0;
+}
+
+/* Close what came attached to a record */
+static void handoff_close(int *fds)
+{
+    int i;
+
+    for (i = 0; i < HANDOFF_FDS_MAX; i++) {
+        if (fds[i] != -1)
+            close(fds[i]);
+        fds[i] = -1;
+    }
+}
+
+/*
+ * Receive the next record and the descriptors attached to it into fds,
+ * which has room for HANDOFF_FDS_MAX, the rest are -1. Its data has to
+ * be read with handoff_read() before the next record. Returns -1 on
+ * errors and on records of another build.
+ */
+int handoff_recv(int sock, handoff_record_t *rec, int *fds)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(HANDOFF_FDS_MAX * sizeof(int))];
+    } control;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t got;
+    int i, n = 0;
+
+    for (i = 0; i < HANDOFF_FDS_MAX; i++)
+        fds[i] = -1;
+    iov.iov_base = rec;
+    iov.iov_len = sizeof(*rec);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    while ((got = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+        ;
+    if (got <= 0)
+        return -1;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && n == 0) {
+            n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), n * sizeof(int));
+        }
+    }
+    if ((size_t)got < sizeof(*rec) && handoff_read(sock, (char *)rec + got, sizeof(*rec) - got) == -1) {
+        handoff_close(fds);
+        return -1;
+    }
+    if (rec->magic != HANDOFF_MAGIC || rec->fds != n) {
+        handoff_close(fds);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,71 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+/*
+ * Hand sockets and the state that goes with them from a running server
+ * to its successor over a Unix domain socket. Every record travels with
+ * the descriptors it counts attached (SCM_RIGHTS), followed by the data
+ * its lengths announce. Both ends must be the same build.
+ */
+#define HANDOFF_MAGIC 0x6b636833UL  /* "kch3" */
+#define HANDOFF_FDS_MAX 3           /* A local client's socket, memory file and eventfd */
+
+enum handoff_type {
+    HANDOFF_LISTEN = 1,             /* Listen socket of a shard */
+    HANDOFF_CLIENT,                 /* Client connection and its state */
+    HANDOFF_END                     /* Nothing follows, the successor acknowledges */
+};
+
+typedef struct handoff_record {
+    unsigned long magic;
+    int type;
+    int fds;                        /* Descriptors attached */
+    int state;                      /* Client state as the server numbers it */
+    int binary;                     /* Speaks binary frames */
+    int deflate;                    /* Asked for compressed messages */
+    unsigned long id;               /* Sender id in binary frames */
+    unsigned long history_seq;      /* Messages up to this one were replayed */
+    unsigned long node;             /* Node a link goes to, 0 if unknown */
+    int dialed;                     /* Link dialed to a peer from the command line */
+    struct sockaddr_in addr;
+    size_t room_len, nick_len;      /* Data following the record, in this order */
+    size_t in_len, out_len;         /* Input not handled yet, output not written yet */
+} handoff_record_t;
+
+int handoff_listen(const char *path);
+int handoff_connect(const char *path);
+
+int handoff_send(int sock, const handoff_record_t *rec, const int *fds, const struct iovec *iov, int iovcnt);
+int handoff_recv(int sock, handoff_record_t *rec, int *fds);
+int handoff_read(int sock, void *buf, size_t len);
+
+#endif
@@ -0,0 +1,59 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "hist.h"
+
+int hist_index(unsigned long v)
+{
+    int msb = 0;
+
+    if (v < (1UL << HIST_SUB_BITS))
+        return (int)v;
+    while ((v >> msb) > 1)
+        msb++;
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + (int)((v >> (msb - HIST_SUB_BITS)) & ((1UL << HIST_SUB_BITS) - 1));
+}
+
+/* Smallest value falling into a bucket */
+unsigned long hist_value(int index)
+{
+    int msb = (index >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+
+    if (index < (1 << HIST_SUB_BITS))
+        return (unsigned long)index;
+    return ((1UL << HIST_SUB_BITS) + (index & ((1 << HIST_SUB_BITS) - 1))) << (msb - HIST_SUB_BITS);
+}
+
+unsigned long hist_percentile(const unsigned long *hist, unsigned long total, double p)
+{
+    unsigned long rank = (unsigned long)(p * total), sum = 0;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        if ((sum += hist[i]) > rank)
+            return hist_value(i);
+    }
+    return 0;
+}
@@ -0,0 +1,334 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE 1
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "history.h"
+
+#define HISTORY_PATH_SIZE 4096
+
+static void history_path(history_t *h, char *path, unsigned long id, const char *ext)
+{
+    snprintf(path, HISTORY_PATH_SIZE, "%s/%08lu.%s", h->dir, id, ext);
+}
+
+/* Map a segment, a new one is created empty and writable, an old one is only read */
+static int segment_open(history_t *h, history_segment_t *seg, unsigned long id, int create)
+{
+    char path[HISTORY_PATH_SIZE];
+    size_t idx_size = h->segment_records * sizeof(history_record_t);
+    struct stat st;
+
+    seg->id = id;
+    seg->used = seg->records = 0;
+    seg->map = NULL;
+    seg->idx = NULL;
+    seg->idx_fd = -1;
+    history_path(h, path, id, "log");
+    if ((seg->fd = open(path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY, 0644)) == -1)
+        return -1;
+    if (create && ftruncate(seg->fd, h->segment_size) == -1)
+        goto fail;
+    if (fstat(seg->fd, &st) == -1 || st.st_size == 0)
+        goto fail;
+    seg->size = st.st_size;
+    if ((seg->map = (char *)mmap(NULL, seg->size, create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, seg->fd, 0)) == MAP_FAILED)
+        goto fail;
+    if (!create)
+        return 0;
+    history_path(h, path, id, "idx");
+    if ((seg->idx_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1 || ftruncate(seg->idx_fd, idx_size) == -1)
+        goto fail;
+    if ((seg->idx = (history_record_t *)mmap(NULL, idx_size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->idx_fd, 0)) == MAP_FAILED)
+        goto fail;
+    return 0;
+fail:
+    if (seg->map && seg->map != MAP_FAILED)
+        munmap(seg->map, seg->size);
+    if (seg->idx_fd != -1)
+        close(seg->idx_fd);
+    close(seg->fd);
+    seg->fd = -1;
+    return -1;
+}
+
+/* Trim the files of the current segment to what was written, it stays readable */
+static void segment_seal(history_t *h, history_segment_t *seg)
+{
+    if (!seg->idx)
+        return;
+    munmap(seg->idx, h->segment_records * sizeof(history_record_t));
+    seg->idx = NULL;
+    if (ftruncate(seg->idx_fd, seg->records * sizeof(history_record_t)) == -1 || ftruncate(seg->fd, seg->used) == -1)
+        perror("ftruncate()");
+    close(seg->idx_fd);
+    seg->idx_fd = -1;
+}
+
+static void segment_close(history_t *h, history_segment_t *seg, int remove)
+{
+    char path[HISTORY_PATH_SIZE];
+
+    if (seg->fd == -1)
+        return;
+    segment_seal(h, seg);
+    munmap(seg->map, seg->size);
+    close(seg->fd);                             /* Replays hold their own descriptors */
+    seg->fd = -1;
+    if (remove) {
+        history_path(h, path, seg->id, "log");
+        unlink(path);
+        history_path(h, path, seg->id, "idx");
+        unlink(path);
+    }
+}
+
+static void history_index(history_t *h, const history_record_t *rec)
+{
+    h->_tail[(h->_tail_head + h->_tail_count) % h->_tail_size] = *rec;
+    if (h->_tail_count < h->_tail_size)
+        h->_tail_count++;
+    else
+        h->_tail_head = (h->_tail_head + 1) % h->_tail_size;
+}
+
+/* Pick up the index of a segment left by an earlier run */
+static void history_recover(history_t *h, unsigned long id)
+{
+    history_segment_t *seg = &h->_segs[id % h->segments];
+    char path[HISTORY_PATH_SIZE];
+    history_record_t rec;
+    int fd;
+
+    history_path(h, path, id, "idx");
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return;
+    if (segment_open(h, seg, id, 0) == -1) {
+        close(fd);
+        return;
+    }
+    while (read(fd, &rec, sizeof(rec)) == sizeof(rec) && rec.seq != 0) {    /* Unsealed index ends in zeros */
+        history_index(h, &rec);
+        if (rec.seq > h->seq)
+            h->seq = rec.seq;
+    }
+    close(fd);
+}
+
+/*
+ * Open the log in dir, keeping up to segments segment files of
+ * segment_size bytes and the newest records in memory. Messages of an
+ * earlier run are picked up, writing continues in a new segment.
+ */
+int history_open(history_t *h, const char *dir, size_t segment_size, int segments, size_t records)
+{
+    unsigned long id, last = 0;
+    struct dirent *entry;
+    DIR *d;
+    int i;
+
+    if (!h || !dir || segments < 1 || records == 0 || segment_size < 1024)
+        return -1;
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+        return -1;
+    if (!(d = opendir(dir)))
+        return -1;
+    while ((entry = readdir(d)))                /* Find the segment written last, names are "<id>.log" and "<id>.idx" */
+        if (sscanf(entry->d_name, "%8lu.", &id) == 1 && id > last)
+            last = id;
+    h->dir = strdup(dir);
+    h->segment_size = segment_size;
+    h->segment_records = segment_size / 64;
+    h->segments = segments;
+    h->seq = 0;
+    h->_segs = (history_segment_t *)calloc(segments, sizeof(history_segment_t));
+    h->_tail = (history_record_t *)calloc(records, sizeof(history_record_t));
+    h->_tail_size = records;
+    h->_tail_head = h->_tail_count = 0;
+    if (!h->dir || !h->_segs || !h->_tail) {
+        closedir(d);
+        history_close(h);
+        return -1;
+    }
+    for (i = 0; i < segments; i++)
+        h->_segs[i].fd = -1;
+    h->_first = last + 2 > (unsigned long)segments ? last + 2 - segments : 1;
+    h->_last = last + 1;
+    rewinddir(d);
+    while ((entry = readdir(d))) {              /* Delete what falls out of the window */
+        char path[HISTORY_PATH_SIZE];
+
+        if (sscanf(entry->d_name, "%8lu.", &id) == 1 && id < h->_first) {
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(d);
+    for (id = h->_first; id < h->_last; id++)
+        history_recover(h, id);
+    if (segment_open(h, &h->_segs[h->_last % segments], h->_last, 1) == -1) {
+        history_close(h);
+        return -1;
+    }
+    pthread_mutex_init(&h->_mutex, NULL);
+    return 0;
+}
+
+void history_close(history_t *h)
+{
+    int i;
+
+    if (!h)
+        return;
+    if (h->_segs) {
+        for (i = 0; i < h->segments; i++)
+            segment_close(h, &h->_segs[i], 0);
+        free(h->_segs);
+        h->_segs = NULL;
+    }
+    free(h->_tail);
+    h->_tail = NULL;
+    free(h->dir);
+    h->dir = NULL;
+}
+
+/* Seal the current segment and start the next one, the oldest is dropped */
+static int history_rotate(history_t *h)
+{
+    history_segment_t *seg;
+
+    segment_seal(h, &h->_segs[h->_last % h->segments]);
+    h->_last++;
+    seg = &h->_segs[h->_last % h->segments];
+    if (seg->fd != -1) {
+        segment_close(h, seg, 1);
+        h->_first = seg->id + 1;
+    }
+    return segment_open(h, seg, h->_last, 1);
+}
+
+/*
+ * Append a text line sent to room, label_len being the length of the
+ * sender name it starts with. Returns its sequence number or 0 if it was
+ * not logged.
+ */
+unsigned long history_append(history_t *h, const char *room, size_t room_len, const char *text, size_t len,
+        size_t label_len, unsigned long sender)
+{
+    history_segment_t *seg;
+    history_record_t rec;
+
+    if (!h || !h->_segs || len > h->segment_size || room_len > ROOM_NAME_SIZE)
+        return 0;
+    pthread_mutex_lock(&h->_mutex);
+    seg = &h->_segs[h->_last % h->segments];
+    if ((seg->used + len > h->segment_size || seg->records == h->segment_records) && history_rotate(h) == -1) {
+        pthread_mutex_unlock(&h->_mutex);
+        return 0;
+    }
+    seg = &h->_segs[h->_last % h->segments];
+    if (seg->fd == -1) {                        /* Rotation failed earlier, try again */
+        pthread_mutex_unlock(&h->_mutex);
+        return 0;
+    }
+    memcpy(seg->map + seg->used, text, len);
+    memset(&rec, 0, sizeof(rec));
+    rec.seq = ++h->seq;
+    rec.segment = seg->id;
+    rec.offset = seg->used;
+    rec.len = len;
+    rec.label_len = label_len;
+    rec.sender = sender;
+    rec.room_len = room_len;
+    memcpy(rec.room, room, room_len);
+    seg->idx[seg->records++] = rec;
+    seg->used += len;
+    history_index(h, &rec);
+    pthread_mutex_unlock(&h->_mutex);
+    return rec.seq;
+}
+
+/* Records of dropped or unreadable segments never match */
+static int history_match(history_t *h, const history_record_t *rec, const char *room, size_t room_len, unsigned long since)
+{
+    history_segment_t *seg = &h->_segs[rec->segment % h->segments];
+
+    return rec->seq > since && rec->segment >= h->_first && seg->fd != -1 && seg->id == rec->segment
+        && rec->room_len == room_len && memcmp(rec->room, room, room_len) == 0;
+}
+
+/*
+ * Hand the records of room to callback, oldest first: those after since
+ * if it is not 0, otherwise the last ones, at most last records and
+ * max_bytes of text. The callback runs with the log locked and gets the
+ * segment's descriptor and the mapped text. Returns the sequence number
+ * of the last message logged so far.
+ */
+unsigned long history_replay(history_t *h, const char *room, size_t room_len, unsigned long since, size_t last,
+        size_t max_bytes, history_callback_t callback, void *data)
+{
+    size_t i, count = 0, bytes = 0, start = 0;
+    unsigned long seq;
+
+    if (!h || !h->_segs)
+        return 0;
+    pthread_mutex_lock(&h->_mutex);
+    for (i = h->_tail_count; i > 0 && count < last; i--) {  /* Newest first, to find where to start */
+        history_record_t *rec = &h->_tail[(h->_tail_head + i - 1) % h->_tail_size];
+
+        if (rec->seq <= since)
+            break;
+        if (!history_match(h, rec, room, room_len, since))
+            continue;
+        if (bytes + rec->len > max_bytes)
+            break;
+        bytes += rec->len;
+        count++;
+        start = i - 1;
+    }
+    for (i = start; count > 0; i++) {
+        history_record_t *rec = &h->_tail[(h->_tail_head + i) % h->_tail_size];
+        history_segment_t *seg = &h->_segs[rec->segment % h->segments];
+
+        if (!history_match(h, rec, room, room_len, since))
+            continue;
+        callback(rec, seg->fd, seg->map + rec->offset, data);
+        count--;
+    }
+    seq = h->seq;
+    pthread_mutex_unlock(&h->_mutex);
+    return seq;
+}
@@ -0,0 +1,84 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "room.h"
+
+/*
+ * Append-only log of the messages sent to rooms. Messages are stored in
+ * their text wire form in memory-mapped segment files, so that a replay
+ * can hand file ranges straight to sendfile(). Every segment has an
+ * index file of fixed-size records next to it, from which the bounded
+ * in-memory tail index is rebuilt on startup. Once a segment is full
+ * the next one is started and the oldest is deleted.
+ */
+typedef struct history_record {
+    unsigned long seq;                  /* Server wide sequence number, starting at 1 */
+    unsigned long segment;              /* Id of the segment holding the text */
+    size_t offset, len;                 /* Text line within the segment */
+    size_t label_len;                   /* Length of the sender name in front */
+    unsigned long sender;               /* Id of the sending client */
+    size_t room_len;
+    char room[ROOM_NAME_SIZE + 1];
+} history_record_t;
+
+typedef struct history_segment {
+    unsigned long id;
+    int fd, idx_fd;
+    char *map;                          /* Whole segment, text */
+    size_t size;                        /* Of the mapping */
+    history_record_t *idx;              /* Index records of the segment, NULL once full */
+    size_t used, records;
+} history_segment_t;
+
+typedef struct history {
+    char *dir;
+    size_t segment_size;
+    size_t segment_records;             /* Index records per segment */
+    int segments;                       /* Segments kept */
+    unsigned long seq;                  /* Last sequence number handed out */
+    history_segment_t *_segs;           /* Indexed by id modulo segments */
+    unsigned long _first, _last;        /* Oldest and current segment */
+    history_record_t *_tail;            /* Ring of the newest records */
+    size_t _tail_size, _tail_head, _tail_count;
+    pthread_mutex_t _mutex;
+} history_t;
+
+typedef void (*history_callback_t)(const history_record_t *rec, int fd, const char *text, void *data);
+
+int history_open(history_t *h, const char *dir, size_t segment_size, int segments, size_t records);
+void history_close(history_t *h);
+
+unsigned long history_append(history_t *h, const char *room, size_t room_len, const char *text, size_t len,
+        size_t label_len, unsigned long sender);
+unsigned long history_replay(history_t *h, const char *room, size_t room_len, unsigned long since, size_t last,
+        size_t max_bytes, history_callback_t callback, void *data);
+
+#endif
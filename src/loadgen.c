@@ -0,0 +1,497 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE 1
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "frame.h"
+#include "hist.h"
+#include "proto.h"
+#include "zip.h"
+
+#ifndef SERVER_LISTEN_PORT
+#   define SERVER_LISTEN_PORT 9900
+#endif
+#ifndef BUFFER_SIZE
+#   define BUFFER_SIZE 512
+#endif
+#define LOADGEN_MAX_THREADS 64
+#define LOADGEN_MAX_PORTS 16                    /* Nodes of a federation, one port each */
+#define LOADGEN_MAX_EVENTS 256
+#define LOADGEN_READ_SIZE 16384
+#define LOADGEN_OUT_SIZE 4096
+#define LOADGEN_DRAIN_MS 1000                   /* Time to wait for messages in flight */
+
+/*
+ * Every generated message is a line "LG <conn> <seq> <sec>.<nsec> <padding>"
+ * and comes back to all other connections as "<sender>: LG ...", so the
+ * receiver can tell the delivery latency from the embedded monotonic
+ * time stamp and account the delivery to the sequence number. With
+ * several ports, connection n talks to the node at port n % ports, so
+ * the receiver can tell deliveries that crossed nodes. Messages stamped
+ * before the run started come from the history the server replays on
+ * JOIN and don't count. With -z the connections send MODE ZIP before
+ * they join and speak binary frames instead, the message is the payload
+ * of a frame and may come back compressed.
+ */
+typedef struct conn {
+    int sock;
+    int id;                                     /* Number of the connection, embedded in messages */
+    int quit;                                   /* QUIT was acknowledged */
+    frame_t in;
+    char inbuf[LOADGEN_READ_SIZE];
+    char out[LOADGEN_OUT_SIZE];                 /* Partially written messages */
+    size_t out_len;
+} conn_t;
+
+typedef struct worker {
+    pthread_t tid;
+    int epfd;
+    conn_t *conns;
+    int count;
+    double rate;                                /* Messages per second sent by this worker */
+    unsigned long sent, received, skipped, foreign;
+    unsigned long bytes_out, bytes_in;
+    unsigned long hist[HIST_BUCKETS];           /* Delivery latencies in nanoseconds */
+    unsigned long max_ns;
+    unsigned long cross_received;               /* Deliveries sent through another node */
+    unsigned long cross_hist[HIST_BUCKETS];
+    unsigned long deflated;                     /* Deliveries that came compressed */
+    z_stream inflater;
+    char plain[BUFFER_SIZE + 1];                /* Message taken out of a frame, NUL terminated */
+} worker_t;
+
+static const char *host;
+static int ports[LOADGEN_MAX_PORTS] = { SERVER_LISTEN_PORT }, port_count = 1;
+static int conn_count = 100, worker_count = 2, msg_size = 64, json = 0, zip = 0;
+static double rate = 1000.0, duration = 10.0;
+static worker_t workers[LOADGEN_MAX_THREADS];
+static unsigned long seq_next = 0, seq_max;
+static unsigned int *fanout;                    /* Deliveries per sequence number */
+static struct timespec start;
+
+static double elapsed(const struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+static int conn_flush(worker_t *w, conn_t *c)
+{
+    struct epoll_event ev;
+    ssize_t written;
+
+    while (c->out_len > 0) {
+        if ((written = write(c->sock, c->out, c->out_len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            break;
+        }
+        memmove(c->out, c->out + written, c->out_len - written);
+        c->out_len -= written;
+        w->bytes_out += written;
+    }
+    ev.events = c->out_len > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    ev.data.ptr = c;
+    epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->sock, &ev);
+    return 0;
+}
+
+static void conn_send(worker_t *w, conn_t *c)
+{
+    struct timespec now;
+    unsigned long seq;
+    size_t head = zip ? FRAME_HEADER_SIZE : 0;
+    char *msg;
+    int len;
+
+    if (c->out_len + msg_size + 64 > LOADGEN_OUT_SIZE) {    /* Server doesn't keep up, don't pile up */
+        w->skipped++;
+        return;
+    }
+    if ((seq = __atomic_fetch_add(&seq_next, 1, __ATOMIC_RELAXED)) >= seq_max) {
+        w->skipped++;
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    msg = c->out + c->out_len + head;
+    len = sprintf(msg, "LG %d %lu %ld.%09ld ", c->id, seq, (long)now.tv_sec, now.tv_nsec);
+    while (len < msg_size - 1)
+        msg[len++] = 'x';
+    if (zip)
+        frame_header(c->out + c->out_len, FRAME_MSG, 0, len);
+    else
+        msg[len++] = '\n';
+    c->out_len += head + len;
+    w->sent++;
+    conn_flush(w, c);
+}
+
+/* Account a delivered message, "LG ..." without the sender in front */
+static void conn_message(worker_t *w, conn_t *c, const char *msg)
+{
+    struct timespec now;
+    unsigned long seq, ns;
+    long sec, nsec;
+    int id;
+
+    if (strncmp(msg, "LG ", 3) != 0 || sscanf(msg + 3, "%d %lu %ld.%ld", &id, &seq, &sec, &nsec) != 4 || seq >= seq_max) {
+        w->foreign++;                           /* Not one of ours */
+        return;
+    }
+    if (sec < start.tv_sec || (sec == start.tv_sec && nsec < start.tv_nsec)) {
+        w->foreign++;                           /* Replayed from the history, sent by an earlier run */
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (now.tv_sec - sec) * 1000000000UL + now.tv_nsec - nsec;
+    w->hist[hist_index(ns)]++;
+    if (ns > w->max_ns)
+        w->max_ns = ns;
+    w->received++;
+    if (id % port_count != c->id % port_count) {
+        w->cross_hist[hist_index(ns)]++;
+        w->cross_received++;
+    }
+    __atomic_add_fetch(&fanout[seq], 1, __ATOMIC_RELAXED);
+}
+
+static void conn_line(worker_t *w, conn_t *c, char *line, size_t len)
+{
+    char *lg;
+
+    line[len - 1] = '\0';
+    if (strncmp(line, "ACK\r", 4) == 0) {
+        c->quit = 1;
+        return;
+    }
+    if (strncmp(line, "PING\r", 5) == 0) {     /* Heartbeat, only sent while we are quiet */
+        if (c->out_len + 6 <= LOADGEN_OUT_SIZE) {
+            memcpy(c->out + c->out_len, "PONG\r\n", 6);
+            c->out_len += 6;
+            conn_flush(w, c);
+        }
+        return;
+    }
+    if (!(lg = strstr(line, ": LG "))) {
+        w->foreign++;
+        return;
+    }
+    conn_message(w, c, lg + 2);
+}
+
+static void conn_frame(worker_t *w, conn_t *c, int type, const char *payload, size_t len)
+{
+    ssize_t plain;
+
+    switch (type) {
+        case FRAME_ACK:
+            c->quit = 1;
+            break;
+        case FRAME_PING:
+            if (c->out_len + FRAME_HEADER_SIZE <= LOADGEN_OUT_SIZE) {
+                frame_header(c->out + c->out_len, FRAME_PONG, 0, 0);
+                c->out_len += FRAME_HEADER_SIZE;
+                conn_flush(w, c);
+            }
+            break;
+        case FRAME_MSG:
+            if (len >= sizeof(w->plain)) {
+                w->foreign++;
+                break;
+            }
+            memcpy(w->plain, payload, len);
+            w->plain[len] = '\0';
+            conn_message(w, c, w->plain);
+            break;
+        case FRAME_DEFLATE:
+            if ((plain = zip_inflate(&w->inflater, payload, len, w->plain, sizeof(w->plain) - 1)) == -1) {
+                w->foreign++;
+                break;
+            }
+            w->plain[plain] = '\0';
+            w->deflated++;
+            conn_message(w, c, w->plain);
+            break;
+        default:
+            w->foreign++;
+    }
+}
+
+static int conn_read(worker_t *w, conn_t *c)
+{
+    ssize_t read_bytes;
+    unsigned long sender;
+    char *line;
+    size_t len;
+    int type;
+
+    if ((read_bytes = frame_read(&c->in, c->sock)) < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    else if (read_bytes == 0)
+        return -1;
+    w->bytes_in += read_bytes;
+    if (zip) {
+        while (frame_next_binary(&c->in, &type, &sender, &line, &len))
+            conn_frame(w, c, type, line, len);
+    } else {
+        while (frame_next(&c->in, &line, &len))
+            conn_line(w, c, line, len);
+    }
+    return 0;
+}
+
+static void worker_poll(worker_t *w, int timeout)
+{
+    struct epoll_event events[LOADGEN_MAX_EVENTS];
+    int i, count;
+
+    if ((count = epoll_wait(w->epfd, events, LOADGEN_MAX_EVENTS, timeout)) < 0)
+        return;
+    for (i = 0; i < count; i++) {
+        conn_t *c = (conn_t *)events[i].data.ptr;
+
+        if (c->sock < 0)
+            continue;
+        if (((events[i].events & EPOLLOUT) && conn_flush(w, c) == -1)
+                || ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && conn_read(w, c) == -1)) {
+            if (!c->quit)
+                fprintf(stderr, "Connection %d lost\n", c->id);
+            epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->sock, NULL);
+            close(c->sock);
+            c->sock = -1;
+            c->quit = 1;
+        }
+    }
+}
+
+void *worker_func(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    char quit[FRAME_HEADER_SIZE];
+    unsigned long due;
+    int i, next = 0, done;
+    double t;
+
+    while ((t = elapsed(&start)) < duration) {          /* Send at the configured rate */
+        for (due = (unsigned long)(w->rate * t); w->sent + w->skipped < due; next = (next + 1) % w->count) {
+            if (w->conns[next].sock >= 0)
+                conn_send(w, &w->conns[next]);
+            else
+                w->skipped++;
+        }
+        worker_poll(w, 1);
+    }
+    while (elapsed(&start) < duration + LOADGEN_DRAIN_MS / 1000.0)
+        worker_poll(w, 10);                             /* Collect what is still in flight */
+
+    frame_header(quit, FRAME_QUIT, 0, 0);
+    for (i = 0; i < w->count; i++) {                    /* Leave the conversation */
+        conn_t *c = &w->conns[i];
+
+        if (c->sock >= 0 && (zip ? write(c->sock, quit, sizeof(quit)) : write(c->sock, "QUIT\r\n", 6)) < 0)
+            c->quit = 1;
+    }
+    do {
+        worker_poll(w, 10);
+        for (i = 0, done = 1; i < w->count; i++)
+            done &= w->conns[i].quit;
+    } while (!done && elapsed(&start) < duration + 2 * LOADGEN_DRAIN_MS / 1000.0);
+    for (i = 0; i < w->count; i++) {
+        if (w->conns[i].sock >= 0)
+            close(w->conns[i].sock);
+    }
+    return NULL;
+}
+
+static void report(double secs)
+{
+    unsigned long sent = 0, received = 0, skipped = 0, bytes_out = 0, bytes_in = 0, max_ns = 0, complete = 0, expected;
+    unsigned long cross = 0, deflated = 0;
+    static unsigned long hist[HIST_BUCKETS], cross_hist[HIST_BUCKETS];
+    unsigned long i;
+    int j;
+
+    for (j = 0; j < worker_count; j++) {
+        worker_t *w = &workers[j];
+
+        sent += w->sent; received += w->received; skipped += w->skipped;
+        bytes_out += w->bytes_out; bytes_in += w->bytes_in;
+        if (w->max_ns > max_ns)
+            max_ns = w->max_ns;
+        cross += w->cross_received;
+        deflated += w->deflated;
+        for (i = 0; i < HIST_BUCKETS; i++) {
+            hist[i] += w->hist[i];
+            cross_hist[i] += w->cross_hist[i];
+        }
+    }
+    for (i = 0; i < sent && i < seq_max; i++) {
+        if (fanout[i] >= (unsigned int)(conn_count - 1))
+            complete++;
+    }
+    expected = sent * (conn_count - 1);
+
+    if (json) {
+        fprintf(stdout, "{\"connections\": %d, \"threads\": %d, \"duration_s\": %.3f, \"message_size\": %d, "
+                "\"sent\": %lu, \"skipped\": %lu, \"received\": %lu, \"expected\": %lu, "
+                "\"msgs_in_per_s\": %.1f, \"msgs_out_per_s\": %.1f, \"bytes_out\": %lu, \"bytes_in\": %lu, "
+                "\"fanout_completeness\": %.6f, \"fully_delivered\": %lu, "
+                "\"latency_p50_us\": %.1f, \"latency_p99_us\": %.1f, \"latency_p999_us\": %.1f, \"latency_max_us\": %.1f, "
+                "\"nodes\": %d, \"cross_node_received\": %lu, \"cross_node_p50_us\": %.1f, \"cross_node_p99_us\": %.1f, ",
+                conn_count, worker_count, secs, msg_size, sent, skipped, received, expected,
+                sent / secs, received / secs, bytes_out, bytes_in,
+                expected ? (double)received / expected : 1.0, complete,
+                hist_percentile(hist, received, 0.5) / 1e3, hist_percentile(hist, received, 0.99) / 1e3,
+                hist_percentile(hist, received, 0.999) / 1e3, max_ns / 1e3,
+                port_count, cross, hist_percentile(cross_hist, cross, 0.5) / 1e3, hist_percentile(cross_hist, cross, 0.99) / 1e3);
+        fprintf(stdout, "\"cross_node_p999_us\": %.1f, \"compressed\": %d, \"compressed_received\": %lu}\n",
+                hist_percentile(cross_hist, cross, 0.999) / 1e3, zip, deflated);
+    } else {
+        fprintf(stdout, "Connections:     %d on %d threads\n", conn_count, worker_count);
+        fprintf(stdout, "Messages sent:   %lu (%.1f/s), %lu skipped\n", sent, sent / secs, skipped);
+        fprintf(stdout, "Messages recvd:  %lu (%.1f/s) of %lu expected\n", received, received / secs, expected);
+        fprintf(stdout, "Fan-out:         %.4f%% complete, %lu of %lu messages reached everyone\n",
+                expected ? 100.0 * received / expected : 100.0, complete, sent);
+        fprintf(stdout, "Latency (us):    p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+                hist_percentile(hist, received, 0.5) / 1e3, hist_percentile(hist, received, 0.99) / 1e3,
+                hist_percentile(hist, received, 0.999) / 1e3, max_ns / 1e3);
+        if (port_count > 1)
+            fprintf(stdout, "Cross-node (us): p50 %.1f  p99 %.1f  p99.9 %.1f  over %lu deliveries between %d nodes\n",
+                    hist_percentile(cross_hist, cross, 0.5) / 1e3, hist_percentile(cross_hist, cross, 0.99) / 1e3,
+                    hist_percentile(cross_hist, cross, 0.999) / 1e3, cross, port_count);
+        if (zip)
+            fprintf(stdout, "Compressed:      %lu of %lu deliveries, %lu bytes received\n", deflated, received, bytes_in);
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-n connections] [-t threads] [-r msgs/s] [-d seconds] [-s size] [-p port[,port...]] [-z] [-j] [host]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    struct rlimit rl;
+    int opt, i, one = 1;
+    char *end;
+
+    while ((opt = getopt(argc, argv, "n:t:r:d:s:p:zj")) != -1) {
+        switch (opt) {
+            case 'n': conn_count = atoi(optarg); break;
+            case 't': worker_count = atoi(optarg); break;
+            case 'r': rate = atof(optarg); break;
+            case 'd': duration = atof(optarg); break;
+            case 's': msg_size = atoi(optarg); break;
+            case 'p':                           /* One port per node of a federation */
+                for (end = optarg, port_count = 0; *end && port_count < LOADGEN_MAX_PORTS; port_count++) {
+                    ports[port_count] = strtol(end, &end, 10);
+                    if (*end == ',')
+                        end++;
+                    else if (*end)
+                        usage(argv[0]);
+                }
+                break;
+            case 'z': zip = 1; break;
+            case 'j': json = 1; break;
+            default: usage(argv[0]);
+        }
+    }
+    host = optind < argc ? argv[optind] : "127.0.0.1";
+    if (port_count < 1 || conn_count < 2 || worker_count < 1 || worker_count > LOADGEN_MAX_THREADS || worker_count > conn_count
+            || rate <= 0 || duration <= 0 || msg_size < 48 || msg_size > BUFFER_SIZE)
+        usage(argv[0]);
+
+    signal(SIGPIPE, SIG_IGN);
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;                      /* Thousands of connections need descriptors */
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    seq_max = (unsigned long)(rate * duration) + 1;
+    if (!(fanout = (unsigned int *)calloc(seq_max, sizeof(unsigned int)))) {
+        perror("calloc()"); exit(EXIT_FAILURE);
+    }
+
+    fprintf(stderr, "Opening %d connections to %s:%d%s ...\n", conn_count, host, ports[0], port_count > 1 ? " and other nodes" : "");
+    for (i = 0; i < worker_count; i++) {
+        worker_t *w = &workers[i];
+        int j;
+
+        w->count = conn_count / worker_count + (i < conn_count % worker_count ? 1 : 0);
+        w->rate = rate * w->count / conn_count;
+        if (!(w->conns = (conn_t *)calloc(w->count, sizeof(conn_t))) || (w->epfd = epoll_create1(0)) == -1
+                || (zip && inflateInit2(&w->inflater, -15) != Z_OK)) {
+            perror("worker"); exit(EXIT_FAILURE);
+        }
+        for (j = 0; j < w->count; j++) {
+            conn_t *c = &w->conns[j];
+            struct epoll_event ev;
+
+            c->id = i * conn_count + j;
+            if ((c->sock = proto_connect(host, ports[c->id % port_count])) == -1
+                    || (zip ? proto_join_zip(c->sock, NULL) : proto_join(c->sock, NULL)) == -1) {
+                fprintf(stderr, "Unable to join connection %d\n", c->id); exit(EXIT_FAILURE);
+            }
+            fcntl(c->sock, F_SETFL, fcntl(c->sock, F_GETFL) | O_NONBLOCK);
+            setsockopt(c->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));  /* Measure the server, not Nagle */
+            frame_init(&c->in, LOADGEN_READ_SIZE, c->inbuf, sizeof(c->inbuf));
+            ev.events = EPOLLIN;
+            ev.data.ptr = c;
+            epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->sock, &ev);
+        }
+    }
+
+    fprintf(stderr, "Sending %.0f messages/s for %.1f seconds ...\n", rate, duration);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < worker_count; i++) {
+        if (pthread_create(&workers[i].tid, NULL, worker_func, &workers[i]) != 0) {
+            perror("pthread_create()"); exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i < worker_count; i++)
+        pthread_join(workers[i].tid, NULL);
+    report(duration);
+    return EXIT_SUCCESS;
+}
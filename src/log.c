@@ -0,0 +1,221 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE 1
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define LOG_MAX_THREADS 256
+#define LOG_RING_SIZE 512               /* Lines per thread, a power of two */
+#define LOG_LINE_SIZE 1024
+#define LOG_OUT_SIZE 65536
+#define LOG_IDLE_NS 5000000             /* Writer nap when all rings are empty */
+
+typedef struct log_line {
+    int level;
+    int len;
+    char text[LOG_LINE_SIZE];
+} log_line_t;
+
+/* Single producer, the owning thread, and single consumer, the writer */
+typedef struct log_ring {
+    unsigned long _head, _tail;
+    unsigned long dropped;
+    log_line_t lines[LOG_RING_SIZE];
+} log_ring_t;
+
+typedef struct log_out {
+    int fd;
+    size_t len;
+    char buf[LOG_OUT_SIZE];
+} log_out_t;
+
+int log_level = LOG_LEVEL_INFO;
+
+static __thread log_ring_t *log_ring;
+static log_ring_t *log_rings[LOG_MAX_THREADS];
+static int log_ring_count = 0;
+static unsigned long log_reported = 0;
+static pthread_mutex_t log_drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static log_out_t log_stdout = { STDOUT_FILENO, 0, { 0 } };
+static log_out_t log_stderr = { STDERR_FILENO, 0, { 0 } };
+
+static const char *log_names[] = { "error", "warn", "info", "debug", "trace" };
+
+/* Registers the ring of the calling thread on its first log line */
+static log_ring_t *log_thread_ring(void)
+{
+    int index;
+
+    if (log_ring)
+        return log_ring;
+    if ((index = __atomic_fetch_add(&log_ring_count, 1, __ATOMIC_RELAXED)) >= LOG_MAX_THREADS)
+        return NULL;
+    if (!(log_ring = (log_ring_t *)calloc(1, sizeof(log_ring_t))))
+        return NULL;
+    __atomic_store_n(&log_rings[index], log_ring, __ATOMIC_RELEASE);
+    return log_ring;
+}
+
+static void log_vwrite(int level, const char *fmt, va_list ap)
+{
+    log_ring_t *ring = log_thread_ring();
+    log_line_t *line;
+    unsigned long tail;
+    int len;
+
+    if (!ring)
+        return;
+    tail = ring->_tail;
+    if (tail - __atomic_load_n(&ring->_head, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    line = &ring->lines[tail & (LOG_RING_SIZE - 1)];
+    line->level = level;
+    if ((len = vsnprintf(line->text, LOG_LINE_SIZE, fmt, ap)) < 0)
+        len = 0;
+    if (len >= LOG_LINE_SIZE) {                 /* Truncated, keep the line break */
+        len = LOG_LINE_SIZE - 1;
+        line->text[len - 1] = '\n';
+    }
+    line->len = len;
+    __atomic_store_n(&ring->_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void log_out_flush(log_out_t *out)
+{
+    size_t off = 0;
+    ssize_t written;
+
+    while (off < out->len && (written = write(out->fd, out->buf + off, out->len - off)) > 0)
+        off += written;
+    out->len = 0;
+}
+
+static void log_out_append(log_out_t *out, const char *text, size_t len)
+{
+    if (out->len + len > LOG_OUT_SIZE)
+        log_out_flush(out);
+    memcpy(out->buf + out->len, text, len);
+    out->len += len;
+}
+
+/* Move everything logged so far to the output, returns the number of lines */
+static unsigned long log_drain(void)
+{
+    unsigned long lines = 0, dropped = 0, head;
+    int i, count = __atomic_load_n(&log_ring_count, __ATOMIC_ACQUIRE);
+    char text[64];
+
+    pthread_mutex_lock(&log_drain_mutex);
+    for (i = 0; i < count && i < LOG_MAX_THREADS; i++) {
+        log_ring_t *ring = __atomic_load_n(&log_rings[i], __ATOMIC_ACQUIRE);
+
+        if (!ring)
+            continue;
+        for (head = ring->_head; head != __atomic_load_n(&ring->_tail, __ATOMIC_ACQUIRE); head++, lines++) {
+            log_line_t *line = &ring->lines[head & (LOG_RING_SIZE - 1)];
+
+            log_out_append(line->level <= LOG_LEVEL_WARN ? &log_stderr : &log_stdout, line->text, line->len);
+            __atomic_store_n(&ring->_head, head + 1, __ATOMIC_RELEASE);
+        }
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+    if (dropped != log_reported) {
+        sprintf(text, "Log: dropped %lu lines, logging can't keep up\n", dropped - log_reported);
+        log_out_append(&log_stderr, text, strlen(text));
+        log_reported = dropped;
+    }
+    log_out_flush(&log_stdout);
+    log_out_flush(&log_stderr);
+    pthread_mutex_unlock(&log_drain_mutex);
+    return lines;
+}
+
+static void *log_thread(void *arg)
+{
+    struct timespec idle;
+
+    idle.tv_sec = 0;
+    idle.tv_nsec = LOG_IDLE_NS;
+    while (1) {
+        if (log_drain() == 0)
+            nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+/* Start the background writer */
+int log_init(void)
+{
+    pthread_t tid;
+
+    if (pthread_create(&tid, NULL, log_thread, NULL) != 0)
+        return -1;
+    pthread_detach(tid);
+    return 0;
+}
+
+/* Write out everything logged so far, eg. before exiting */
+void log_flush(void)
+{
+    log_drain();
+}
+
+/* Returns the level for a name like "info" or -1 */
+int log_parse_level(const char *name)
+{
+    int i;
+
+    for (i = LOG_LEVEL_ERROR; i <= LOG_LEVEL_TRACE; i++) {
+        if (strcmp(name, log_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+#define LOG_FUNC(name, level) \
+void name(const char *fmt, ...) \
+{ \
+    va_list ap; \
+    va_start(ap, fmt); \
+    log_vwrite(level, fmt, ap); \
+    va_end(ap); \
+}
+
+LOG_FUNC(log_error, LOG_LEVEL_ERROR)
+LOG_FUNC(log_warn, LOG_LEVEL_WARN)
+LOG_FUNC(log_info, LOG_LEVEL_INFO)
+LOG_FUNC(log_debug, LOG_LEVEL_DEBUG)
+LOG_FUNC(log_trace, LOG_LEVEL_TRACE)
@@ -0,0 +1,69 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef LOG_H
+#define LOG_H
+
+/*
+ * Leveled asynchronous logging. Every thread formats into a lock-free
+ * ring of its own which a background thread drains to stdout, errors
+ * and warnings to stderr. Nothing blocks: a full ring drops the line and
+ * counts it. Levels above LOG_COMPILE_LEVEL are compiled out, the others
+ * cost one comparison while disabled at runtime. The macros take the
+ * printf() arguments in double parentheses, eg. LOG_INFO(("%d\n", i)).
+ */
+enum log_level {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_TRACE                 /* Every single message, off by default */
+};
+
+#ifndef LOG_COMPILE_LEVEL
+#   define LOG_COMPILE_LEVEL LOG_LEVEL_TRACE
+#endif
+
+extern int log_level;
+
+#define log_enabled(level) ((level) <= LOG_COMPILE_LEVEL && (level) <= log_level)
+
+#define LOG_ERROR(args) do { if (log_enabled(LOG_LEVEL_ERROR)) log_error args; } while (0)
+#define LOG_WARN(args)  do { if (log_enabled(LOG_LEVEL_WARN))  log_warn args;  } while (0)
+#define LOG_INFO(args)  do { if (log_enabled(LOG_LEVEL_INFO))  log_info args;  } while (0)
+#define LOG_DEBUG(args) do { if (log_enabled(LOG_LEVEL_DEBUG)) log_debug args; } while (0)
+#define LOG_TRACE(args) do { if (log_enabled(LOG_LEVEL_TRACE)) log_trace args; } while (0)
+
+int log_init(void);
+void log_flush(void);
+int log_parse_level(const char *name);
+
+void log_error(const char *fmt, ...);
+void log_warn(const char *fmt, ...);
+void log_info(const char *fmt, ...);
+void log_debug(const char *fmt, ...);
+void log_trace(const char *fmt, ...);
+
+#endif
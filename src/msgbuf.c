@@ -0,0 +1,106 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <string.h>
+#include <unistd.h>
+
+#include "msgbuf.h"
+
+msgbuf_t *msgbuf_new(slab_t *slab, size_t len)
+{
+    msgbuf_t *buf = (msgbuf_t *)slab_alloc(slab, sizeof(msgbuf_t) + len);
+
+    if (!buf)
+        return NULL;
+    buf->_refs = 1;
+    buf->len = len;
+    buf->topic = buf->label = NULL;
+    buf->topic_len = buf->label_len = 0;
+    buf->direct = buf->binary = 0;
+    buf->sender = 0;
+    buf->payload = 0;
+    buf->payload_len = len;
+    buf->seq = 0;
+    buf->trace = buf->read_at = buf->forwarded_at = 0;
+    buf->origin = buf->origin_seq = 0;
+    buf->via = NULL;
+    buf->deflated = NULL;
+    buf->fd = -1;
+    buf->offset = 0;
+    buf->data[len] = '\0';
+    return buf;
+}
+
+/* Refer to len bytes of fd at offset, taking over the descriptor */
+msgbuf_t *msgbuf_new_file(slab_t *slab, int fd, off_t offset, size_t len)
+{
+    msgbuf_t *buf = msgbuf_new(slab, 0);
+
+    if (!buf)
+        return NULL;
+    buf->fd = fd;
+    buf->offset = offset;
+    buf->len = buf->payload_len = len;
+    return buf;
+}
+
+msgbuf_t *msgbuf_new_message(slab_t *slab, size_t len, const char *topic, size_t topic_len, const char *label, size_t label_len)
+{
+    msgbuf_t *buf = msgbuf_new(slab, len + 1 + topic_len + 1 + label_len);
+    char *copy;
+
+    if (!buf)
+        return NULL;
+    buf->len = buf->payload_len = len;
+    buf->data[len] = '\0';
+    copy = buf->data + len + 1;                 /* Behind the data, so they are never written */
+    memcpy(copy, topic, topic_len);
+    copy[topic_len] = '\0';
+    buf->topic = copy;
+    buf->topic_len = topic_len;
+    copy += topic_len + 1;
+    memcpy(copy, label, label_len);
+    copy[label_len] = '\0';
+    buf->label = copy;
+    buf->label_len = label_len;
+    return buf;
+}
+
+msgbuf_t *msgbuf_ref(msgbuf_t *buf)
+{
+    if (buf)
+        __sync_add_and_fetch(&buf->_refs, 1);
+    return buf;
+}
+
+void msgbuf_unref(msgbuf_t *buf)
+{
+    if (buf && __sync_sub_and_fetch(&buf->_refs, 1) == 0) {
+        if (buf->fd != -1)
+            close(buf->fd);
+        msgbuf_unref(buf->deflated);
+        slab_free(buf);
+    }
+}
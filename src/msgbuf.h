@@ -0,0 +1,75 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef MSGBUF_H
+#define MSGBUF_H
+
+#include <sys/types.h>
+#include <stddef.h>
+
+#include "pool.h"
+
+/*
+ * Reference counted buffer holding a message in its wire form. A
+ * broadcast formats the message once and every recipient queues a
+ * reference to the same buffer, the last one to drop it returns it to
+ * the slab it came from, which may belong to another thread. A message
+ * may carry a topic, eg. the room it was sent to, and the name of its
+ * sender, both stored behind the data, so that it can be routed and
+ * put into another wire form without parsing it. A direct message names
+ * its recipient as topic instead. A buffer may also stand for a range of
+ * a file instead of holding data, the descriptor is closed with it.
+ * A compressed form made for the clients asking for it is shared just
+ * the same and dropped with the buffer.
+ */
+typedef struct msgbuf {
+    int _refs;
+    size_t len;
+    unsigned long trace;                /* Id of a message sampled for tracing or 0, see trace.h */
+    unsigned long read_at, forwarded_at;  /* When it was read and handed to other shards, if traced */
+    const char *topic;                  /* NUL terminated or NULL */
+    size_t topic_len;
+    int direct;                         /* Topic is a recipient, not a room */
+    int binary;                         /* Data is a binary frame, not a text line */
+    unsigned long sender;               /* Id of the sending client */
+    const char *label;                  /* Name of the sender, NUL terminated or NULL */
+    size_t label_len;
+    size_t payload, payload_len;        /* What the sender sent, offset into data */
+    unsigned long seq;                  /* Position in the history or 0 */
+    unsigned long origin, origin_seq;   /* Where it entered the federation and its number there, see relay.h */
+    const void *via;                    /* Peer link it was relayed over, not to be relayed back */
+    struct msgbuf *deflated;            /* Compressed frame of the payload for clients asking for it or NULL */
+    int fd;                             /* File holding the data or -1 */
+    off_t offset;                       /* Of the data within the file */
+    char data[1];
+} msgbuf_t;
+
+msgbuf_t *msgbuf_new(slab_t *slab, size_t len);
+msgbuf_t *msgbuf_new_file(slab_t *slab, int fd, off_t offset, size_t len);
+msgbuf_t *msgbuf_new_message(slab_t *slab, size_t len, const char *topic, size_t topic_len, const char *label, size_t label_len);
+msgbuf_t *msgbuf_ref(msgbuf_t *buf);
+void msgbuf_unref(msgbuf_t *buf);
+
+#endif
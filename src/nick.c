@@ -0,0 +1,185 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE 1
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "nick.h"
+
+#define NICK_BUCKETS 256
+
+/* FNV-1a */
+static unsigned long nick_hash(const char *name, size_t len)
+{
+    unsigned long hash = 2166136261UL;
+
+    while (len--)
+        hash = (hash ^ (unsigned char)*name++) * 16777619UL;
+    return hash;
+}
+
+int nick_table_init(nick_table_t *table)
+{
+    if (!table)
+        return -1;
+    if (!(table->_buckets = (nick_entry_t **)calloc(NICK_BUCKETS, sizeof(nick_entry_t *))))
+        return -1;
+    table->_mask = NICK_BUCKETS - 1;
+    table->count = 0;
+    pthread_rwlock_init(&table->_lock, NULL);
+    return 0;
+}
+
+/* Entries belong to their owners and are left alone */
+void nick_table_destroy(nick_table_t *table)
+{
+    if (!table || !table->_buckets)
+        return;
+    free(table->_buckets);
+    table->_buckets = NULL;
+    pthread_rwlock_destroy(&table->_lock);
+}
+
+/* Nicknames are up to NICK_SIZE letters, digits, dashes and underscores */
+int nick_valid(const char *name, size_t len)
+{
+    size_t i;
+
+    if (!name || len == 0 || len > NICK_SIZE)
+        return 0;
+    for (i = 0; i < len; i++) {
+        char c = name[i];
+
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_'))
+            return 0;
+    }
+    return 1;
+}
+
+static nick_entry_t *nick_find(nick_table_t *table, const char *name, size_t len, unsigned long hash)
+{
+    nick_entry_t *entry;
+
+    for (entry = table->_buckets[hash & table->_mask]; entry; entry = entry->_next)
+        if (entry->hash == hash && entry->len == len && memcmp(entry->name, name, len) == 0)
+            return entry;
+    return NULL;
+}
+
+/* Double the buckets once there are more entries than buckets, write lock held */
+static void nick_grow(nick_table_t *table)
+{
+    unsigned long i, mask = table->_mask * 2 + 1;
+    nick_entry_t **buckets = (nick_entry_t **)calloc(mask + 1, sizeof(nick_entry_t *));
+
+    if (!buckets)
+        return;                                 /* Longer chains, but still working */
+    for (i = 0; i <= table->_mask; i++) {
+        while (table->_buckets[i]) {
+            nick_entry_t *entry = table->_buckets[i];
+
+            table->_buckets[i] = entry->_next;
+            entry->_next = buckets[entry->hash & mask];
+            buckets[entry->hash & mask] = entry;
+        }
+    }
+    free(table->_buckets);
+    table->_buckets = buckets;
+    table->_mask = mask;
+}
+
+/* Take entry out of its bucket, write lock held */
+static void nick_unlink(nick_table_t *table, nick_entry_t *entry)
+{
+    nick_entry_t **link;
+
+    if (entry->len == 0)
+        return;
+    for (link = &table->_buckets[entry->hash & table->_mask]; *link && *link != entry; link = &(*link)->_next)
+        ;
+    if (*link) {
+        *link = entry->_next;
+        table->count--;
+    }
+    entry->len = 0;
+}
+
+/*
+ * Register entry under name, replacing the name it had before. Returns
+ * -1 and keeps the old name if the new one is invalid or taken.
+ */
+int nick_register(nick_table_t *table, nick_entry_t *entry, const char *name, size_t len)
+{
+    unsigned long hash;
+
+    if (!table || !entry || !nick_valid(name, len))
+        return -1;
+    hash = nick_hash(name, len);
+    pthread_rwlock_wrlock(&table->_lock);
+    if (nick_find(table, name, len, hash)) {
+        pthread_rwlock_unlock(&table->_lock);
+        return -1;
+    }
+    nick_unlink(table, entry);
+    memcpy(entry->name, name, len);
+    entry->name[len] = '\0';
+    entry->len = len;
+    entry->hash = hash;
+    entry->_next = table->_buckets[hash & table->_mask];
+    table->_buckets[hash & table->_mask] = entry;
+    if ((unsigned long)++table->count > table->_mask + 1)
+        nick_grow(table);
+    pthread_rwlock_unlock(&table->_lock);
+    return 0;
+}
+
+void nick_unregister(nick_table_t *table, nick_entry_t *entry)
+{
+    if (!table || !entry || entry->len == 0)
+        return;
+    pthread_rwlock_wrlock(&table->_lock);
+    nick_unlink(table, entry);
+    pthread_rwlock_unlock(&table->_lock);
+}
+
+/* Returns 0 and the owner of name, or -1 if nobody has it */
+int nick_lookup(nick_table_t *table, const char *name, size_t len, void **data, int *shard)
+{
+    nick_entry_t *entry;
+
+    if (!table || !name || len == 0 || len > NICK_SIZE)
+        return -1;
+    pthread_rwlock_rdlock(&table->_lock);
+    if ((entry = nick_find(table, name, len, nick_hash(name, len)))) {
+        if (data)
+            *data = entry->data;
+        if (shard)
+            *shard = entry->shard;
+    }
+    pthread_rwlock_unlock(&table->_lock);
+    return entry ? 0 : -1;
+}
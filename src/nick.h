@@ -0,0 +1,64 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef NICK_H
+#define NICK_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define NICK_SIZE 16
+
+/*
+ * Server wide index of nicknames, hashed by name. Entries are embedded
+ * in their owners and registered under a write lock, lookups share a
+ * read lock. A lookup copies owner and shard out, the owner pointer
+ * may only be used by the thread that unregisters it.
+ */
+typedef struct nick_entry {
+    char name[NICK_SIZE + 1];
+    size_t len;                         /* Zero if not registered */
+    unsigned long hash;
+    void *data;
+    int shard;                          /* Event loop owning data */
+    struct nick_entry *_next;           /* Next entry in the same bucket */
+} nick_entry_t;
+
+typedef struct nick_table {
+    int count;
+    unsigned long _mask;
+    struct nick_entry **_buckets;
+    pthread_rwlock_t _lock;
+} nick_table_t;
+
+int nick_table_init(nick_table_t *table);
+void nick_table_destroy(nick_table_t *table);
+
+int nick_valid(const char *name, size_t len);
+int nick_register(nick_table_t *table, nick_entry_t *entry, const char *name, size_t len);
+void nick_unregister(nick_table_t *table, nick_entry_t *entry);
+int nick_lookup(nick_table_t *table, const char *name, size_t len, void **data, int *shard);
+
+#endif
@@ -0,0 +1,330 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE 1
+
+#include "outq.h"
+
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void outq_pop(outq_t *q)
+{
+    msgbuf_t *buf = q->_ring[q->_head];
+
+    q->bytes -= buf->len - q->_off;
+    q->_head = (q->_head + 1) % q->_size;
+    q->count--;
+    q->_off = 0;
+    msgbuf_unref(buf);
+}
+
+void outq_init(outq_t *q, size_t high, size_t low)
+{
+    if (!q)
+        return;
+    q->_ring = q->_inline;
+    q->_head = 0;
+    q->_size = OUTQ_INLINE;
+    q->_off = 0;
+    q->pinned = 0;
+    q->count = 0;
+    q->bytes = 0;
+    q->high = high;
+    q->low = low < high ? low : high;
+    q->congested = 0;
+    q->drops = 0;
+    q->calls = q->sent = 0;
+    q->peak = 0;
+    q->traced = q->traced_at = 0;
+}
+
+void outq_destroy(outq_t *q)
+{
+    if (!q)
+        return;
+    outq_clear(q);
+    if (q->_ring != q->_inline)
+        free(q->_ring);
+    q->_ring = q->_inline;
+    q->_size = OUTQ_INLINE;
+}
+
+/*
+ * Queue a reference to buf. Returns 0 if it was queued, 1 if the policy
+ * dropped a message and -1 if the connection should be closed.
+ */
+int outq_push(outq_t *q, msgbuf_t *buf, outq_policy_t policy)
+{
+    int ret = 0;
+
+    if (!q || !buf)
+        return -1;
+    if (q->congested || q->bytes + buf->len > q->high) {
+        q->congested = 1;
+        switch (policy) {
+            case OUTQ_DISCONNECT:
+                return -1;
+            case OUTQ_DROP_NEWEST:
+                q->drops++;
+                return 1;
+            case OUTQ_DROP_OLDEST: {                /* Never drop a partially written head or pinned buffers */
+                unsigned int keep = q->pinned > 0 ? q->pinned : (q->_off ? 1u : 0u);
+
+                while (q->count > keep && q->bytes + buf->len > q->high) {
+                    unsigned int victim = (q->_head + keep) % q->_size, i;
+
+                    q->bytes -= q->_ring[victim]->len;
+                    msgbuf_unref(q->_ring[victim]);
+                    for (i = victim; i != (q->_head + q->count - 1) % q->_size; i = (i + 1) % q->_size)
+                        q->_ring[i] = q->_ring[(i + 1) % q->_size];
+                    q->count--;
+                    q->drops++;
+                    ret = 1;
+                }
+                break;
+            }
+        }
+    }
+    if (q->count == q->_size) {                     /* Ring is full, double it */
+        unsigned int i, size = q->_size * 2;
+        msgbuf_t **ring = (msgbuf_t **)malloc(size * sizeof(msgbuf_t *));
+
+        if (!ring)
+            return -1;
+        for (i = 0; i < q->count; i++)
+            ring[i] = q->_ring[(q->_head + i) % q->_size];
+        if (q->_ring != q->_inline)
+            free(q->_ring);
+        q->_ring = ring;
+        q->_head = 0;
+        q->_size = size;
+    }
+    q->_ring[(q->_head + q->count) % q->_size] = msgbuf_ref(buf);
+    q->count++;
+    q->bytes += buf->len;
+    if (q->bytes > q->peak)
+        q->peak = q->bytes;
+    return ret;
+}
+
+/*
+ * Describe up to max buffers from the head of the queue in iov, stopping
+ * at the first file range. They stay pinned, neither dropped nor freed,
+ * until outq_complete() so that an asynchronous write may refer to them.
+ * Returns the number of vectors filled in, 0 if the head is a file range.
+ */
+unsigned int outq_prepare(outq_t *q, struct iovec *iov, unsigned int max)
+{
+    unsigned int i, n;
+
+    if (!q || q->pinned > 0)
+        return 0;
+    n = q->count < max ? q->count : max;
+    for (i = 0; i < n; i++) {
+        msgbuf_t *buf = q->_ring[(q->_head + i) % q->_size];
+
+        if (buf->fd != -1)
+            break;
+        iov[i].iov_base = buf->data;
+        iov[i].iov_len = buf->len;
+    }
+    if (i > 0) {
+        iov[0].iov_base = (char *)iov[0].iov_base + q->_off;
+        iov[0].iov_len -= q->_off;
+    }
+    q->pinned = i;
+    return i;
+}
+
+/* Account for written bytes from the head of the queue and unpin it */
+void outq_complete(outq_t *q, size_t written)
+{
+    if (!q)
+        return;
+    q->pinned = 0;
+    while (written > 0 && q->count > 0) {
+        msgbuf_t *buf = q->_ring[q->_head];
+        size_t left = buf->len - q->_off;
+
+        if (written < left) {
+            q->_off += written;
+            q->bytes -= written;
+            break;
+        }
+        written -= left;
+        if (buf->trace) {
+            q->traced = buf->trace;
+            q->traced_at = buf->read_at;
+        }
+        outq_pop(q);
+        q->sent++;
+    }
+    if (q->congested && q->bytes <= q->low)
+        q->congested = 0;
+}
+
+/*
+ * Write as much of the queue as the socket fd takes without blocking,
+ * gathering up to OUTQ_IOV_MAX buffers per sendmsg(). If more is queued
+ * than one call takes the kernel is told with MSG_MORE, so it doesn't
+ * push out a partial segment in between. Buffers standing for file
+ * ranges go out with sendfile() instead. Returns the number of bytes
+ * written or -1 if the connection is broken.
+ */
+ssize_t outq_write(outq_t *q, int fd)
+{
+    struct iovec iov[OUTQ_IOV_MAX];
+    struct msghdr msg;
+    ssize_t written, total = 0;
+    size_t wanted;
+    unsigned int i, n;
+
+    if (!q)
+        return -1;
+    while (q->count > 0) {
+        msgbuf_t *head = q->_ring[q->_head];
+
+        if (head->fd != -1) {                       /* The kernel copies it from the page cache */
+            off_t offset = head->offset + q->_off;
+
+            wanted = head->len - q->_off;
+            written = sendfile(fd, head->fd, &offset, wanted);
+            if (written == 0) {                     /* File got shorter, nothing more to send */
+                outq_pop(q);
+                continue;
+            }
+        } else {
+            n = outq_prepare(q, iov, OUTQ_IOV_MAX);
+            for (i = 0, wanted = 0; i < n; i++)
+                wanted += iov[i].iov_len;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = n;
+            written = sendmsg(fd, &msg, MSG_NOSIGNAL | (q->count > n ? MSG_MORE : 0));
+            q->pinned = 0;
+        }
+        q->calls++;
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            break;
+        }
+        total += written;
+        wanted -= written;
+        outq_complete(q, written);
+        if (wanted > 0)                             /* Socket buffer is full, wait for EPOLLOUT */
+            break;
+    }
+    if (q->congested && q->bytes <= q->low)
+        q->congested = 0;
+    return total;
+}
+
+/*
+ * Copy up to max bytes from the head of the queue to dst, reading file
+ * ranges, and account for them as written. Returns the number of bytes
+ * copied or -1 if a file couldn't be read.
+ */
+ssize_t outq_take(outq_t *q, char *dst, size_t max)
+{
+    size_t total = 0, len;
+    ssize_t got;
+
+    if (!q || !dst)
+        return -1;
+    while (q->count > 0 && total < max) {
+        msgbuf_t *head = q->_ring[q->_head];
+
+        len = head->len - q->_off < max - total ? head->len - q->_off : max - total;
+        if (head->fd == -1) {
+            memcpy(dst + total, head->data + q->_off, len);
+        } else if ((got = pread(head->fd, dst + total, len, head->offset + q->_off)) == -1) {
+            return -1;
+        } else if (got == 0) {                      /* File got shorter, nothing more to copy */
+            outq_pop(q);
+            continue;
+        } else {
+            len = got;
+        }
+        total += len;
+        outq_complete(q, len);
+    }
+    return total;
+}
+
+/*
+ * Copy the bytes not written yet to dst, which has room for q->bytes,
+ * reading file ranges. Returns how many were copied, less if a file got
+ * shorter, or -1 if a file couldn't be read.
+ */
+ssize_t outq_copy(const outq_t *q, char *dst)
+{
+    size_t off = q->_off, total = 0;
+    unsigned int i;
+    ssize_t got;
+
+    if (!q || !dst)
+        return -1;
+    for (i = 0; i < q->count; i++, off = 0) {
+        msgbuf_t *buf = q->_ring[(q->_head + i) % q->_size];
+
+        if (buf->fd == -1) {
+            memcpy(dst + total, buf->data + off, buf->len - off);
+            total += buf->len - off;
+            continue;
+        }
+        if ((got = pread(buf->fd, dst + total, buf->len - off, buf->offset + off)) == -1)
+            return -1;
+        total += got;
+    }
+    return total;
+}
+
+/* Drop everything queued except for pinned buffers */
+void outq_clear(outq_t *q)
+{
+    if (!q)
+        return;
+    while (q->count > q->pinned) {
+        unsigned int last = (q->_head + q->count - 1) % q->_size;
+        msgbuf_t *buf = q->_ring[last];
+
+        if (q->count == 1) {
+            outq_pop(q);
+            break;
+        }
+        q->bytes -= buf->len;
+        q->count--;
+        msgbuf_unref(buf);
+    }
+}
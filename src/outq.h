@@ -0,0 +1,79 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "msgbuf.h"
+
+/* What to do with a message for a queue that is above its high watermark */
+typedef enum outq_policy {
+    OUTQ_DROP_OLDEST,               /* Make room by dropping queued messages */
+    OUTQ_DROP_NEWEST,               /* Drop the message itself */
+    OUTQ_DISCONNECT                 /* Give up on the connection */
+} outq_policy_t;
+
+/*
+ * Bounded queue of outbound message buffers of one connection. Once the
+ * queued bytes exceed the high watermark the queue counts as congested
+ * until it drained below the low watermark, and the policy applies to
+ * every message pushed in between.
+ */
+#define OUTQ_INLINE 16
+#define OUTQ_IOV_MAX 64             /* Buffers gathered per write */
+
+typedef struct outq {
+    msgbuf_t **_ring;
+    msgbuf_t *_inline[OUTQ_INLINE];  /* Initial ring, avoids allocating for short queues */
+    unsigned int _head, _size;
+    size_t _off;                    /* Bytes of the head buffer already written */
+    unsigned int pinned;            /* Buffers at the head an asynchronous write refers to */
+    unsigned int count;             /* Number of queued buffers */
+    size_t bytes;                   /* Queued bytes not yet written */
+    size_t high, low;               /* Watermarks */
+    int congested;
+    unsigned long drops;            /* Messages dropped by the policy */
+    unsigned long calls;            /* System calls made by outq_write() */
+    unsigned long sent;             /* Buffers written completely */
+    size_t peak;                    /* Highest number of queued bytes seen */
+    unsigned long traced;           /* Last traced buffer written completely or 0, see msgbuf.h */
+    unsigned long traced_at;        /* When its message was read */
+} outq_t;
+
+void outq_init(outq_t *q, size_t high, size_t low);
+void outq_destroy(outq_t *q);
+
+int outq_push(outq_t *q, msgbuf_t *buf, outq_policy_t policy);
+ssize_t outq_write(outq_t *q, int fd);
+unsigned int outq_prepare(outq_t *q, struct iovec *iov, unsigned int max);
+void outq_complete(outq_t *q, size_t written);
+ssize_t outq_take(outq_t *q, char *dst, size_t max);
+ssize_t outq_copy(const outq_t *q, char *dst);
+void outq_clear(outq_t *q);
+
+#endif
@@ -0,0 +1,180 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "pool.h"
+
+#include <stdlib.h>
+
+/* Header in front of every object, tells pool_free() where it belongs */
+typedef struct pool_object {
+    struct pool *pool;              /* Owning pool, NULL if plainly malloc()ed */
+    struct pool_object *next;       /* Link while the object is free */
+} pool_object_t;
+
+static void pool_release_list(pool_object_t *iter)
+{
+    pool_object_t *next;
+
+    for (; iter; iter = next) {
+        next = iter->next;
+        free(iter);
+    }
+}
+
+void pool_init(pool_t *pool, size_t size)
+{
+    if (!pool)
+        return;
+    pool->size = size;
+    pool->_owner = pthread_self();          /* The calling thread owns the pool */
+    pool->_free = NULL;
+    pool->_remote = NULL;
+#ifdef POOL_STATS
+    pool->hits = pool->misses = 0;
+    pool->used = pool->peak = 0;
+#endif
+}
+
+void pool_destroy(pool_t *pool)
+{
+    if (!pool)
+        return;
+    pool_release_list(pool->_free);
+    pool_release_list(__atomic_exchange_n(&pool->_remote, NULL, __ATOMIC_ACQUIRE));
+    pool->_free = NULL;
+}
+
+void *pool_alloc(pool_t *pool)
+{
+    pool_object_t *obj;
+
+    if (!pool->_free && __atomic_load_n(&pool->_remote, __ATOMIC_RELAXED)) {
+        pool->_free = __atomic_exchange_n(&pool->_remote, NULL, __ATOMIC_ACQUIRE);
+#ifdef POOL_STATS
+        for (obj = pool->_free; obj; obj = obj->next)
+            pool->used--;
+#endif
+    }
+    if ((obj = pool->_free)) {
+        pool->_free = obj->next;
+#ifdef POOL_STATS
+        pool->hits++;
+#endif
+    } else {
+        if (!(obj = (pool_object_t *)malloc(sizeof(pool_object_t) + pool->size)))
+            return NULL;
+        obj->pool = pool;
+#ifdef POOL_STATS
+        pool->misses++;
+#endif
+    }
+#ifdef POOL_STATS
+    if (++pool->used > pool->peak)
+        pool->peak = pool->used;
+#endif
+    return obj + 1;
+}
+
+void pool_free(void *ptr)
+{
+    pool_object_t *obj, *head;
+    pool_t *pool;
+
+    if (!ptr)
+        return;
+    obj = (pool_object_t *)ptr - 1;
+    if (!(pool = obj->pool)) {
+        free(obj);
+    } else if (pthread_equal(pool->_owner, pthread_self())) {
+        obj->next = pool->_free;
+        pool->_free = obj;
+#ifdef POOL_STATS
+        pool->used--;
+#endif
+    } else {                                /* Hand it back to the owner */
+        head = __atomic_load_n(&pool->_remote, __ATOMIC_RELAXED);
+        do {
+            obj->next = head;
+        } while (!__atomic_compare_exchange_n(&pool->_remote, &head, obj, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+}
+
+void slab_init(slab_t *slab)
+{
+    int i;
+
+    if (!slab)
+        return;
+    for (i = 0; i < SLAB_CLASSES; i++)
+        pool_init(&slab->classes[i], (size_t)SLAB_MIN_SIZE << i);
+}
+
+void slab_destroy(slab_t *slab)
+{
+    int i;
+
+    if (!slab)
+        return;
+    for (i = 0; i < SLAB_CLASSES; i++)
+        pool_destroy(&slab->classes[i]);
+}
+
+/* Objects too big for any class, or without a slab, come from malloc() */
+void *slab_alloc(slab_t *slab, size_t size)
+{
+    pool_object_t *obj;
+    int i;
+
+    if (slab) {
+        for (i = 0; i < SLAB_CLASSES; i++) {
+            if (size <= slab->classes[i].size)
+                return pool_alloc(&slab->classes[i]);
+        }
+    }
+    if (!(obj = (pool_object_t *)malloc(sizeof(pool_object_t) + size)))
+        return NULL;
+    obj->pool = NULL;
+    return obj + 1;
+}
+
+#ifdef POOL_STATS
+void pool_print(const pool_t *pool, const char *name, FILE *out)
+{
+    unsigned long total = pool->hits + pool->misses;
+
+    fprintf(out, "Pool %s of %lu byte objects: %lu allocations, %.1f%% hits, %lu in use, peak %lu\n",
+            name, (unsigned long)pool->size, total, total ? 100.0 * pool->hits / total : 0.0, pool->used, pool->peak);
+}
+
+void slab_print(const slab_t *slab, const char *name, FILE *out)
+{
+    int i;
+
+    for (i = 0; i < SLAB_CLASSES; i++) {
+        if (slab->classes[i].hits + slab->classes[i].misses > 0)
+            pool_print(&slab->classes[i], name, out);
+    }
+}
+#endif
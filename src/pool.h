@@ -0,0 +1,73 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+/*
+ * Pool of fixed-size objects owned by one thread. Only the owner
+ * allocates, but any thread may free: objects coming back from other
+ * threads are pushed onto a lock-free stack which the owner takes over
+ * whenever its own free list runs dry. Build with POOL_STATS to count
+ * hits, misses and usage.
+ */
+typedef struct pool {
+    size_t size;                    /* Object size */
+    pthread_t _owner;
+    struct pool_object *_free;      /* Free objects, owner only */
+    struct pool_object *_remote;    /* Objects freed by other threads */
+#ifdef POOL_STATS
+    unsigned long hits, misses;     /* Allocations served from the free lists or by malloc() */
+    unsigned long used, peak;       /* Objects handed out */
+#endif
+} pool_t;
+
+#define SLAB_CLASSES 8
+#define SLAB_MIN_SIZE 32
+
+/* Pools for size classes from SLAB_MIN_SIZE doubling up */
+typedef struct slab {
+    pool_t classes[SLAB_CLASSES];
+} slab_t;
+
+void pool_init(pool_t *pool, size_t size);
+void pool_destroy(pool_t *pool);
+void *pool_alloc(pool_t *pool);
+void pool_free(void *ptr);
+
+void slab_init(slab_t *slab);
+void slab_destroy(slab_t *slab);
+void *slab_alloc(slab_t *slab, size_t size);
+#define slab_free pool_free
+
+#ifdef POOL_STATS
+void pool_print(const pool_t *pool, const char *name, FILE *out);
+void slab_print(const slab_t *slab, const char *name, FILE *out);
+#endif
+
+#endif
@@ -0,0 +1,170 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _POSIX_SOURCE 1
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "frame.h"
+#include "proto.h"
+
+/* Returns a connected socket or -1 */
+int proto_connect(const char *host, int port)
+{
+    struct sockaddr_in addr;
+    struct hostent *he;
+    int sock;
+
+    if ((he = gethostbyname(host)) == NULL)
+        return -1;
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    memcpy(&addr.sin_addr, he->h_addr_list[0], he->h_length);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(struct sockaddr)) == -1) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/*
+ * Send a command and wait for the ACK line, skipping messages that were
+ * still on their way. The reply is read byte by byte so nothing the
+ * server sends after it gets swallowed.
+ */
+static int proto_command(int sock, const char *cmd)
+{
+    char c, line[8];
+    size_t len = 0;
+
+    if (write(sock, cmd, strlen(cmd)) < 0)
+        return -1;
+    while (read(sock, &c, 1) == 1) {
+        if (len < sizeof(line))
+            line[len] = c;
+        len++;
+        if (c == '\n') {
+            if (len == 5 && strncmp(line, "ACK\r\n", 5) == 0)
+                return 0;
+            len = 0;
+        }
+    }
+    return -1;
+}
+
+static int proto_enter(int sock, const char *join, const char *room)
+{
+    char cmd[PROTO_ROOM_SIZE + 16];
+
+    strcpy(cmd, join);
+    if (room) {
+        if (strlen(room) == 0 || strlen(room) > PROTO_ROOM_SIZE)
+            return -1;
+        strcat(cmd, " ");
+        strcat(cmd, room);
+    }
+    strcat(cmd, "\r\n");
+    return proto_command(sock, cmd);
+}
+
+/* Enter the named room or the default one if room is NULL */
+int proto_join(int sock, const char *room)
+{
+    return proto_enter(sock, "JOIN", room);
+}
+
+/* Wait for the ACK frame, skipping the frames before it */
+static int proto_frame_ack(int sock)
+{
+    unsigned char header[FRAME_HEADER_SIZE];
+    unsigned long len;
+    size_t got;
+    ssize_t n;
+    char c;
+
+    while (1) {
+        for (got = 0; got < FRAME_HEADER_SIZE; got += n)
+            if ((n = read(sock, header + got, FRAME_HEADER_SIZE - got)) <= 0)
+                return -1;
+        if (header[0] == FRAME_ACK)
+            return 0;
+        len = (unsigned long)header[6] << 24 | (unsigned long)header[7] << 16 | (unsigned long)header[8] << 8 | header[9];
+        for (; len > 0; len--)                  /* Byte by byte, like proto_command() */
+            if (read(sock, &c, 1) != 1)
+                return -1;
+    }
+}
+
+/* Like proto_join(), but binary frames from then on, long messages compressed */
+int proto_join_zip(int sock, const char *room)
+{
+    char frame[FRAME_HEADER_SIZE + PROTO_ROOM_SIZE];
+    size_t len = room ? strlen(room) : 0;
+
+    if ((room && (len == 0 || len > PROTO_ROOM_SIZE)) || proto_command(sock, "MODE ZIP\r\n") == -1)
+        return -1;
+    frame_header(frame, FRAME_JOIN, 0, len);
+    if (room)
+        memcpy(frame + FRAME_HEADER_SIZE, room, len);
+    if (write(sock, frame, FRAME_HEADER_SIZE + len) < 0)
+        return -1;
+    return proto_frame_ack(sock);
+}
+
+int proto_quit(int sock)
+{
+    return proto_command(sock, "QUIT\r\n");
+}
+
+/*
+ * Whether the server takes a line for a command rather than a message to
+ * the room, like QUIT or NICK name. The line may end in CRLF or LF.
+ */
+int proto_is_command(const char *line, size_t len)
+{
+    static const char *commands[] = { "QUIT", "STATS", "PING", "PONG", "JOIN", "MODE BIN", "MODE ZIP", NULL };
+    static const char *with_arg[] = { "JOIN ", "NICK ", "MSG ", "HISTORY ", "PEER ", NULL };
+    int i;
+
+    if (len > 0 && line[len - 1] == '\n')
+        len--;
+    if (len > 0 && line[len - 1] == '\r')
+        len--;
+    for (i = 0; commands[i]; i++)
+        if (len == strlen(commands[i]) && memcmp(line, commands[i], len) == 0)
+            return 1;
+    for (i = 0; with_arg[i]; i++)
+        if (len > strlen(with_arg[i]) && memcmp(line, with_arg[i], strlen(with_arg[i])) == 0)
+            return 1;
+    return 0;
+}
@@ -0,0 +1,47 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stddef.h>
+
+/*
+ * Client side of the conversation protocol: connect, enter a room with
+ * JOIN [room]\r\n, leave with QUIT\r\n, both answered by ACK\r\n.
+ * MODE ZIP\r\n, only before the first JOIN, switches to binary frames
+ * after the ACK, with long room messages compressed, see frame.h and
+ * zip.h. Any other line is a message to the room, unless it looks like
+ * a command, see proto_is_command().
+ */
+#define PROTO_ROOM_SIZE 32
+
+int proto_connect(const char *host, int port);
+int proto_join(int sock, const char *room);
+int proto_join_zip(int sock, const char *room);
+int proto_quit(int sock);
+int proto_is_command(const char *line, size_t len);
+
+#endif
@@ -0,0 +1,148 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "registry.h"
+
+#include <stdlib.h>
+
+/*
+ * Walks announce themselves in the reader counter of the current epoch
+ * parity. The epoch only advances once the other parity has drained, so
+ * at any time walks belong to the current or the previous epoch. An entry
+ * removed during the previous epoch can therefore be released as soon as
+ * the counter of that parity reaches zero, see registry_advance().
+ */
+static unsigned long registry_enter(registry_t *reg)
+{
+    unsigned long epoch;
+
+    while (1) {
+        epoch = __atomic_load_n(&reg->_epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&reg->_readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&reg->_epoch, __ATOMIC_SEQ_CST) == epoch)
+            return epoch;
+        __atomic_sub_fetch(&reg->_readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/* Must be called with the mutex held */
+static void registry_advance(registry_t *reg)
+{
+    int prev = (reg->_epoch + 1) & 1;
+    registry_entry_t *iter, *next;
+
+    if (__atomic_load_n(&reg->_readers[prev], __ATOMIC_SEQ_CST) != 0)
+        return;
+    for (iter = reg->_limbo[prev]; iter; iter = next) {
+        next = iter->_retired;
+        if (reg->_release)
+            reg->_release(iter);
+    }
+    __atomic_store_n(&reg->_limbo[prev], NULL, __ATOMIC_RELAXED);   /* Walks peek at it, see registry_leave() */
+    __atomic_add_fetch(&reg->_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+static void registry_leave(registry_t *reg, unsigned long epoch)
+{
+    __atomic_sub_fetch(&reg->_readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+    if ((__atomic_load_n(&reg->_limbo[0], __ATOMIC_RELAXED) || __atomic_load_n(&reg->_limbo[1], __ATOMIC_RELAXED))
+            && pthread_mutex_trylock(&reg->_mutex) == 0) {
+        registry_advance(reg);                  /* Release what this walk may have held back */
+        pthread_mutex_unlock(&reg->_mutex);
+    }
+}
+
+void registry_init(registry_t *reg, void (*release)(registry_entry_t *))
+{
+    if (!reg)
+        return;
+    pthread_mutex_init(&reg->_mutex, NULL);
+    reg->_size = 0;
+    reg->_head._next = reg->_head._prev = &reg->_head;
+    reg->_head.data = NULL;
+    reg->_epoch = 0;
+    reg->_readers[0] = reg->_readers[1] = 0;
+    reg->_limbo[0] = reg->_limbo[1] = NULL;
+    reg->_release = release;
+}
+
+void registry_destroy(registry_t *reg)
+{
+    if (!reg)
+        return;
+    pthread_mutex_lock(&reg->_mutex);
+    registry_advance(reg);                      /* Twice to release both epochs */
+    registry_advance(reg);
+    pthread_mutex_unlock(&reg->_mutex);
+    pthread_mutex_destroy(&reg->_mutex);
+}
+
+void registry_add(registry_t *reg, registry_entry_t *entry)
+{
+    if (!reg || !entry)
+        return;
+    pthread_mutex_lock(&reg->_mutex);
+    entry->_prev = &reg->_head;
+    entry->_next = reg->_head._next;
+    entry->_retired = NULL;
+    reg->_head._next->_prev = entry;
+    __atomic_store_n(&reg->_head._next, entry, __ATOMIC_RELEASE);   /* Publish fully linked entry to walks */
+    __atomic_store_n(&reg->_size, reg->_size + 1, __ATOMIC_RELAXED);
+    registry_advance(reg);
+    pthread_mutex_unlock(&reg->_mutex);
+}
+
+void registry_remove(registry_t *reg, registry_entry_t *entry)
+{
+    if (!reg || !entry)
+        return;
+    pthread_mutex_lock(&reg->_mutex);
+    entry->_next->_prev = entry->_prev;         /* Walks standing on entry can still follow its _next */
+    __atomic_store_n(&entry->_prev->_next, entry->_next, __ATOMIC_RELEASE);
+    __atomic_store_n(&reg->_size, reg->_size - 1, __ATOMIC_RELAXED);
+    entry->_retired = reg->_limbo[reg->_epoch & 1];
+    __atomic_store_n(&reg->_limbo[reg->_epoch & 1], entry, __ATOMIC_RELAXED);
+    registry_advance(reg);
+    pthread_mutex_unlock(&reg->_mutex);
+}
+
+void registry_apply(registry_t *reg, void (*callback)(registry_entry_t *, void *), void *data)
+{
+    registry_entry_t *iter;
+    unsigned long epoch;
+
+    if (!reg || !callback)
+        return;
+    epoch = registry_enter(reg);
+    for (iter = __atomic_load_n(&reg->_head._next, __ATOMIC_ACQUIRE); iter != &reg->_head;
+            iter = __atomic_load_n(&iter->_next, __ATOMIC_ACQUIRE))
+        callback(iter, data);
+    registry_leave(reg, epoch);
+}
+
+int registry_size(registry_t *reg)
+{
+    return reg ? __atomic_load_n(&reg->_size, __ATOMIC_RELAXED) : 0;
+}
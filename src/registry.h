@@ -0,0 +1,61 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <pthread.h>
+
+/*
+ * Intrusive doubly linked registry. Adding and removing are O(1) and
+ * serialized by a mutex, while registry_apply() walks the entries
+ * without taking it. Removed entries are handed to the release callback
+ * only once no walk that might still see them is running.
+ */
+typedef struct registry_entry {
+    void *data;
+    struct registry_entry *_next, *_prev;
+    struct registry_entry *_retired;    /* Link in the list of entries waiting for release */
+} registry_entry_t;
+
+typedef struct registry {
+    int _size;
+    struct registry_entry _head;        /* Sentinel of the circular list */
+    pthread_mutex_t _mutex;             /* Serializes writers */
+    unsigned long _epoch;
+    int _readers[2];                    /* Running walks per epoch parity */
+    struct registry_entry *_limbo[2];   /* Removed entries per epoch parity */
+    void (*_release)(struct registry_entry *);
+} registry_t;
+
+void registry_init(registry_t *reg, void (*release)(registry_entry_t *));
+void registry_destroy(registry_t *reg);
+
+void registry_add(registry_t *reg, registry_entry_t *entry);
+void registry_remove(registry_t *reg, registry_entry_t *entry);
+void registry_apply(registry_t *reg, void (*callback)(registry_entry_t *, void *), void *data);
+int registry_size(registry_t *reg);
+
+#endif
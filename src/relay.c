@@ -0,0 +1,176 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <string.h>
+
+#include "frame.h"
+#include "relay.h"
+
+#define RELAY_NAME_MAX 255          /* Room and sender name are preceded by a length byte */
+#define RELAY_BITS (8 * sizeof(unsigned long))
+
+static unsigned long relay_get32(const char *p)
+{
+    const unsigned char *u = (const unsigned char *)p;
+
+    return (unsigned long)u[0] << 24 | (unsigned long)u[1] << 16 | (unsigned long)u[2] << 8 | u[3];
+}
+
+static void relay_put32(char *p, unsigned long v)
+{
+    p[0] = (char)(v >> 24 & 0xff);
+    p[1] = (char)(v >> 16 & 0xff);
+    p[2] = (char)(v >> 8 & 0xff);
+    p[3] = (char)(v & 0xff);
+}
+
+static size_t relay_name_len(size_t len)
+{
+    return len > RELAY_NAME_MAX ? RELAY_NAME_MAX : len;
+}
+
+/* Bytes of the whole frame, header included */
+size_t relay_size(const relay_t *r)
+{
+    return FRAME_HEADER_SIZE + RELAY_HEADER_SIZE + relay_name_len(r->room_len) + relay_name_len(r->label_len) + r->len;
+}
+
+/* Write the frame to dst, which holds relay_size() bytes */
+void relay_encode(char *dst, const relay_t *r)
+{
+    size_t room_len = relay_name_len(r->room_len), label_len = relay_name_len(r->label_len);
+    char *p = dst + FRAME_HEADER_SIZE;
+
+    frame_header(dst, FRAME_RELAY, r->sender, relay_size(r) - FRAME_HEADER_SIZE);
+    relay_put32(p, r->origin >> 16 >> 16);          /* Shifted twice, unsigned long may have 32 bits */
+    relay_put32(p + 4, r->origin & 0xffffffffUL);
+    relay_put32(p + 8, r->seq >> 16 >> 16);
+    relay_put32(p + 12, r->seq & 0xffffffffUL);
+    p[16] = (char)(r->binary ? 1 : 0);
+    p[17] = (char)room_len;
+    p[18] = (char)label_len;
+    p += RELAY_HEADER_SIZE;
+    memcpy(p, r->room, room_len);
+    memcpy(p + room_len, r->label, label_len);
+    memcpy(p + room_len + label_len, r->payload, r->len);
+}
+
+/*
+ * Take apart the payload of a relay frame, the fields of r point into it.
+ * Returns -1 if it is malformed.
+ */
+int relay_decode(relay_t *r, unsigned long sender, const char *payload, size_t len)
+{
+    if (len < RELAY_HEADER_SIZE)
+        return -1;
+    r->origin = relay_get32(payload) << 16 << 16 | relay_get32(payload + 4);
+    r->seq = relay_get32(payload + 8) << 16 << 16 | relay_get32(payload + 12);
+    r->binary = payload[16] & 1;
+    r->room_len = (unsigned char)payload[17];
+    r->label_len = (unsigned char)payload[18];
+    if (len < RELAY_HEADER_SIZE + r->room_len + r->label_len)
+        return -1;
+    r->sender = sender;
+    r->room = payload + RELAY_HEADER_SIZE;
+    r->label = r->room + r->room_len;
+    r->payload = r->label + r->label_len;
+    r->len = len - RELAY_HEADER_SIZE - r->room_len - r->label_len;
+    return 0;
+}
+
+void relay_seen_init(relay_seen_t *t)
+{
+    if (!t)
+        return;
+    pthread_mutex_init(&t->_mutex, NULL);
+    t->_count = 0;
+    t->_stamp = 0;
+}
+
+/* Move the window up by n sequence numbers, the bits of the oldest fall out */
+static void relay_window_shift(unsigned long *window, unsigned long n)
+{
+    int words = (int)(n / RELAY_BITS), bits = (int)(n % RELAY_BITS), i;
+
+    if (n >= RELAY_WINDOW) {
+        memset(window, 0, RELAY_WINDOW_WORDS * sizeof(unsigned long));
+        return;
+    }
+    for (i = RELAY_WINDOW_WORDS - 1; i >= 0; i--) {
+        window[i] = i >= words ? window[i - words] << bits : 0;
+        if (bits > 0 && i > words)
+            window[i] |= window[i - words - 1] >> (RELAY_BITS - bits);
+    }
+}
+
+/* Slot of an origin, taken over from the least recent one if it is new and the table is full */
+static relay_origin_t *relay_origin(relay_seen_t *t, unsigned long origin)
+{
+    relay_origin_t *o, *victim = NULL;
+    int i;
+
+    for (i = 0; i < t->_count; i++) {
+        o = &t->_origins[i];
+        if (o->origin == origin)
+            return o;
+        if (!victim || o->used < victim->used)
+            victim = o;
+    }
+    if (t->_count < RELAY_ORIGINS)
+        victim = &t->_origins[t->_count++];
+    victim->origin = origin;
+    victim->top = 0;
+    memset(victim->window, 0, sizeof(victim->window));
+    return victim;
+}
+
+/*
+ * Returns 1 if the message seq of origin was seen before, or is too old
+ * to tell, otherwise notes it and returns 0.
+ */
+int relay_seen(relay_seen_t *t, unsigned long origin, unsigned long seq)
+{
+    relay_origin_t *o;
+    unsigned long age;
+    int seen = 0;
+
+    if (!t)
+        return 0;
+    pthread_mutex_lock(&t->_mutex);
+    o = relay_origin(t, origin);
+    o->used = ++t->_stamp;
+    if (o->top == 0 || seq > o->top) {              /* Newest yet */
+        relay_window_shift(o->window, o->top == 0 ? RELAY_WINDOW : seq - o->top);
+        o->top = seq;
+        o->window[0] |= 1;
+    } else if ((age = o->top - seq) >= RELAY_WINDOW) {
+        seen = 1;
+    } else {
+        seen = (o->window[age / RELAY_BITS] >> age % RELAY_BITS) & 1;
+        o->window[age / RELAY_BITS] |= 1UL << age % RELAY_BITS;
+    }
+    pthread_mutex_unlock(&t->_mutex);
+    return seen;
+}
@@ -0,0 +1,88 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/*
+ * Messages relayed between the nodes of a federation. A relay frame is a
+ * binary frame of type FRAME_RELAY with the id of the original sender in
+ * its header. Its payload starts with the origin, node and shard the
+ * message entered the federation at, and the sequence number the origin
+ * gave it, followed by the room, the name of the sender and what the
+ * sender sent. Sequence numbers grow per origin, which lets a node tell
+ * a message it got over another link before, see relay_seen().
+ */
+#define RELAY_HEADER_SIZE 19
+
+typedef struct relay {
+    unsigned long origin;           /* Node id shifted left by 8 bits, or'ed with the shard */
+    unsigned long seq;
+    int binary;                     /* Sent as a binary frame, not a text line */
+    unsigned long sender;
+    const char *room;
+    size_t room_len;
+    const char *label;              /* Name of the sender */
+    size_t label_len;
+    const char *payload;
+    size_t len;
+} relay_t;
+
+size_t relay_size(const relay_t *r);
+void relay_encode(char *dst, const relay_t *r);
+int relay_decode(relay_t *r, unsigned long sender, const char *payload, size_t len);
+
+/*
+ * The sequence numbers seen lately per origin, a window of RELAY_WINDOW
+ * below the highest one. Anything older counts as seen. Once the table
+ * is full, the origin heard of least recently is forgotten. Thread-safe.
+ */
+#ifndef RELAY_ORIGINS
+#   define RELAY_ORIGINS 256
+#endif
+#define RELAY_WINDOW 256
+#define RELAY_WINDOW_WORDS (RELAY_WINDOW / (8 * sizeof(unsigned long)))
+
+typedef struct relay_origin {
+    unsigned long origin;
+    unsigned long top;              /* Highest sequence number seen */
+    unsigned long window[RELAY_WINDOW_WORDS];  /* Bit i set if top - i was seen */
+    unsigned long used;             /* Stamp of the last lookup, to find the least recent */
+} relay_origin_t;
+
+typedef struct relay_seen {
+    pthread_mutex_t _mutex;
+    relay_origin_t _origins[RELAY_ORIGINS];
+    int _count;
+    unsigned long _stamp;
+} relay_seen_t;
+
+void relay_seen_init(relay_seen_t *t);
+int relay_seen(relay_seen_t *t, unsigned long origin, unsigned long seq);
+
+#endif
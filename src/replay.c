@@ -0,0 +1,715 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE 1
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "frame.h"
+#include "hist.h"
+#include "proto.h"
+#include "zip.h"
+
+#ifndef SERVER_LISTEN_PORT
+#   define SERVER_LISTEN_PORT 9900
+#endif
+#define REPLAY_MAX_EVENTS 256
+#define REPLAY_READ_SIZE 16384
+#define REPLAY_BATCH 64                         /* Records between polls while behind or unpaced */
+#define REPLAY_DRAIN_MS 1000                    /* Time to wait for messages in flight */
+#define REPLAY_QUIET_MS 100                     /* Nothing delivered that long, all arrived */
+
+/*
+ * Drive a server with what its clients sent while it captured, see
+ * capture.h, with one connection per captured one and the same bytes in
+ * the same order. With -x the records keep their time line, sped up by
+ * the factor, -x 0 sends as fast as the server takes them.
+ *
+ * Every line or frame sent is remembered by the hash of its text along
+ * with the time it was sent, a message coming back as "<sender>: text"
+ * or in a frame is accounted for the delivery latency. The outgoing and
+ * incoming streams are followed through MODE BIN and MODE ZIP before the
+ * first JOIN, the way back switches to frames with the ACK.
+ */
+typedef struct record {
+    unsigned long time;                         /* Microseconds since the first record */
+    int type;
+    int conn;                                   /* Index into conns */
+    const char *data;
+    size_t len;
+} record_t;
+
+typedef struct conn {
+    unsigned long id;                           /* Of the captured connection */
+    int sock;                                   /* -1 while not connected */
+    int skip;                                   /* Link of a peer node, not replayed */
+    int done;                                   /* Connected once and closed since */
+    int closing;                                /* Shut the write side down once flushed */
+    int out_binary, in_binary;                  /* Frames rather than lines each way */
+    int joined;                                 /* Sent a JOIN, MODE is a message from then on */
+    int switching;                              /* Sent MODE BIN or ZIP, frames come after the ACK */
+    int held_quit, held_close;                  /* Captured ones, for after the rest when unpaced */
+    unsigned long captured;                     /* Bytes in the capture, while loading */
+    frame_t sent, in;                           /* Lines and frames sent, those received */
+    char sentbuf[REPLAY_READ_SIZE], inbuf[REPLAY_READ_SIZE];
+    char *out;                                  /* Not yet written */
+    size_t out_len, out_size;
+} conn_t;
+
+typedef struct sent {
+    unsigned long hash;                         /* 0 if the slot is free */
+    unsigned long ns;
+} sent_t;
+
+static const char *host;
+static int port = SERVER_LISTEN_PORT, json = 0;
+static double speed = 1.0;
+static record_t *records;
+static unsigned long record_count = 0;
+static conn_t *conns;
+static int conn_count = 0, *conn_index;         /* Open addressing by captured id */
+static unsigned long conn_mask;
+static sent_t *sent_table;
+static unsigned long sent_mask = 0, sent_used = 0;
+static int epfd;
+static z_stream inflater;
+static char plain[REPLAY_READ_SIZE];
+static struct timespec start;
+
+static unsigned long sent, received, unmatched, opened, failed, bytes_out, bytes_in, max_ns, lag_ns;
+static unsigned long finished;                  /* Last record sent or message delivered */
+static unsigned long hist[HIST_BUCKETS];
+
+static unsigned long elapsed_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1000000000UL + now.tv_nsec - start.tv_nsec;
+}
+
+/* FNV-1a, never 0 */
+static unsigned long hash(const char *data, size_t len)
+{
+    unsigned long h = 14695981039346656037UL;
+
+    while (len-- > 0)
+        h = (h ^ (unsigned char)*data++) * 1099511628211UL;
+    return h ? h : 1;
+}
+
+static void sent_put(unsigned long h, unsigned long ns)
+{
+    unsigned long i;
+
+    if ((sent_used + 1) * 2 > sent_mask + 1) {  /* Grow at half full */
+        sent_t *old = sent_table;
+        unsigned long old_size = sent_mask + 1, j;
+
+        sent_mask = sent_mask ? sent_mask * 2 + 1 : 4095;
+        if (!(sent_table = (sent_t *)calloc(sent_mask + 1, sizeof(sent_t)))) {
+            perror("calloc()"); exit(EXIT_FAILURE);
+        }
+        for (j = 0; old && j < old_size; j++) {
+            if (old[j].hash) {
+                for (i = old[j].hash & sent_mask; sent_table[i].hash; i = (i + 1) & sent_mask);
+                sent_table[i] = old[j];
+            }
+        }
+        free(old);
+    }
+    for (i = h & sent_mask; sent_table[i].hash && sent_table[i].hash != h; i = (i + 1) & sent_mask);
+    if (!sent_table[i].hash)
+        sent_used++;
+    sent_table[i].hash = h;                     /* The latest of equal messages */
+    sent_table[i].ns = ns;
+}
+
+/* Returns when the message was sent or 0 */
+static unsigned long sent_get(unsigned long h)
+{
+    unsigned long i;
+
+    for (i = h & sent_mask; sent_mask && sent_table[i].hash; i = (i + 1) & sent_mask) {
+        if (sent_table[i].hash == h)
+            return sent_table[i].ns;
+    }
+    return 0;
+}
+
+/* Returns the index of a captured connection, new ones are added while loading */
+static int conn_find(unsigned long id)
+{
+    unsigned long i;
+
+    for (i = (id * 2654435761UL) & conn_mask; conn_index[i] != -1; i = (i + 1) & conn_mask) {
+        if (conns[conn_index[i]].id == id)
+            return conn_index[i];
+    }
+    if ((unsigned long)(conn_count + 1) * 2 > conn_mask + 1) {
+        int *old = conn_index, j;
+
+        conn_mask = conn_mask * 2 + 1;
+        if (!(conn_index = (int *)malloc((conn_mask + 1) * sizeof(int)))) {
+            perror("malloc()"); exit(EXIT_FAILURE);
+        }
+        memset(conn_index, 0xff, (conn_mask + 1) * sizeof(int));
+        for (j = 0; j < conn_count; j++) {
+            for (i = (conns[j].id * 2654435761UL) & conn_mask; conn_index[i] != -1; i = (i + 1) & conn_mask);
+            conn_index[i] = j;
+        }
+        free(old);
+        for (i = (id * 2654435761UL) & conn_mask; conn_index[i] != -1; i = (i + 1) & conn_mask);
+    }
+    if (!(conn_count & (conn_count - 1)) && !(conns = (conn_t *)realloc(conns, (conn_count ? conn_count * 2 : 1) * sizeof(conn_t)))) {
+        perror("realloc()"); exit(EXIT_FAILURE);
+    }
+    memset(&conns[conn_count], 0, sizeof(conn_t));
+    conns[conn_count].id = id;
+    conns[conn_count].sock = -1;
+    conn_index[i] = conn_count;
+    return conn_count++;
+}
+
+static int varint(const unsigned char **p, const unsigned char *end, unsigned long *v)
+{
+    int shift;
+
+    for (*v = 0, shift = 0; *p < end && shift < 64; shift += 7) {
+        *v |= (unsigned long)(**p & 0x7f) << shift;
+        if (!(*(*p)++ & 0x80))
+            return 0;
+    }
+    return -1;
+}
+
+/* Read the capture into records, returns -1 if it isn't one */
+static int load(const char *path)
+{
+    const unsigned char *p, *end;
+    unsigned long delta, conn, len, at = 0, size = 0;
+    char *data;
+    FILE *file;
+    long bytes;
+    int type;
+
+    if (!(file = fopen(path, "rb")) || fseek(file, 0, SEEK_END) == -1 || (bytes = ftell(file)) < 0
+            || fseek(file, 0, SEEK_SET) == -1 || !(data = (char *)malloc(bytes + 1))
+            || fread(data, 1, bytes, file) != (size_t)bytes || bytes < CAPTURE_MAGIC_SIZE
+            || memcmp(data, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != 0)
+        return -1;
+    fclose(file);
+    conn_mask = 1023;
+    if (!(conn_index = (int *)malloc((conn_mask + 1) * sizeof(int))))
+        return -1;
+    memset(conn_index, 0xff, (conn_mask + 1) * sizeof(int));
+    for (p = (unsigned char *)data + CAPTURE_MAGIC_SIZE, end = (unsigned char *)data + bytes; p < end; record_count++) {
+        record_t *r;
+
+        type = *p++;
+        if (varint(&p, end, &delta) == -1 || varint(&p, end, &conn) == -1
+                || (type == CAPTURE_DATA && (varint(&p, end, &len) == -1 || len > (unsigned long)(end - p)))
+                || type < CAPTURE_CONNECT || type > CAPTURE_CLOSE) {
+            fprintf(stderr, "Capture ends with a broken record after %lu records\n", record_count);
+            break;                              /* Likely the server was killed while writing */
+        }
+        if (record_count == size && !(records = (record_t *)realloc(records, (size = size ? size * 2 : 4096) * sizeof(record_t))))
+            return -1;
+        r = &records[record_count];
+        at = record_count ? at + ((delta >> 1) ^ -(delta & 1)) : 0;  /* Zigzag, starts right away */
+        r->time = at;
+        r->type = type;
+        r->conn = conn_find(conn);
+        r->data = NULL;
+        r->len = 0;
+        if (type == CAPTURE_DATA) {
+            conn_t *c = &conns[r->conn];
+
+            if (c->captured == 0 && len >= 5 && memcmp(p, "PEER ", 5) == 0)
+                c->skip = 1;                    /* Relayed traffic is not a client's */
+            c->captured += len;
+            r->data = (const char *)p;
+            r->len = len;
+            p += len;
+        }
+    }
+    return 0;
+}
+
+static int conn_flush(conn_t *c)
+{
+    struct epoll_event ev;
+    ssize_t written;
+    size_t off = 0;
+
+    while (off < c->out_len) {
+        if ((written = write(c->sock, c->out + off, c->out_len - off)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            break;
+        }
+        off += written;
+        bytes_out += written;
+    }
+    memmove(c->out, c->out + off, c->out_len - off);
+    c->out_len -= off;
+    if (c->out_len == 0 && c->closing)
+        shutdown(c->sock, SHUT_WR);
+    ev.events = c->out_len > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->sock, &ev);
+    return 0;
+}
+
+static void conn_queue(conn_t *c, const char *data, size_t len)
+{
+    if (c->out_len + len > c->out_size) {
+        while (c->out_len + len > c->out_size)
+            c->out_size = c->out_size ? c->out_size * 2 : REPLAY_READ_SIZE;
+        if (!(c->out = (char *)realloc(c->out, c->out_size))) {
+            perror("realloc()"); exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+}
+
+static int is_switch(const char *line, size_t len)
+{
+    return len == 8 && (memcmp(line, "MODE BIN", 8) == 0 || memcmp(line, "MODE ZIP", 8) == 0);
+}
+
+static int is_join(const char *line, size_t len)
+{
+    return len >= 4 && memcmp(line, "JOIN", 4) == 0 && (len == 4 || line[4] == ' ');
+}
+
+/*
+ * Queue the lines or frames complete with the data and remember the
+ * messages among them by their text. Unpaced, a QUIT is held back until
+ * everything was sent, lest the connection miss the rest.
+ */
+static void conn_send(conn_t *c, const char *data, size_t len)
+{
+    unsigned long sender, now = elapsed_ns();
+    size_t done, fed, n, line;
+    char *p;
+    int type;
+
+    for (done = 0; done < len; done += fed) {
+        fed = frame_feed(&c->sent, data + done, len - done);
+        while (1) {
+            if (c->out_binary) {
+                if (!frame_next_binary(&c->sent, &type, &sender, &p, &n))
+                    break;
+                if (type == FRAME_QUIT && speed == 0) {
+                    c->held_quit = 1;
+                    continue;
+                }
+                conn_queue(c, p - FRAME_HEADER_SIZE, FRAME_HEADER_SIZE + n);
+                if (type == FRAME_MSG) {
+                    sent_put(hash(p, n), now);
+                    sent++;
+                }
+            } else {
+                if (!frame_next(&c->sent, &p, &n))
+                    break;
+                for (line = n; line > 0 && (p[line - 1] == '\n' || p[line - 1] == '\r'); line--);
+                if (line == 4 && memcmp(p, "QUIT", 4) == 0 && speed == 0) {
+                    c->held_quit = 1;
+                    continue;
+                }
+                conn_queue(c, p, n);
+                n = line;
+                if (!c->joined && is_switch(p, n))
+                    c->out_binary = c->switching = 1;
+                if (is_join(p, n))
+                    c->joined = 1;
+                sent_put(hash(p, n), now);      /* Commands never come back, no harm */
+                sent++;
+            }
+        }
+        if (fed == 0)
+            break;
+    }
+}
+
+static void conn_delivered(const char *msg, size_t len)
+{
+    unsigned long at = sent_get(hash(msg, len)), ns;
+
+    if (!at) {
+        unmatched++;
+        return;
+    }
+    finished = elapsed_ns();
+    ns = finished - at;
+    hist[hist_index(ns)]++;
+    if (ns > max_ns)
+        max_ns = ns;
+    received++;
+}
+
+static void conn_line(conn_t *c, char *line, size_t len)
+{
+    char *text;
+
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+        len--;
+    if (len == 4 && memcmp(line, "PING", 4) == 0) {   /* Answered whether the client did or not */
+        conn_queue(c, "PONG\r\n", 6);
+        conn_flush(c);
+    } else if (len == 3 && memcmp(line, "ACK", 3) == 0) {
+        if (c->switching)
+            c->in_binary = 1;
+        c->switching = 0;
+    } else if ((text = memchr(line, ':', len)) && text + 1 < line + len && text[1] == ' ')
+        conn_delivered(text + 2, line + len - text - 2);
+    else
+        unmatched++;
+}
+
+static void conn_frame(conn_t *c, int type, const char *payload, size_t len)
+{
+    char header[FRAME_HEADER_SIZE];
+    ssize_t n;
+
+    switch (type) {
+        case FRAME_PING:
+            frame_header(header, FRAME_PONG, 0, 0);
+            conn_queue(c, header, sizeof(header));
+            conn_flush(c);
+            break;
+        case FRAME_ACK:
+            break;
+        case FRAME_MSG:
+            conn_delivered(payload, len);
+            break;
+        case FRAME_DEFLATE:
+            if ((n = zip_inflate(&inflater, payload, len, plain, sizeof(plain))) == -1)
+                unmatched++;
+            else
+                conn_delivered(plain, n);
+            break;
+        default:
+            unmatched++;
+    }
+}
+
+static int conn_read(conn_t *c)
+{
+    ssize_t read_bytes;
+    unsigned long sender;
+    char *p;
+    size_t n;
+    int type;
+
+    if ((read_bytes = frame_read(&c->in, c->sock)) < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    else if (read_bytes == 0)
+        return -1;
+    bytes_in += read_bytes;
+    while (1) {                                 /* Lines until the ACK of a switch, frames after */
+        if (c->in_binary) {
+            if (!frame_next_binary(&c->in, &type, &sender, &p, &n))
+                break;
+            conn_frame(c, type, p, n);
+        } else {
+            if (!frame_next(&c->in, &p, &n))
+                break;
+            conn_line(c, p, n);
+        }
+    }
+    return 0;
+}
+
+static void conn_close(conn_t *c)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->sock, NULL);
+    close(c->sock);
+    c->sock = -1;
+    c->done = 1;
+    c->out_len = 0;
+}
+
+static void conn_open(conn_t *c)
+{
+    struct epoll_event ev;
+    int one = 1;
+
+    if ((c->sock = proto_connect(host, port)) == -1) {
+        failed++;
+        c->done = 1;
+        return;
+    }
+    fcntl(c->sock, F_SETFL, fcntl(c->sock, F_GETFL) | O_NONBLOCK);
+    setsockopt(c->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));  /* Keep the captured timing */
+    frame_init(&c->sent, REPLAY_READ_SIZE, c->sentbuf, sizeof(c->sentbuf));
+    frame_init(&c->in, REPLAY_READ_SIZE, c->inbuf, sizeof(c->inbuf));
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->sock, &ev);
+    opened++;
+}
+
+/* Quit and close what was held back while unpaced */
+static void conn_release(conn_t *c)
+{
+    char quit[FRAME_HEADER_SIZE];
+
+    if (c->held_quit && c->out_binary) {
+        frame_header(quit, FRAME_QUIT, 0, 0);
+        conn_queue(c, quit, sizeof(quit));
+    } else if (c->held_quit)
+        conn_queue(c, "QUIT\r\n", 6);
+    c->closing = c->held_close;
+    c->held_quit = c->held_close = 0;
+    if (conn_flush(c) == -1)
+        conn_close(c);
+}
+
+static void replay(const record_t *r)
+{
+    conn_t *c = &conns[r->conn];
+
+    if (c->skip || c->done)
+        return;
+    switch (r->type) {
+        case CAPTURE_CONNECT:
+            if (c->sock == -1)
+                conn_open(c);
+            break;
+        case CAPTURE_DATA:
+            if (c->sock == -1)                  /* Taken over from an older server, connected before */
+                conn_open(c);
+            if (c->sock == -1)
+                break;
+            conn_send(c, r->data, r->len);
+            if (conn_flush(c) == -1)
+                conn_close(c);
+            break;
+        case CAPTURE_CLOSE:
+            if (c->sock == -1)
+                break;
+            if (speed == 0) {
+                c->held_close = 1;
+                break;
+            }
+            c->closing = 1;                     /* Read on until the server closes, too */
+            if (c->out_len == 0)
+                shutdown(c->sock, SHUT_WR);
+            break;
+    }
+}
+
+static void poll_conns(int timeout)
+{
+    struct epoll_event events[REPLAY_MAX_EVENTS];
+    int i, count;
+
+    if ((count = epoll_wait(epfd, events, REPLAY_MAX_EVENTS, timeout)) < 0)
+        return;
+    for (i = 0; i < count; i++) {
+        conn_t *c = (conn_t *)events[i].data.ptr;
+
+        if (c->sock < 0)
+            continue;
+        if (((events[i].events & EPOLLOUT) && conn_flush(c) == -1)
+                || ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && conn_read(c) == -1)) {
+            if (!c->closing)
+                fprintf(stderr, "Connection %lu lost\n", c->id);
+            conn_close(c);
+        }
+    }
+}
+
+/* Value of a number in a report written with -j, or -1 */
+static double baseline_value(const char *report, const char *key)
+{
+    char name[64];
+    const char *at;
+
+    sprintf(name, "\"%s\": ", key);
+    return (at = strstr(report, name)) ? strtod(at + strlen(name), NULL) : -1.0;
+}
+
+static void compare(const char *path, double secs, FILE *out)
+{
+    static const char *keys[] = { "msgs_in_per_s", "msgs_out_per_s", "latency_p50_us", "latency_p99_us",
+            "latency_p999_us", "latency_max_us" };
+    double now[6], base;
+    char report[4096];
+    size_t len;
+    FILE *file;
+    int i;
+
+    if (!(file = fopen(path, "r"))) {
+        perror(path);
+        return;
+    }
+    len = fread(report, 1, sizeof(report) - 1, file);
+    report[len] = '\0';
+    fclose(file);
+    now[0] = sent / secs;
+    now[1] = received / secs;
+    now[2] = hist_percentile(hist, received, 0.5) / 1e3;
+    now[3] = hist_percentile(hist, received, 0.99) / 1e3;
+    now[4] = hist_percentile(hist, received, 0.999) / 1e3;
+    now[5] = max_ns / 1e3;
+    fprintf(out, "Compared to %s:\n", path);
+    for (i = 0; i < 6; i++) {
+        if ((base = baseline_value(report, keys[i])) < 0)
+            continue;
+        fprintf(out, "  %-16s %12.1f -> %12.1f  %+7.1f%%\n", keys[i], base, now[i], base > 0 ? 100.0 * (now[i] - base) / base : 0.0);
+    }
+}
+
+static void report(double secs)
+{
+    if (json) {
+        fprintf(stdout, "{\"connections\": %lu, \"failed\": %lu, \"records\": %lu, \"speed\": %.3f, \"duration_s\": %.3f, "
+                "\"sent\": %lu, \"received\": %lu, \"unmatched\": %lu, \"msgs_in_per_s\": %.1f, \"msgs_out_per_s\": %.1f, "
+                "\"bytes_out\": %lu, \"bytes_in\": %lu, ",
+                opened, failed, record_count, speed, secs, sent, received, unmatched, sent / secs, received / secs,
+                bytes_out, bytes_in);
+        fprintf(stdout, "\"latency_p50_us\": %.1f, \"latency_p99_us\": %.1f, \"latency_p999_us\": %.1f, \"latency_max_us\": %.1f, "
+                "\"lag_max_ms\": %.3f}\n",
+                hist_percentile(hist, received, 0.5) / 1e3, hist_percentile(hist, received, 0.99) / 1e3,
+                hist_percentile(hist, received, 0.999) / 1e3, max_ns / 1e3, lag_ns / 1e6);
+    } else {
+        fprintf(stdout, "Connections:     %lu replayed, %lu failed\n", opened, failed);
+        if (speed > 0)
+            fprintf(stdout, "Records:         %lu in %.3f s at %.2fx\n", record_count, secs, speed);
+        else
+            fprintf(stdout, "Records:         %lu in %.3f s at full speed\n", record_count, secs);
+        fprintf(stdout, "Messages sent:   %lu (%.1f/s), %lu bytes\n", sent, sent / secs, bytes_out);
+        fprintf(stdout, "Messages recvd:  %lu (%.1f/s), %lu not matched, %lu bytes\n", received, received / secs, unmatched, bytes_in);
+        fprintf(stdout, "Latency (us):    p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+                hist_percentile(hist, received, 0.5) / 1e3, hist_percentile(hist, received, 0.99) / 1e3,
+                hist_percentile(hist, received, 0.999) / 1e3, max_ns / 1e3);
+        if (speed > 0)
+            fprintf(stdout, "Behind schedule: %.3f ms at most\n", lag_ns / 1e6);
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-x speed] [-p port] [-j] [-c baseline.json] capture_file [host]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    struct rlimit rl;
+    const char *baseline = NULL;
+    unsigned long next = 0, due, now, last = 0;
+    int opt, batch = 0, i, open;
+    double secs;
+    char *end;
+
+    while ((opt = getopt(argc, argv, "x:p:jc:")) != -1) {
+        switch (opt) {
+            case 'x':                           /* Speed up the captured time line, 0 for as fast as possible */
+                speed = strtod(optarg, &end);
+                if (*end || speed < 0)
+                    usage(argv[0]);
+                break;
+            case 'p': port = atoi(optarg); break;
+            case 'j': json = 1; break;
+            case 'c': baseline = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind >= argc || port < 1 || port > 65535)
+        usage(argv[0]);
+    host = optind + 1 < argc ? argv[optind + 1] : "127.0.0.1";
+    if (load(argv[optind]) == -1) {
+        fprintf(stderr, "Unable to load capture %s\n", argv[optind]); exit(EXIT_FAILURE);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;                      /* Thousands of connections need descriptors */
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if ((epfd = epoll_create1(0)) == -1 || inflateInit2(&inflater, -15) != Z_OK) {
+        perror("epoll_create1()"); exit(EXIT_FAILURE);
+    }
+
+    fprintf(stderr, "Replaying %lu records of %d connections to %s:%d ...\n", record_count, conn_count, host, port);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (next < record_count) {
+        due = speed > 0 ? (unsigned long)(records[next].time * 1000.0 / speed) : 0;
+        if ((now = elapsed_ns()) >= due && batch++ < REPLAY_BATCH) {
+            if (speed > 0 && now - due > lag_ns)
+                lag_ns = now - due;
+            replay(&records[next++]);
+            continue;
+        }
+        batch = 0;
+        poll_conns(now >= due ? 0 : (int)((due - now) / 1000000));
+    }
+    if ((last = elapsed_ns()) > finished)
+        finished = last;
+    if (speed == 0) {                                   /* Let the messages arrive before anyone leaves */
+        while (elapsed_ns() - finished < REPLAY_QUIET_MS * 1000000UL && elapsed_ns() - last < REPLAY_DRAIN_MS * 1000000UL)
+            poll_conns(10);
+        for (i = 0; i < conn_count; i++) {
+            if (conns[i].sock >= 0)
+                conn_release(&conns[i]);
+        }
+        last = elapsed_ns();
+    }
+    do {                                                /* Collect what is still in flight */
+        poll_conns(10);
+        for (i = 0, open = 0; i < conn_count; i++)
+            open += conns[i].sock >= 0;
+    } while (open > 0 && elapsed_ns() - last < REPLAY_DRAIN_MS * 1000000UL);
+    for (i = 0; i < conn_count; i++) {
+        if (conns[i].sock >= 0)
+            conn_close(&conns[i]);
+    }
+    secs = finished / 1e9;
+    report(secs > 0 ? secs : 1e-9);
+    if (baseline)
+        compare(baseline, secs > 0 ? secs : 1e-9, json ? stderr : stdout);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,185 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "room.h"
+
+#define ROOM_BUCKETS 64
+
+/* FNV-1a */
+static unsigned long room_hash(const char *name, size_t len)
+{
+    unsigned long hash = 2166136261UL;
+
+    while (len--)
+        hash = (hash ^ (unsigned char)*name++) * 16777619UL;
+    return hash;
+}
+
+int room_table_init(room_table_t *table)
+{
+    if (!table)
+        return -1;
+    if (!(table->_buckets = (room_t **)calloc(ROOM_BUCKETS, sizeof(room_t *))))
+        return -1;
+    table->_mask = ROOM_BUCKETS - 1;
+    table->count = 0;
+    pool_init(&table->_pool, sizeof(room_t));
+    return 0;
+}
+
+void room_table_destroy(room_table_t *table)
+{
+    unsigned long i;
+
+    if (!table || !table->_buckets)
+        return;
+    for (i = 0; i <= table->_mask; i++) {
+        while (table->_buckets[i]) {
+            room_t *room = table->_buckets[i];
+
+            table->_buckets[i] = room->_next;
+            pool_free(room);
+        }
+    }
+    free(table->_buckets);
+    table->_buckets = NULL;
+    pool_destroy(&table->_pool);
+}
+
+/* Double the buckets once there are more rooms than buckets, keeping chains short */
+static void room_grow(room_table_t *table)
+{
+    unsigned long i, mask = table->_mask * 2 + 1;
+    room_t **buckets = (room_t **)calloc(mask + 1, sizeof(room_t *));
+
+    if (!buckets)
+        return;                                 /* Longer chains, but still working */
+    for (i = 0; i <= table->_mask; i++) {
+        while (table->_buckets[i]) {
+            room_t *room = table->_buckets[i];
+
+            table->_buckets[i] = room->_next;
+            room->_next = buckets[room->hash & mask];
+            buckets[room->hash & mask] = room;
+        }
+    }
+    free(table->_buckets);
+    table->_buckets = buckets;
+    table->_mask = mask;
+}
+
+static room_t *room_lookup(room_table_t *table, const char *name, size_t len, unsigned long hash)
+{
+    room_t *room;
+
+    for (room = table->_buckets[hash & table->_mask]; room; room = room->_next)
+        if (room->hash == hash && room->len == len && memcmp(room->name, name, len) == 0)
+            return room;
+    return NULL;
+}
+
+/* Room names are up to ROOM_NAME_SIZE printable characters without blanks */
+int room_valid(const char *name, size_t len)
+{
+    size_t i;
+
+    if (!name || len > ROOM_NAME_SIZE)
+        return 0;
+    for (i = 0; i < len; i++)
+        if (name[i] <= ' ' || name[i] > '~')
+            return 0;
+    return 1;
+}
+
+room_t *room_find(room_table_t *table, const char *name, size_t len)
+{
+    if (!table || !name || len > ROOM_NAME_SIZE)
+        return NULL;
+    return room_lookup(table, name, len, room_hash(name, len));
+}
+
+room_t *room_join(room_table_t *table, const char *name, size_t len, room_member_t *member)
+{
+    unsigned long hash;
+    room_t *room;
+
+    if (!table || !name || !member || len > ROOM_NAME_SIZE)
+        return NULL;
+    hash = room_hash(name, len);
+    if (!(room = room_lookup(table, name, len, hash))) {
+        if (!(room = (room_t *)pool_alloc(&table->_pool)))
+            return NULL;
+        memcpy(room->name, name, len);
+        room->name[len] = '\0';
+        room->len = len;
+        room->hash = hash;
+        room->size = 0;
+        room->_head._next = room->_head._prev = &room->_head;
+        room->_next = table->_buckets[hash & table->_mask];
+        table->_buckets[hash & table->_mask] = room;
+        __atomic_store_n(&table->count, table->count + 1, __ATOMIC_RELAXED);
+        if ((unsigned long)table->count > table->_mask + 1)
+            room_grow(table);
+    }
+    member->room = room;
+    member->_next = &room->_head;
+    member->_prev = room->_head._prev;
+    room->_head._prev->_next = member;
+    room->_head._prev = member;
+    room->size++;
+    return room;
+}
+
+void room_leave(room_table_t *table, room_member_t *member)
+{
+    room_t *room, **link;
+
+    if (!table || !member || !(room = member->room))
+        return;
+    member->_prev->_next = member->_next;
+    member->_next->_prev = member->_prev;
+    member->room = NULL;
+    if (--room->size > 0)
+        return;
+    for (link = &table->_buckets[room->hash & table->_mask]; *link != room; link = &(*link)->_next)
+        ;
+    *link = room->_next;                        /* Empty rooms are gone */
+    __atomic_store_n(&table->count, table->count - 1, __ATOMIC_RELAXED);
+    pool_free(room);
+}
+
+/* The callback must not make members leave */
+void room_apply(room_t *room, void (*callback)(room_member_t *, void *), void *data)
+{
+    room_member_t *member;
+
+    if (!room)
+        return;
+    for (member = room->_head._next; member != &room->_head; member = member->_next)
+        callback(member, data);
+}
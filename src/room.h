@@ -0,0 +1,72 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef ROOM_H
+#define ROOM_H
+
+#include <stddef.h>
+
+#include "pool.h"
+
+#define ROOM_NAME_SIZE 32
+
+/*
+ * Rooms of one event loop, hashed by name. A room is created when the
+ * first member joins and freed when the last one leaves, members are
+ * linked into their room intrusively. Only the owning thread may touch
+ * the table, rooms of the same name on other loops are independent.
+ */
+typedef struct room_member {
+    void *data;
+    struct room *room;                  /* Room joined or NULL */
+    struct room_member *_next, *_prev;
+} room_member_t;
+
+typedef struct room {
+    char name[ROOM_NAME_SIZE + 1];
+    size_t len;
+    unsigned long hash;
+    int size;                           /* Number of members */
+    struct room_member _head;           /* Sentinel of the circular member list */
+    struct room *_next;                 /* Next room in the same bucket */
+} room_t;
+
+typedef struct room_table {
+    int count;                          /* Rooms with members, read by other threads */
+    unsigned long _mask;
+    struct room **_buckets;
+    pool_t _pool;
+} room_table_t;
+
+int room_table_init(room_table_t *table);
+void room_table_destroy(room_table_t *table);
+
+int room_valid(const char *name, size_t len);
+room_t *room_find(room_table_t *table, const char *name, size_t len);
+room_t *room_join(room_table_t *table, const char *name, size_t len, room_member_t *member);
+void room_leave(room_table_t *table, room_member_t *member);
+void room_apply(room_t *room, void (*callback)(room_member_t *, void *), void *data);
+
+#endif
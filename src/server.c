@@ -23,32 +23,182 @@
     THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
-#define _POSIX_SOURCE 1
 
-#include <sys/select.h>
-#include <sys/stat.h>
+#define _GNU_SOURCE 1
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <mqueue.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
-#include "list.h"
+#include "bucket.h"
+#include "capture.h"
+#include "frame.h"
+#include "handoff.h"
+#include "history.h"
+#include "log.h"
+#include "msgbuf.h"
+#include "nick.h"
+#include "outq.h"
+#include "pool.h"
+#include "registry.h"
+#include "relay.h"
+#include "room.h"
+#include "shm.h"
+#include "spsc.h"
+#include "stats.h"
+#include "trace.h"
+#include "uring.h"
+#include "wheel.h"
+#include "zip.h"
 
 #ifndef SERVER_LISTEN_PORT
 #   define SERVER_LISTEN_PORT 9900
 #endif
-#define SERVER_LISTEN_BACKLOG 5
+#ifndef SERVER_LISTEN_BACKLOG
+#   define SERVER_LISTEN_BACKLOG SOMAXCONN
+#endif
+#define SERVER_MAX_LOOPS 64
+#ifndef SERVER_SHARD_QUEUE
+#   define SERVER_SHARD_QUEUE 1024
+#endif
+#define SERVER_MAX_EVENTS 64
 #ifndef BUFFER_SIZE
 #   define BUFFER_SIZE 512
 #endif
+#ifndef SERVER_OUTQ_HIGH
+#   define SERVER_OUTQ_HIGH 65536
+#endif
+#ifndef SERVER_READ_SIZE
+#   define SERVER_READ_SIZE 16384
+#endif
+#ifndef SERVER_STATS_SIZE
+#   define SERVER_STATS_SIZE 16384
+#endif
+#ifndef SERVER_SPILL_MAX
+#   define SERVER_SPILL_MAX (1024 * 1024)
+#endif
+#ifndef SERVER_HISTORY_REPLAY
+#   define SERVER_HISTORY_REPLAY 20
+#endif
+#ifndef SERVER_HISTORY_SEGMENT
+#   define SERVER_HISTORY_SEGMENT (4 * 1024 * 1024)
+#endif
+#ifndef SERVER_HISTORY_SEGMENTS
+#   define SERVER_HISTORY_SEGMENTS 8
+#endif
+#ifndef SERVER_HISTORY_RECORDS
+#   define SERVER_HISTORY_RECORDS 16384
+#endif
+#ifndef SERVER_COALESCE_BYTES
+#   define SERVER_COALESCE_BYTES 16384
+#endif
+#define SERVER_COALESCE_MAX 10000   /* Longest coalescing window in microseconds */
+#ifndef SERVER_TIMER_TICK
+#   define SERVER_TIMER_TICK 100    /* Milliseconds per tick of the timing wheels */
+#endif
+#ifndef SERVER_INPUT_QUANTUM
+#   define SERVER_INPUT_QUANTUM 4096    /* Input bytes a client may handle per round */
+#endif
+#ifndef SERVER_SHM_RING
+#   define SERVER_SHM_RING (1024 * 1024)    /* Bytes of each ring of a local client, absorb bursts like socket buffers */
+#endif
+#ifndef SERVER_DEFLATE_MIN
+#   define SERVER_DEFLATE_MIN 256   /* Shorter payloads go out uncompressed */
+#endif
+#ifndef SERVER_DEFLATE_LEVEL
+#   define SERVER_DEFLATE_LEVEL 6
+#endif
+#ifndef SERVER_TRACE_EVENTS
+#   define SERVER_TRACE_EVENTS 16384    /* Trace events each shard keeps */
+#endif
+#ifndef SERVER_TRACE_PATH
+#   define SERVER_TRACE_PATH "kidcat.trace.json"
+#endif
+#ifndef SERVER_URING_ENTRIES
+#   define SERVER_URING_ENTRIES 256
+#endif
+#ifndef SERVER_URING_BUFFERS
+#   define SERVER_URING_BUFFERS 256
+#endif
+#ifndef SERVER_URING_BUFFER_SIZE
+#   define SERVER_URING_BUFFER_SIZE 4096
+#endif
+#ifndef SERVER_MAX_PEERS
+#   define SERVER_MAX_PEERS 16
+#endif
+#define SERVER_MAX_LINKS SERVER_MAX_PEERS   /* Peer links per shard */
+#ifndef SERVER_PEER_RETRY
+#   define SERVER_PEER_RETRY 1      /* Seconds between attempts to dial a peer */
+#endif
 #define IPADDR_SIZE 15
 
+/* Operations of an io_uring loop, tagged onto the client or loop they belong to */
+enum loop_op {
+    LOOP_ACCEPT = 1,                /* Multishot accept on the listen socket */
+    LOOP_ACCEPT_LOCAL,              /* Multishot accept on the socket of local clients */
+    LOOP_NOTIFY,                    /* Multishot poll of the eventfd */
+    LOOP_RECV,                      /* Multishot receive into provided buffers */
+    LOOP_SEND,                      /* Output queue head handed to the kernel */
+    LOOP_WRITABLE                   /* Waiting to go on with a file range */
+};
+
+/*
+ * Every event loop is a shard of the server: it accepts on its own
+ * SO_REUSEPORT listener, keeps its own clients and is the only thread
+ * touching them. Messages for the clients of other shards travel
+ * through one single-producer/single-consumer queue per pair of shards.
+ */
+typedef struct loop {
+    pthread_t tid;                  /* Thread running this event loop */
+    int epfd;                       /* Epoll instance of this loop */
+    int uring;                      /* Runs on the io_uring instance instead */
+    uring_t ring;
+    int index;                      /* Number of the loop, used for logging */
+    int cpu;                        /* CPU the loop is pinned to or -1 */
+    int listen_sock;                /* Listen socket of this shard */
+    registry_t clients;             /* Clients of this shard */
+    room_table_t rooms;             /* Rooms with members on this shard */
+    int evfd;                       /* Signals messages from other shards */
+    int notified;                   /* Set once evfd was signalled and not yet drained */
+    int stats_requested;            /* Print the queues of this shard, on SIGUSR1 */
+    spsc_t *inbox;                  /* Queues from every other shard, indexed by sender */
+    unsigned long overflows;        /* Messages lost to full queues towards this shard */
+    pool_t client_pool;             /* Client structs of this loop */
+    slab_t slab;                    /* Messages sent by clients of this loop */
+    stats_t stats;                  /* Counters of this shard, written by its thread only */
+    struct client *held, *held_tail;  /* Clients holding output back, oldest first */
+    struct client *ready, *ready_tail;  /* Clients with input left after their share, in turn */
+    wheel_t timers;                 /* Idle, heartbeat and throttle timers of the clients */
+    unsigned long tick;             /* Current tick of the wheel */
+    int accepting;                  /* Multishot accepts armed on io_uring */
+    int parking;                    /* Stopped for a new process taking over */
+    struct adopt *adopt;            /* Clients taken over from the old process, set up once the loop runs */
+    struct client *links[SERVER_MAX_LINKS];  /* Links to peer nodes, every message is relayed over them */
+    int link_count;
+    unsigned long relay_seq;        /* Last sequence number given to a message of this shard */
+    zip_t zip;                      /* Compresses the messages published by this shard */
+    trace_t trace;                  /* Events of the messages traced, if sampling */
+    unsigned long sampled;          /* Messages published since the last one traced */
+    capture_ring_t *capture;        /* Records what the clients of this shard send, if capturing */
+} loop_t;
+
 typedef struct client {
     int sock;                       /* Client socket */
     struct sockaddr_in addr;        /* Socket connection details */
@@ -57,237 +207,2915 @@ typedef struct client {
         CLIENT_ERROR,               /* Error state */
         CLIENT_ACCEPTED,            /* Client was accepted */
         CLIENT_JOINED,              /* Client joined conversation */
-        CLIENT_QUIT                 /* Client quitted conversation */
+        CLIENT_PEER,                /* Link to a peer node, carries relay frames */
+        CLIENT_QUIT,                /* Client quitted conversation */
+        CLIENT_CLOSED               /* Closed, io_uring operations still to complete */
     } state;
-    char name[IPADDR_SIZE];         /* Printable name, eg. IP address */
-    mqd_t mq;                       /* Message queue */
+    char name[IPADDR_SIZE + 1];     /* Printable name, eg. IP address */
+    loop_t *loop;                   /* Event loop owning the client */
+    registry_entry_t entry;         /* Entry in the registry of the shard */
+    room_member_t member;           /* Membership in a room once joined */
+    nick_entry_t nick;              /* Nickname, if registered */
+    unsigned long id;               /* Sender id in binary frames */
+    int binary;                     /* Speaks binary frames instead of text lines */
+    int deflate;                    /* Gets long room messages compressed */
+    frame_t in;                     /* Input not yet handled */
+    char inbuf[SERVER_READ_SIZE];
+    outq_t out;                     /* Messages not yet written */
+    int broken;                     /* Output failed, socket is shut down */
+    struct msghdr msg;              /* Send in flight on io_uring */
+    struct iovec iov[OUTQ_IOV_MAX];
+    int sending;
+    int pending;                    /* io_uring operations not completed yet */
+    int held;                       /* Output held back until flush_at to coalesce writes */
+    struct client *held_next, *held_prev;
+    unsigned long flush_at;         /* Microseconds on the monotonic clock */
+    unsigned long flushed_at;       /* Last time output was written */
+    wheel_timer_t timer;            /* Fires when the client was silent too long */
+    unsigned long active;           /* Tick of the last input */
+    unsigned long read_at;          /* Nanoseconds, last time input came in, if tracing */
+    unsigned long pinged;           /* Tick of the PING not answered yet or 0 */
+    int ready;                      /* Input left after its share, waits for the next round */
+    struct client *ready_next, *ready_prev;
+    size_t deficit;                 /* Input bytes it may still handle this round */
+    bucket_t msg_rate, byte_rate;   /* Input admitted per second */
+    int throttled;                  /* Input paused over the rate limits until resume fires */
+    wheel_timer_t resume;
+    char *spill;                    /* Input received while throttled that the frame buffer didn't take */
+    size_t spill_len, spill_size;
+    int receiving;                  /* Multishot receive armed on io_uring */
+    size_t history_last;            /* Messages to replay on JOIN */
+    unsigned long history_since;    /* Replay what came after this one instead, if not 0 */
+    unsigned long history_seq;      /* Messages up to this one were replayed or before our time */
+    unsigned long node;             /* Peer node the link goes to, 0 if unknown */
+    struct peer *peer;              /* Peer the link was dialed to, NULL if accepted */
+    shm_t *shm;                     /* Rings of a client on this host, its socket only wakes, NULL for TCP */
+    int handed_off;                 /* Sent to the successor, the connection is its to shut down */
 } client_t;
 
+/* Whether the input of a client is still handled */
+#define client_open(cl) ((cl)->state == CLIENT_ACCEPTED || (cl)->state == CLIENT_JOINED || (cl)->state == CLIENT_PEER)
+
 typedef struct message {
-    int sock;                       /* Socket of sender */
-    char sender[IPADDR_SIZE];       /* IP address of sender */
-    char data[BUFFER_SIZE];         /* Message content */
+    int sock;                       /* Socket of sender or -1 if it is on another shard */
+    msgbuf_t *buf;                  /* Formatted message shared by all recipients */
+    msgbuf_t *alt;                  /* Other wire form, made for the first recipient needing it */
+    unsigned long recipients;       /* Clients the message was queued for */
 } message_t;
 
-static int server_sock;
+/* A client the old process handed off, waiting for its shard to run */
+typedef struct adopt {
+    handoff_record_t rec;
+    int fds[HANDOFF_FDS_MAX];       /* Socket, then the memory file and eventfd of a local client */
+    struct peer *peer;              /* Peer a dialed link goes to, NULL if none */
+    struct adopt *next;
+    char data[1];                   /* Room, nickname, input and output as the record says */
+} adopt_t;
+
+/* A peer node from the command line, dialed again whenever its link goes down */
+typedef struct peer {
+    const char *name;               /* As given, host:port */
+    struct sockaddr_in addr;
+    loop_t *loop;                   /* Shard owning the link */
+    int up;                         /* Link dialed and not closed yet */
+    int sock;                       /* Link dialed but not taken on by its shard yet, or -1 */
+    unsigned long failures;         /* Attempts failed in a row */
+} peer_t;
+
 static struct sockaddr_in server_addr;
-static list_t client_list;
+static int server_backlog = SERVER_LISTEN_BACKLOG;
+static loop_t loops[SERVER_MAX_LOOPS];
+static int loop_count = 0;
+static int loop_cpus[SERVER_MAX_LOOPS], loop_cpu_count = 0;
+static msgbuf_t *ack_buf[2], *ping_buf[2], *pong_buf[2], *nick_taken_buf[2], *nick_unknown_buf[2], *room_invalid_buf[2], *history_invalid_buf[2];  /* Text and binary form */
+static unsigned long client_ids = 0;
+static history_t history;           /* Messages sent to rooms, if logging */
+static const char *history_dir = NULL;
+static size_t history_replay_last = SERVER_HISTORY_REPLAY;
+static nick_table_t nicks;          /* Nicknames of all shards */
+static size_t outq_high = SERVER_OUTQ_HIGH, outq_low = SERVER_OUTQ_HIGH / 4;
+static outq_policy_t outq_policy = OUTQ_DISCONNECT;
+static int use_uring = 0;
+static unsigned long coalesce_window = 0, coalesce_bytes = SERVER_COALESCE_BYTES;
+static unsigned long idle_timeout = 0, ping_interval = 0;  /* In ticks, 0 if off */
+static size_t input_quantum = SERVER_INPUT_QUANTUM;
+static unsigned long rate_msgs = 0, rate_bytes = 0;         /* Input per client and second, 0 if unlimited */
+static const char *handoff_path = NULL;                     /* Unix socket a successor connects to */
+static int handoff_listeners[SERVER_MAX_LOOPS], handoff_listener_count = 0;  /* Taken over from the old process */
+static int handoff_requested = 0, handoff_parked = 0;
+static pthread_mutex_t handoff_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t handoff_cond = PTHREAD_COND_INITIALIZER;
+static int listen_port = SERVER_LISTEN_PORT;
+static unsigned long node_id = 0;                           /* Of this server within the federation */
+static peer_t peers[SERVER_MAX_PEERS];
+static int peer_count = 0;
+static struct in_addr allowed[SERVER_MAX_PEERS];            /* Hosts besides the peers that may link in */
+static int allowed_count = 0;
+static relay_seen_t relayed;                                /* Messages peers relayed lately */
+static const char *local_path = NULL;                       /* Unix socket clients on this host get rings from */
+static int local_sock = -1;
+static size_t deflate_min = SERVER_DEFLATE_MIN;
+static unsigned long trace_every = 0;                       /* Every n-th message of a shard is traced, 0 if off */
+static const char *trace_path = SERVER_TRACE_PATH;
+static unsigned long trace_ids = 0;
+static int deflate_clients = 0;                             /* Asking for compressed messages, on all shards */
+static const char *capture_path = NULL;                     /* Input of all clients is recorded to, for replay */
 
-void client_message_callback(list_item_t *item, void *msg)
+static unsigned long clock_us(void)
 {
-    client_t *client = (client_t *)item->data;
-    message_t *message = (message_t*)msg;
-    if (client->sock != message->sock)
-        mq_send(client->mq, msg, sizeof(message_t), 1);
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000UL + now.tv_nsec / 1000;
 }
 
-void client_quit_callback(list_item_t *item, void *data)
+/* End the delivery of a traced message once its write to the client completed */
+static void client_traced(client_t *cl)
 {
-    mq_send(((client_t *)item->data)->mq, "", 0, 1);
+    if (!cl->out.traced)
+        return;
+    trace_record(&cl->loop->trace, "deliver", TRACE_WAIT, cl->out.traced, cl->out.traced_at, trace_now(), cl->id);
+    cl->out.traced = 0;
 }
 
-void *thread_func(void *arg)
+/* outq_write() accounting for the system calls it took and the messages it wrote */
+static ssize_t client_write(client_t *cl)
 {
-    int running = 1, read_bytes;
-    struct mq_attr ma;
-    char buf[BUFFER_SIZE];
-    client_t *cl = (client_t *)((list_item_t *)arg)->data;  /* Extract list client data element */
+    unsigned long calls = cl->out.calls, sent = cl->out.sent;
+    ssize_t written;
 
-    if (!arg) {
-        fprintf(stderr, "Thread %ld: ERROR No client data argument\n", pthread_self());
-        pthread_exit((void *)EXIT_FAILURE);
+    if ((written = outq_write(&cl->out, cl->sock)) == -1)
+        return -1;
+    client_traced(cl);
+    stats_add(&cl->loop->stats, STATS_WRITES, cl->out.calls - calls);
+    stats_add(&cl->loop->stats, STATS_WRITTEN, cl->out.sent - sent);
+    stats_add(&cl->loop->stats, STATS_BYTES_OUT, written);
+    if (coalesce_window > 0)
+        cl->flushed_at = clock_us();
+    return written;
+}
+
+/*
+ * io_uring counterpart of client_flush(): hand the head of the output
+ * queue to the kernel in one SENDMSG, unless a send is in flight. File
+ * ranges go out with sendfile() right away, a poll tells when to go on
+ * with what the socket didn't take. Returns -1 if the connection is
+ * broken.
+ */
+static int client_submit(client_t *cl)
+{
+    uring_t *ring = &cl->loop->ring;
+    ssize_t written;
+
+    if (cl->sending || cl->out.count == 0 || cl->loop->parking)  /* Parked output goes to the successor */
+        return 0;
+    if ((cl->msg.msg_iovlen = outq_prepare(&cl->out, cl->iov, OUTQ_IOV_MAX)) > 0) {
+        if (uring_sendmsg(ring, cl->sock, &cl->msg, cl->out.count > cl->msg.msg_iovlen ? MSG_MORE : 0,
+                uring_data(cl, LOOP_SEND)) == -1) {
+            outq_complete(&cl->out, 0);
+            return -1;
+        }
+        stats_add(&cl->loop->stats, STATS_WRITES, 1);
+        if (coalesce_window > 0)
+            cl->flushed_at = clock_us();
+    } else {
+        if ((written = client_write(cl)) == -1)
+            return -1;
+        if (cl->out.count == 0)
+            return 0;
+        if (uring_poll(ring, cl->sock, POLLOUT, uring_data(cl, LOOP_WRITABLE)) == -1)
+            return -1;
+    }
+    cl->sending = 1;
+    cl->pending++;
+    return 0;
+}
+
+/*
+ * Copy the output queue of a local client into its down ring, as far as
+ * there is room, and wake the client if it sleeps. If the ring is full,
+ * the client wakes us once it made room. Returns -1 if the connection is
+ * broken.
+ */
+static int client_push(client_t *cl)
+{
+    shm_ring_t *ring = &cl->shm->down;
+    unsigned long sent = cl->out.sent;
+    uint64_t one = 1;
+    ssize_t copied;
+    size_t len;
+    char *dst;
+    int wake = 0;
+
+    while (cl->out.count > 0) {
+        if (!(dst = shm_ring_reserve(ring, &len))) {
+            if (shm_ring_stall(ring))
+                break;
+            continue;                                               /* Made room meanwhile */
+        }
+        if ((copied = outq_take(&cl->out, dst, len)) == -1)
+            return -1;
+        wake |= shm_ring_commit(ring, copied);
+        stats_add(&cl->loop->stats, STATS_BYTES_OUT, copied);
     }
+    client_traced(cl);
+    stats_add(&cl->loop->stats, STATS_WRITTEN, cl->out.sent - sent);
+    if (wake) {
+        if (write(cl->shm->evfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            return -1;
+        stats_add(&cl->loop->stats, STATS_LOCAL_WAKEUPS, 1);
+    }
+    if (coalesce_window > 0)
+        cl->flushed_at = clock_us();
+    return 0;
+}
 
-    mq_getattr(cl->mq, &ma);
-    fprintf(stdout, "Thread %ld: Message queue msgsize is %ld and maxmsg is %ld\n", pthread_self(), ma.mq_msgsize, ma.mq_maxmsg);
+/*
+ * Write as much pending output as the socket takes without blocking and
+ * watch for writability if something is left. Returns -1 if the
+ * connection is broken.
+ */
+static int client_flush(client_t *cl)
+{
+    struct epoll_event ev;
+    ssize_t written;
+
+    if (cl->shm)
+        return client_push(cl);
+    if (cl->loop->uring)
+        return client_submit(cl);
+    if ((written = client_write(cl)) == -1)
+        return -1;
+    ev.events = (cl->throttled ? 0 : EPOLLIN) | (cl->out.count > 0 ? EPOLLOUT : 0);
+    ev.data.ptr = cl;
+    epoll_ctl(cl->loop->epfd, EPOLL_CTL_MOD, cl->sock, &ev);
+    return 0;
+}
 
-    while (running) {
-        fd_set fds;
+/*
+ * Hold the output of a client back if it wrote less than a coalescing
+ * window ago, so that a burst of messages goes out in one write once the
+ * window is over. Later messages don't extend the window, which caps the
+ * delay, and the first message after a quiet period is written at once.
+ * Returns 1 if the output is held.
+ */
+static int client_hold(client_t *cl)
+{
+    loop_t *loop = cl->loop;
+    unsigned long now;
 
-        FD_ZERO(&fds);
-        FD_SET(cl->sock, &fds);                             /* Include client socket */
-        FD_SET(cl->mq, &fds);                               /* Include thread message queue */
+    if (coalesce_window == 0 || cl->held)
+        return cl->held;
+    if ((now = clock_us()) - cl->flushed_at >= coalesce_window)
+        return 0;
+    cl->held = 1;
+    cl->flush_at = now + coalesce_window;                           /* Same window for all, so the list stays sorted */
+    cl->held_next = NULL;
+    cl->held_prev = loop->held_tail;
+    if (loop->held_tail)
+        loop->held_tail->held_next = cl;
+    else
+        loop->held = cl;
+    loop->held_tail = cl;
+    return 1;
+}
 
-        if (select((cl->sock > cl->mq ? cl->sock : cl->mq) + 1, &fds, NULL, NULL, NULL) == -1) {
-            fprintf(stderr, "Thread %ld: ERROR in select() syscall\n", pthread_self());
-            continue;
+static void client_unhold(client_t *cl)
+{
+    loop_t *loop = cl->loop;
+
+    if (!cl->held)
+        return;
+    if (cl->held_prev)
+        cl->held_prev->held_next = cl->held_next;
+    else
+        loop->held = cl->held_next;
+    if (cl->held_next)
+        cl->held_next->held_prev = cl->held_prev;
+    else
+        loop->held_tail = cl->held_prev;
+    cl->held = 0;
+}
+
+/* Queue a client up for the next round, its share didn't cover all of its input */
+static void client_ready(client_t *cl)
+{
+    loop_t *loop = cl->loop;
+
+    if (cl->ready)
+        return;
+    cl->ready = 1;
+    cl->ready_next = NULL;
+    cl->ready_prev = loop->ready_tail;
+    if (loop->ready_tail)
+        loop->ready_tail->ready_next = cl;
+    else
+        loop->ready = cl;
+    loop->ready_tail = cl;
+    stats_add(&loop->stats, STATS_DEFERRED, 1);
+}
+
+static void client_unready(client_t *cl)
+{
+    loop_t *loop = cl->loop;
+
+    if (!cl->ready)
+        return;
+    if (cl->ready_prev)
+        cl->ready_prev->ready_next = cl->ready_next;
+    else
+        loop->ready = cl->ready_next;
+    if (cl->ready_next)
+        cl->ready_next->ready_prev = cl->ready_prev;
+    else
+        loop->ready_tail = cl->ready_prev;
+    cl->ready = 0;
+}
+
+/*
+ * Queue a reference to buf for a client and try to send it right away.
+ * Only the shard owning the client calls this, messages of other shards
+ * reach it through the inbox, so the queue needs no lock. If the client
+ * can't keep up the slow consumer policy decides, on failure the socket
+ * is shut down so that the loop notices and cleans up.
+ */
+static void client_send(client_t *cl, msgbuf_t *buf)
+{
+    int ret, flush = 0;
+
+    if (cl->broken)
+        return;
+    if ((ret = outq_push(&cl->out, buf, outq_policy)) == -1) {
+        LOG_ERROR(("Thread %ld: ERROR Client %s can't keep up with %lu bytes queued\n", pthread_self(), cl->name, (unsigned long)cl->out.bytes));
+        stats_add(&cl->loop->stats, STATS_SLOW_CLOSED, 1);
+        cl->broken = 1;
+    } else if (ret == 1) {
+        stats_add(&cl->loop->stats, STATS_DROPPED, 1);
+    } else {
+        stats_add(&cl->loop->stats, STATS_MSGS_OUT, 1);
+        stats_observe(&cl->loop->stats, STATS_QUEUE_DEPTH, cl->out.bytes);
+        if (cl->out.count == 1) {                                   /* Otherwise held, or EPOLLOUT or a send is pending */
+            flush = !client_hold(cl);
+        } else if (cl->held && cl->out.bytes >= coalesce_bytes) {   /* Enough for a full write, wait no longer */
+            client_unhold(cl);
+            flush = 1;
+        }
+        if (flush && client_flush(cl) == -1) {
+            LOG_ERROR(("Thread %ld: ERROR Unable to write to client %s\n", pthread_self(), cl->name));
+            stats_add(&cl->loop->stats, STATS_ERRORS, 1);
+            cl->broken = 1;
         }
+    }
+    if (cl->broken) {
+        outq_clear(&cl->out);
+        shutdown(cl->sock, SHUT_RDWR);
+    }
+}
 
-        switch (cl->state) {                                /* This little state-machine decides on */
-            case CLIENT_ACCEPTED:                           /* client status how to handle i/o */
-                if (FD_ISSET(cl->sock, &fds)) {
-                    if ((read_bytes = read(cl->sock, buf, BUFFER_SIZE)) < 0) {
-                        fprintf(stderr, "Thread %ld: ERROR Unable to read from client\n", pthread_self());
-                        cl->state = CLIENT_ERROR;
-                    } else {
-                        buf[read_bytes] = '\0';
-                        if (strncmp(buf, "JOIN\r\n", 6) == 0) {
-                            cl->state = CLIENT_JOINED;
-                            fprintf(stdout, "Thread %ld: Client %s joined conversation\n", pthread_self(), cl->name);
-                            if (write(cl->sock, "ACK\r\n", 5) < 0) {
-                                fprintf(stderr, "Thread %ld: ERROR Unable to write to client\n", pthread_self());
-                                cl->state = CLIENT_ERROR;
-                            }
-                        } else if (strncmp(buf, "QUIT\r\n", 6) == 0) {
-                            cl->state = CLIENT_QUIT;
-                            fprintf(stdout, "Thread %ld: Client %s leaves connection\n", pthread_self(), cl->name);
-                            if (write(cl->sock, "ACK\r\n", 5) < 0) {
-                                fprintf(stderr, "Thread %ld: ERROR Unable to write to client\n", pthread_self());
-                                cl->state = CLIENT_ERROR;
-                            }
-                        } else {
-                            fprintf(stderr, "Thread %ld: Client %s sent unknown command '%s'\n", pthread_self(), cl->name, buf);
-                        }
-                    }
-                } else if (FD_ISSET(cl->mq, &fds)) {
-                    char *msg_data = (char *)malloc(ma.mq_msgsize);
-
-                    if (mq_receive(cl->mq, msg_data, ma.mq_msgsize, NULL) == -1) {
-                        fprintf(stderr, "Thread %ld: Error in mq_receive() syscall\n", pthread_self());
-                    } else {
-                        fprintf(stderr, "Thread %ld: Received message '%s' in state ACCEPTED...\n", pthread_self(), ((message_t *)msg_data)->data);
-                        if (msg_data == 0) {
-                            cl->state = CLIENT_QUIT;
-                        }
-                    }
-                    free(msg_data);
-                }
-                break;
-            case CLIENT_JOINED:
-                if (FD_ISSET(cl->sock, &fds)) {
-                    if ((read_bytes = read(cl->sock, buf, BUFFER_SIZE)) < 0) {
-                        fprintf(stderr, "Thread %ld: ERROR Unable to read from client\n", pthread_self());
-                        cl->state = CLIENT_ERROR;
-                    } else {
-                        buf[read_bytes] = '\0';
-                        if (strncmp(buf, "QUIT\r\n", 6) == 0) {
-                            cl->state = CLIENT_QUIT;
-                            fprintf(stdout, "Thread %ld: Client %s leaved conversation\n", pthread_self(), cl->name);
-                            if (write(cl->sock, "ACK\r\n", 5) < 0) {
-                                fprintf(stderr, "Thread %ld: ERROR Unable to write to client\n", pthread_self());
-                                cl->state = CLIENT_ERROR;
-                            }
-                        } else {
-                            message_t msg;
-                            strcpy(msg.sender, cl->name);
-                            strcpy(msg.data, buf);
-                            msg.sock = cl->sock;
-                            fprintf(stdout, "Thread %ld: Client %s sent message '%s'\n", pthread_self(), msg.sender, msg.data);
-                            list_apply(&client_list, client_message_callback, &msg);
-                        }
-                    }
-                } else if (FD_ISSET(cl->mq, &fds)) {
-                    char *msg_data = (char *)malloc(ma.mq_msgsize);
-
-                    if (mq_receive(cl->mq, msg_data, ma.mq_msgsize, NULL) == -1) {
-                        fprintf(stderr, "Thread %ld: Error in mq_receive() syscall\n", pthread_self());
-                    } else {
-                        fprintf(stderr, "Thread %ld: Received message '%s' ...\n", pthread_self(), ((message_t *)msg_data)->data);
-                        if (msg_data == 0) {
-                            cl->state = CLIENT_QUIT;
-                        } else {
-                            sprintf(buf, "%s: %s", ((message_t *)msg_data)->sender, ((message_t *)msg_data)->data);
-                            fprintf(stdout, "Thread %ld: Send message to clients ...\n", pthread_self());
-                            if (write(cl->sock, buf, strlen(buf)) < 0) {
-                                fprintf(stderr, "Thread %ld: ERROR Unable to write to client\n", pthread_self());
-                                cl->state = CLIENT_ERROR;
-                            }
-                        }
-                    }
-                    free(msg_data);
-                }
-                break;
-            case CLIENT_ERROR:
-            case CLIENT_QUIT:
-                running = 0;
-                break;
+/*
+ * Format a message in the wire form of text or binary clients. Text
+ * clients get "sender: payload" or "sender (private): payload" as one
+ * line, binary clients a frame carrying the sender id.
+ */
+static msgbuf_t *message_new(slab_t *slab, int binary, int direct, const char *topic, size_t topic_len,
+        const char *label, size_t label_len, unsigned long sender, const char *payload, size_t len)
+{
+    const char *sep = direct ? " (private): " : ": ";
+    size_t head = binary ? FRAME_HEADER_SIZE : label_len + strlen(sep);
+    msgbuf_t *buf;
+    char *p;
+
+    if (!(buf = msgbuf_new_message(slab, head + len + (binary ? 0 : 1), topic, topic_len, label, label_len)))
+        return NULL;
+    buf->direct = direct;
+    buf->binary = binary;
+    buf->sender = sender;
+    buf->payload = head;
+    buf->payload_len = len;
+    if (binary) {
+        frame_header(buf->data, direct ? FRAME_DIRECT : FRAME_MSG, sender, len);
+        memcpy(buf->data + head, payload, len);
+    } else {
+        memcpy(buf->data, label, label_len);
+        memcpy(buf->data + label_len, sep, head - label_len);
+        for (p = buf->data + head; len > 0; len--, payload++)       /* Line breaks of binary payloads would split the line */
+            *p++ = *payload == '\n' ? ' ' : *payload;
+        *p = '\n';
+    }
+    return buf;
+}
+
+/* The same message in the other wire form */
+static msgbuf_t *message_translate(loop_t *loop, msgbuf_t *buf)
+{
+    msgbuf_t *alt;
+
+    stats_add(&loop->stats, STATS_TRANSLATED, 1);
+    if ((alt = message_new(&loop->slab, !buf->binary, buf->direct, buf->topic, buf->topic_len,
+            buf->label, buf->label_len, buf->sender, buf->data + buf->payload, buf->payload_len))) {
+        alt->trace = buf->trace;                                    /* Its writes complete the delivery all the same */
+        alt->read_at = buf->read_at;
+    }
+    return alt;
+}
+
+/* Pick every trace_every-th message a shard publishes for tracing */
+static void message_sample(loop_t *loop, msgbuf_t *buf, unsigned long read_at)
+{
+    if (!trace_every || ++loop->sampled < trace_every)
+        return;
+    loop->sampled = 0;
+    buf->trace = __atomic_add_fetch(&trace_ids, 1, __ATOMIC_RELAXED);
+    buf->read_at = read_at;
+}
+
+/*
+ * Compress the payload of a message for the clients asking for it, once
+ * for all shards, which share the frame through the message. Left out
+ * for short payloads, if nobody asks, and if it wouldn't get shorter.
+ */
+static void message_deflate(loop_t *loop, msgbuf_t *buf)
+{
+    struct timespec start, end;
+    unsigned long cpu, now;
+    msgbuf_t *frame;
+    ssize_t len;
+
+    if (buf->payload_len < deflate_min || __atomic_load_n(&deflate_clients, __ATOMIC_RELAXED) == 0)
+        return;
+    if (!(frame = msgbuf_new(&loop->slab, FRAME_HEADER_SIZE + buf->payload_len))) {
+        LOG_ERROR(("Thread %ld: ERROR Out of memory, message is not compressed\n", pthread_self()));
+        return;
+    }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    len = zip_compress(&loop->zip, buf->data + buf->payload, buf->payload_len, frame->data + FRAME_HEADER_SIZE, buf->payload_len);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+    cpu = (end.tv_sec - start.tv_sec) * 1000000000UL + end.tv_nsec - start.tv_nsec;
+    stats_add(&loop->stats, STATS_COMPRESS_NS, cpu);
+    if (buf->trace) {                                               /* Ends now, lasted as long as it took the CPU */
+        now = trace_now();
+        trace_record(&loop->trace, "compress", TRACE_SLICE, buf->trace, now - cpu, now, len == -1 ? 0 : len);
+    }
+    if (len == -1) {
+        msgbuf_unref(frame);
+        return;
+    }
+    frame->trace = buf->trace;
+    frame->read_at = buf->read_at;
+    frame_header(frame->data, FRAME_DEFLATE, buf->sender, len);
+    frame->len = FRAME_HEADER_SIZE + len;
+    frame->binary = 1;
+    buf->deflated = frame;
+    stats_add(&loop->stats, STATS_COMPRESSED, 1);
+    stats_add(&loop->stats, STATS_COMPRESS_IN, buf->payload_len);
+    stats_add(&loop->stats, STATS_COMPRESS_OUT, len);
+}
+
+void client_message_callback(room_member_t *member, void *msg)
+{
+    client_t *client = (client_t *)member->data;
+    message_t *message = (message_t*)msg;
+
+    if (client->sock != message->sock && client->state == CLIENT_JOINED
+            && (message->buf->seq == 0 || message->buf->seq > client->history_seq)) {  /* Not replayed already */
+        if (client->deflate && message->buf->deflated) {            /* Compressed once for all nodes and shards */
+            client_send(client, message->buf->deflated);
+            stats_add(&client->loop->stats, STATS_DEFLATED_OUT, 1);
+        } else if (client->binary == message->buf->binary) {
+            client_send(client, message->buf);
+        } else if (message->alt || (message->alt = message_translate(client->loop, message->buf))) {
+            client_send(client, message->alt);                      /* Translated once per shard */
         }
+        message->recipients++;
     }
+}
 
-    list_remove(&client_list, (void *)arg);                         /* Remove this client from the client list */
-    free(arg);
+void client_quit_callback(registry_entry_t *entry, void *data)
+{
+    client_t *cl = (client_t *)entry->data;
 
-    shutdown(cl->sock, 2); close(cl->sock);                         /* Terminate and close client socket */
-    sprintf(buf, "/%s:%d", cl->name, cl->sock);                     /* Close and unlink message queue */
-    mq_close(cl->mq); mq_unlink(buf);                               /* Close message queue */
-    fprintf(stdout, "Thread %ld: Closed connection for %s on socket %d\n", pthread_self(), cl->name, cl->sock);
-    free(cl);
-    pthread_exit((void *)EXIT_SUCCESS);
+    if (!cl->handed_off)                                            /* Closed with this process, the successor serves it on */
+        shutdown(cl->sock, SHUT_RDWR);
 }
 
-void sig_handler(int sig)
+void client_stats_callback(registry_entry_t *entry, void *data)
 {
-    fprintf(stdout, "Server: Disconnect all clients ...\n");
-    list_apply((list_t *)&client_list, client_quit_callback, NULL); /* Call quit callback for every client in list */
-    list_destroy((list_t *)&client_list);
-    close(server_sock);
-    fprintf(stdout, "Server: Shutdown ...\n");
-    exit(EXIT_SUCCESS);                                             /* That's it, main thread goes out of business */
+    client_t *cl = (client_t *)entry->data;
+
+    fprintf(stdout, "Server: Client %s on socket %d has %lu bytes in %u messages queued, peak %lu bytes, dropped %lu messages\n",
+            cl->name, cl->sock, (unsigned long)cl->out.bytes, cl->out.count, (unsigned long)cl->out.peak, cl->out.drops);
 }
 
-int main(int argc, char **argv)
+/*
+ * Called by the registry once no broadcast can reach the client anymore.
+ * Only now the socket may be closed, otherwise a new connection could
+ * reuse the descriptor while a broadcast still writes to it.
+ */
+static void client_release(registry_entry_t *entry)
 {
-    struct sigaction action; sigset_t sigs;
-    int eins_val = 1;
+    client_t *cl = (client_t *)entry->data;
 
-    if ((server_sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        perror("socket()"); exit(EXIT_FAILURE);
+    close(cl->sock);
+    if (cl->deflate)
+        __atomic_sub_fetch(&deflate_clients, 1, __ATOMIC_RELAXED);
+    if (cl->shm) {
+        shm_destroy(cl->shm);
+        free(cl->shm);
     }
+    outq_destroy(&cl->out);
+    free(cl->spill);
+    pool_free(cl);
+}
+
+/* Whether a node may link in from addr: a peer on the command line runs there or the host is allowed */
+static int link_allowed(const struct sockaddr_in *addr)
+{
+    int i;
 
-    sigfillset(&sigs);                                          /* Mostly to keep valgrind happy */
-    action.sa_flags = 0;
-    action.sa_handler = sig_handler;                            /* Set up signal handler for some cleanup */
-    action.sa_mask = sigs;                                      /* and housekeeping before we terminate */
-    sigaction(SIGINT, &action, NULL);
-    sigaction(SIGTERM, &action, NULL);
+    for (i = 0; i < peer_count; i++)
+        if (peers[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr)
+            return 1;
+    for (i = 0; i < allowed_count; i++)
+        if (allowed[i].s_addr == addr->sin_addr.s_addr)
+            return 1;
+    return 0;
+}
 
-    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &eins_val, sizeof(eins_val));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(SERVER_LISTEN_PORT);           /* Set up listen socket */
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);            /* Accept any incomming address */
-    if (bind(server_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
-        close(server_sock); perror("bind()"); exit(EXIT_FAILURE);
+/*
+ * Turn a connection into a link to a peer node, relay frames flow both
+ * ways from now on. Accepted links know the node id the peer introduced
+ * itself with, dialed ones the peer they were dialed to. Links are only
+ * accepted from the hosts of the peers and those allowed with -A, they
+ * bypass the rate limits and relay for every client.
+ */
+static void client_link(client_t *cl, unsigned long node, peer_t *peer)
+{
+    loop_t *loop = cl->loop;
+    int one = 1;
+
+    cl->peer = peer;
+    if (!peer && (node == 0 || !link_allowed(&cl->addr))) {
+        LOG_WARN(("Thread %ld: Refusing link from %s, not a peer\n", pthread_self(), cl->name));
+        cl->state = CLIENT_ERROR;
+        return;
     }
-    if (listen(server_sock, SERVER_LISTEN_BACKLOG) == -1) {
-        close(server_sock); perror("listen()"); exit(EXIT_FAILURE);
+    if (node == node_id || loop->link_count == SERVER_MAX_LINKS) {
+        LOG_WARN(("Thread %ld: Refusing link to node %lu at %s\n", pthread_self(), node, cl->name));
+        cl->state = CLIENT_ERROR;
+        return;
     }
-    fprintf(stdout, "Server: Listening on %d ...\n", SERVER_LISTEN_PORT);
+    capture_record(loop->capture, CAPTURE_CLOSE, cl->id, NULL, 0);  /* Relayed traffic is no client's to replay */
+    cl->state = CLIENT_PEER;
+    cl->binary = 1;
+    cl->node = node;
+    loop->links[loop->link_count++] = cl;
+    if (ping_interval == 0)                                         /* Links are silent when nobody talks */
+        wheel_del(&loop->timers, &cl->timer);
+    setsockopt(cl->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));  /* Batched by the output queue already */
+    if (peer)
+        LOG_INFO(("Thread %ld: Linked to peer %s on socket %d\n", pthread_self(), peer->name, cl->sock));
+    else
+        LOG_INFO(("Thread %ld: Linked to node %lu at %s on socket %d\n", pthread_self(), node, cl->name, cl->sock));
+}
 
-    list_init(&client_list);
+/* Forget a link once it is closed, a dialed one is dialed again */
+static void client_unlink(client_t *cl)
+{
+    loop_t *loop = cl->loop;
+    int i;
 
-    while (2) {
-        client_t *cl = (client_t *)malloc(sizeof(client_t));    /* Allocate some mem for or client struct */
+    for (i = 0; i < loop->link_count; i++) {
+        if (loop->links[i] == cl) {
+            loop->links[i] = loop->links[--loop->link_count];
+            LOG_INFO(("Thread %ld: Link to peer %s is down\n", pthread_self(), cl->peer ? cl->peer->name : cl->name));
+            break;
+        }
+    }
+    if (cl->peer)
+        __atomic_store_n(&cl->peer->up, 0, __ATOMIC_RELEASE);
+}
+
+static void client_close(client_t *cl)
+{
+    if (cl->loop->uring) {
+        uring_cancel(&cl->loop->ring, uring_data(cl, LOOP_RECV));
+        uring_enter(&cl->loop->ring, 0, -1);                            /* Sends queued before, like a last ACK, go first */
+    } else
+        epoll_ctl(cl->loop->epfd, EPOLL_CTL_DEL, cl->sock, NULL);
+    client_unhold(cl);
+    client_unready(cl);
+    client_unlink(cl);
+    wheel_del(&cl->loop->timers, &cl->timer);
+    wheel_del(&cl->loop->timers, &cl->resume);
+    shutdown(cl->sock, 2);                                          /* Terminate client socket */
+    if (cl->state != CLIENT_PEER)
+        capture_record(cl->loop->capture, CAPTURE_CLOSE, cl->id, NULL, 0);
+    LOG_INFO(("Thread %ld: Closed connection for %s on socket %d, peak queue %lu bytes, dropped %lu messages\n",
+            pthread_self(), cl->name, cl->sock, (unsigned long)cl->out.peak, cl->out.drops));
+    room_leave(&cl->loop->rooms, &cl->member);                      /* Frees the room if it was the last member */
+    nick_unregister(&nicks, &cl->nick);                             /* Messages still on their way are dropped */
+    cl->state = CLIENT_CLOSED;
+    if (cl->pending == 0)                                           /* Otherwise once the kernel is done with it */
+        registry_remove(&cl->loop->clients, &cl->entry);            /* Released when no broadcast sees it anymore */
+}
+
+/* Tick at which the client has been silent too long, for a PING or for good */
+static unsigned long client_deadline(client_t *cl)
+{
+    unsigned long deadline = 0;
+
+    if (ping_interval > 0)
+        deadline = (cl->pinged ? cl->pinged : cl->active) + ping_interval;
+    if (idle_timeout > 0 && (deadline == 0 || (long)(cl->active + idle_timeout - deadline) < 0))
+        deadline = cl->active + idle_timeout;
+    return deadline;
+}
+
+/*
+ * Timer of a client fired. Input doesn't touch the timer, it only notes
+ * the tick, so the deadline is checked against that here: a client that
+ * was silent too long gets a PING or is disconnected, any other gets its
+ * timer armed again.
+ */
+static void client_timer_callback(wheel_timer_t *timer, void *data)
+{
+    client_t *cl = (client_t *)timer->data;
+    loop_t *loop = cl->loop;
+
+    if (idle_timeout > 0 && (long)(loop->tick - cl->active) >= (long)idle_timeout) {
+        LOG_INFO(("Thread %ld: Client %s idle for too long\n", pthread_self(), cl->name));
+        stats_add(&loop->stats, STATS_IDLE_CLOSED, 1);
+        client_close(cl);
+        return;
+    }
+    if (cl->pinged && (long)(loop->tick - cl->pinged) >= (long)ping_interval) {
+        LOG_INFO(("Thread %ld: Client %s didn't answer PING\n", pthread_self(), cl->name));
+        stats_add(&loop->stats, STATS_HEARTBEAT_CLOSED, 1);
+        client_close(cl);
+        return;
+    }
+    if (ping_interval > 0 && !cl->pinged && (long)(loop->tick - cl->active) >= (long)ping_interval) {
+        client_send(cl, ping_buf[cl->binary]);
+        cl->pinged = loop->tick;
+        stats_add(&loop->stats, STATS_PINGS, 1);
+    }
+    wheel_add(&loop->timers, timer, client_deadline(cl));
+}
+
+/* Arm the multishot receive of an io_uring client, unless the loop is parking */
+static int client_receive(client_t *cl)
+{
+    if (cl->loop->parking)
+        return 0;
+    if (uring_recv_multishot(&cl->loop->ring, cl->sock, uring_data(cl, LOOP_RECV)) == -1)
+        return -1;
+    cl->receiving = 1;
+    cl->pending++;
+    return 0;
+}
+
+/* Set up a freshly accepted client and start watching its socket */
+static void client_init(loop_t *loop, client_t *cl)
+{
+    struct epoll_event ev;
+    unsigned long now = rate_msgs > 0 || rate_bytes > 0 ? clock_us() : 0;
+    int one = 1;
+
+    frame_init(&cl->in, BUFFER_SIZE, cl->inbuf, sizeof(cl->inbuf));
+    cl->state = CLIENT_ACCEPTED;                                    /* Seems like we have a new client to serve */
+    if (cl->addr.sin_family == AF_INET)
+        inet_ntop(AF_INET, &cl->addr.sin_addr, cl->name, sizeof(cl->name));
+    else
+        strcpy(cl->name, "local");
+    cl->loop = loop;
+    outq_init(&cl->out, outq_high, outq_low);
+    cl->broken = 0;
+    memset(&cl->msg, 0, sizeof(cl->msg));
+    cl->msg.msg_iov = cl->iov;
+    cl->sending = cl->pending = 0;
+    cl->held = 0;
+    cl->flushed_at = 0;
+    wheel_timer_init(&cl->timer, cl);
+    cl->active = loop->tick;
+    cl->pinged = 0;
+    cl->read_at = 0;
+    if (idle_timeout > 0 || ping_interval > 0)
+        wheel_add(&loop->timers, &cl->timer, client_deadline(cl));
+    cl->ready = 0;
+    cl->deficit = 0;
+    bucket_init(&cl->msg_rate, rate_msgs, rate_msgs, now);          /* Bursts of up to a second */
+    bucket_init(&cl->byte_rate, rate_bytes, rate_bytes, now);
+    cl->throttled = 0;
+    wheel_timer_init(&cl->resume, cl);
+    cl->spill = NULL;
+    cl->spill_len = cl->spill_size = 0;
+    cl->receiving = 0;
+    LOG_INFO(("Thread %ld: Accepted client %s on socket %d\n", pthread_self(), cl->name, cl->sock));
+    stats_add(&loop->stats, STATS_ACCEPTED, 1);
+
+    cl->member.data = cl;
+    cl->member.room = NULL;                                         /* Not in any room before JOIN */
+    cl->nick.data = cl;
+    cl->nick.shard = loop->index;
+    cl->nick.len = 0;
+    cl->id = __atomic_add_fetch(&client_ids, 1, __ATOMIC_RELAXED) & 0xffffffffUL;
+    cl->binary = 0;
+    cl->deflate = 0;
+    cl->history_last = history_replay_last;
+    cl->history_since = cl->history_seq = 0;
+    cl->node = 0;
+    cl->peer = NULL;
+    cl->shm = NULL;
+    cl->handed_off = 0;
+    cl->entry.data = cl;                                            /* Stuff it into the registry of our shard */
+    registry_add(&loop->clients, &cl->entry);
+    capture_record(loop->capture, CAPTURE_CONNECT, cl->id, NULL, 0);
+
+    if (coalesce_window > 0)                                        /* Writes are coalesced here instead of by Nagle */
+        setsockopt(cl->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (loop->uring) {
+        if (client_receive(cl) == 0)
+            return;
+        LOG_ERROR(("Thread %ld: ERROR Submission queue full\n", pthread_self()));
+    } else {
+        ev.events = EPOLLIN;
+        ev.data.ptr = cl;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, cl->sock, &ev) == 0)
+            return;
+        LOG_ERROR(("Thread %ld: ERROR in epoll_ctl() syscall\n", pthread_self()));
+    }
+    client_close(cl);
+}
+
+static void client_accept(loop_t *loop)
+{
+    while (1) {
+        client_t *cl = (client_t *)pool_alloc(&loop->client_pool);  /* Allocate some mem for or client struct */
+
+        if (!cl) {
+            LOG_ERROR(("Thread %ld: ERROR Out of memory, not accepting clients\n", pthread_self()));
+            return;
+        }
         cl->socklen = sizeof(struct sockaddr);
 
-        if ((cl->sock = accept(server_sock, (struct sockaddr *)&cl->addr, &cl->socklen)) == -1) {
-            free(cl);                                           /* Gentle reaction cause we continue looping */
-            fprintf(stderr, "Server: ERROR in accept() syscall, bad luck for client\n");
-        } else {
-            pthread_t tid;
-            list_item_t *item;
-            char mqname[BUFFER_SIZE];                           /* Used to compose a message queue name in the form "/%s" */
-
-            cl->state = CLIENT_ACCEPTED;                        /* Seems like we have a new client to serve */
-            strcpy(cl->name, inet_ntoa(cl->addr.sin_addr));
-            sprintf(mqname, "/%s:%d", cl->name, cl->sock);      /* Create a distinct name for the message queue */
-            if ((cl->mq = mq_open(mqname, O_RDWR | O_CREAT, S_IRWXU, NULL)) == -1) {
-                fprintf(stderr, "Server: Unable to create message queue for client %s on socket %d\n", cl->name, cl->sock);
-                kill(getpid(), SIGTERM);
-            }
-            fprintf(stdout, "Server: Accepted client %s on socket %d\n", cl->name, cl->sock);
+        if ((cl->sock = accept4(loop->listen_sock, (struct sockaddr *)&cl->addr, &cl->socklen, SOCK_NONBLOCK)) == -1) {
+            pool_free(cl);                                          /* Backlog is empty */
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                LOG_ERROR(("Thread %ld: ERROR in accept() syscall, bad luck for client\n", pthread_self()));
+            return;
+        }
+        client_init(loop, cl);
+    }
+}
+
+/* A client accepted by the multishot accept of an io_uring loop */
+static void client_accepted(loop_t *loop, int sock)
+{
+    client_t *cl = (client_t *)pool_alloc(&loop->client_pool);
 
-            item = (list_item_t *)malloc(sizeof(list_item_t));  /* Wrap all this into a list item and stuff it into */
-            item->data = cl;                                    /* our global client list */
-            item->_next = 0;
-            list_add(&client_list, item);
+    if (!cl) {
+        LOG_ERROR(("Thread %ld: ERROR Out of memory, not accepting clients\n", pthread_self()));
+        close(sock);
+        return;
+    }
+    cl->sock = sock;
+    cl->socklen = sizeof(struct sockaddr);
+    if (getpeername(sock, (struct sockaddr *)&cl->addr, &cl->socklen) == -1)
+        memset(&cl->addr, 0, sizeof(cl->addr));
+    client_init(loop, cl);
+}
 
-            if ((pthread_create(&tid, NULL, thread_func, (void*)item)) != 0) {
-                fprintf(stderr, "Server: ERROR in pthread_create() syscall\n");
-                kill(getpid(), SIGTERM);
-            } else {
-                pthread_detach(tid);                            /* Shoot and forget the thread*/
+/* A client on this host connected to the local socket, it gets its rings with the greeting */
+static void client_local(loop_t *loop, int sock)
+{
+    client_t *cl = (client_t *)pool_alloc(&loop->client_pool);
+    shm_t *shm = (shm_t *)malloc(sizeof(shm_t));
+
+    if (!cl || !shm || shm_create(shm, SERVER_SHM_RING) == -1) {
+        LOG_ERROR(("Thread %ld: ERROR Out of memory, not accepting local client\n", pthread_self()));
+        free(shm);
+        if (cl)
+            pool_free(cl);
+        close(sock);
+        return;
+    }
+    if (shm_send(sock, shm) == -1) {
+        LOG_ERROR(("Thread %ld: ERROR Unable to greet local client\n", pthread_self()));
+        shm_destroy(shm);
+        free(shm);
+        pool_free(cl);
+        close(sock);
+        return;
+    }
+    cl->sock = sock;
+    memset(&cl->addr, 0, sizeof(cl->addr));
+    cl->socklen = sizeof(cl->addr);
+    client_init(loop, cl);
+    if (cl->state == CLIENT_CLOSED) {
+        shm_destroy(shm);
+        free(shm);
+        return;
+    }
+    cl->shm = shm;
+}
+
+static void client_accept_local(loop_t *loop)
+{
+    int sock;
+
+    while ((sock = accept4(local_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+        client_local(loop, sock);
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        LOG_ERROR(("Thread %ld: ERROR in accept() syscall, bad luck for local client\n", pthread_self()));
+}
+
+/*
+ * Relay a message to the peer nodes linked to this shard, all but the
+ * one it came from. The relay frame is made once for all of them.
+ */
+static void loop_relay(loop_t *loop, msgbuf_t *buf)
+{
+    msgbuf_t *frame = NULL;
+    relay_t r;
+    int i;
+
+    for (i = 0; i < loop->link_count; i++) {
+        if (loop->links[i] == buf->via)
+            continue;
+        if (!frame) {
+            r.origin = buf->origin;
+            r.seq = buf->origin_seq;
+            r.binary = buf->binary;
+            r.sender = buf->sender;
+            r.room = buf->topic;
+            r.room_len = buf->topic_len;
+            r.label = buf->label;
+            r.label_len = buf->label_len;
+            r.payload = buf->data + buf->payload;
+            r.len = buf->payload_len;
+            if (relay_size(&r) > SERVER_READ_SIZE) {                /* Peers would discard it */
+                LOG_WARN(("Thread %ld: Message too large to relay\n", pthread_self()));
+                return;
+            }
+            if (!(frame = msgbuf_new(&loop->slab, relay_size(&r)))) {
+                LOG_ERROR(("Thread %ld: ERROR Out of memory, message is not relayed\n", pthread_self()));
+                return;
             }
+            relay_encode(frame->data, &r);
+            frame->binary = 1;
+        }
+        client_send(loop->links[i], frame);
+        stats_add(&loop->stats, STATS_RELAYED_OUT, 1);
+    }
+    msgbuf_unref(frame);
+}
+
+/*
+ * Queue a message for the members of its room on this shard, timing the
+ * fan-out, and relay it to the peers linked to this shard. Drops the
+ * reference to the other wire form, if there is one.
+ */
+static void loop_broadcast(loop_t *loop, message_t *msg)
+{
+    struct timespec start, end;
+    room_t *room;
+
+    if (loop->link_count > 0)
+        loop_relay(loop, msg->buf);
+    if (!(room = room_find(&loop->rooms, msg->buf->topic, msg->buf->topic_len))) {
+        msgbuf_unref(msg->alt);                                     /* Nobody listening here */
+        return;
+    }
+    msg->recipients = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    room_apply(room, client_message_callback, msg);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    msgbuf_unref(msg->alt);
+    if (msg->buf->trace)
+        trace_record(&loop->trace, "fanout", TRACE_SLICE, msg->buf->trace, start.tv_sec * 1000000000UL + start.tv_nsec,
+                end.tv_sec * 1000000000UL + end.tv_nsec, msg->recipients);
+    stats_observe(&loop->stats, STATS_FANOUT, msg->recipients);
+    stats_observe(&loop->stats, STATS_BROADCAST_NS,
+            (end.tv_sec - start.tv_sec) * 1000000000UL + end.tv_nsec - start.tv_nsec);
+}
+
+/*
+ * Deliver a direct message if its recipient belongs to this shard. The
+ * recipient is looked up again, it may have left or been renamed since
+ * the sender looked.
+ */
+static void loop_direct(loop_t *loop, msgbuf_t *buf)
+{
+    client_t *to;
+    msgbuf_t *alt;
+    int shard;
+
+    if (nick_lookup(&nicks, buf->topic, buf->topic_len, (void **)&to, &shard) == -1 || shard != loop->index)
+        return;
+    if (to->state != CLIENT_JOINED)
+        return;
+    if (to->binary == buf->binary) {
+        client_send(to, buf);
+    } else if ((alt = message_translate(loop, buf))) {
+        client_send(to, alt);
+        msgbuf_unref(alt);
+    }
+    stats_observe(&loop->stats, STATS_FANOUT, 1);
+}
+
+/* Hand a message over to another shard */
+static void loop_push(loop_t *loop, loop_t *dst, msgbuf_t *buf)
+{
+    uint64_t one = 1;
+
+    if (spsc_push(&dst->inbox[loop->index], msgbuf_ref(buf)) == -1) {
+        msgbuf_unref(buf);
+        __atomic_add_fetch(&dst->overflows, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (__atomic_exchange_n(&dst->notified, 1, __ATOMIC_SEQ_CST) == 0 && write(dst->evfd, &one, sizeof(one)) < 0)
+        LOG_ERROR(("Thread %ld: ERROR Unable to wake up shard %d\n", pthread_self(), dst->index));
+}
+
+/* Hand a message over to every other shard for delivery to its clients */
+static void loop_forward(loop_t *loop, msgbuf_t *buf)
+{
+    int i;
+
+    if (buf->trace)
+        buf->forwarded_at = trace_now();                            /* Before the other shards can see it */
+    for (i = 0; i < loop_count; i++)
+        if (&loops[i] != loop)
+            loop_push(loop, &loops[i], buf);
+    if (buf->trace)
+        trace_record(&loop->trace, "forward", TRACE_SLICE, buf->trace, buf->forwarded_at, trace_now(), loop_count - 1);
+}
+
+/* Take on the links the dialer made to the peers of this shard */
+static void loop_dialed(loop_t *loop)
+{
+    client_t *cl;
+    int i, sock;
+
+    for (i = 0; i < peer_count; i++) {
+        if (peers[i].loop != loop || (sock = __atomic_exchange_n(&peers[i].sock, -1, __ATOMIC_ACQUIRE)) == -1)
+            continue;
+        if (!(cl = (client_t *)pool_alloc(&loop->client_pool))) {
+            LOG_ERROR(("Thread %ld: ERROR Out of memory, dropping link to peer %s\n", pthread_self(), peers[i].name));
+            close(sock);
+            __atomic_store_n(&peers[i].up, 0, __ATOMIC_RELEASE);
+            continue;
+        }
+        cl->sock = sock;
+        cl->addr = peers[i].addr;
+        cl->socklen = sizeof(cl->addr);
+        client_init(loop, cl);
+        if (cl->state != CLIENT_ACCEPTED) {                         /* Closed already */
+            __atomic_store_n(&peers[i].up, 0, __ATOMIC_RELEASE);
+            continue;
+        }
+        client_link(cl, 0, &peers[i]);
+        if (cl->state == CLIENT_ERROR)
+            client_close(cl);
+    }
+}
+
+/* Deliver what other shards handed over to the clients of this shard */
+static void loop_drain(loop_t *loop)
+{
+    uint64_t count;
+    message_t msg;
+    int i;
+
+    if (read(loop->evfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        LOG_ERROR(("Thread %ld: ERROR in read() from eventfd\n", pthread_self()));
+    __atomic_store_n(&loop->notified, 0, __ATOMIC_SEQ_CST);    /* Later pushes signal again */
+    if (peer_count > 0)
+        loop_dialed(loop);
+    msg.sock = -1;
+    for (i = 0; i < loop_count; i++) {
+        if (i == loop->index)
+            continue;
+        while ((msg.buf = (msgbuf_t *)spsc_pop(&loop->inbox[i]))) {
+            msg.alt = NULL;
+            if (msg.buf->trace)                                     /* Waited in the queue from shard i */
+                trace_record(&loop->trace, "queue", TRACE_WAIT, msg.buf->trace, msg.buf->forwarded_at, trace_now(), i);
+            if (msg.buf->direct)
+                loop_direct(loop, msg.buf);
+            else
+                loop_broadcast(loop, &msg);
+            msgbuf_unref(msg.buf);
+        }
+    }
+}
+
+/* Length of a line without its LF or CRLF terminator */
+static size_t line_length(const char *line, size_t len)
+{
+    if (len > 0 && line[len - 1] == '\n')
+        len--;
+    if (len > 0 && line[len - 1] == '\r')
+        len--;
+    return len;
+}
+
+/* Matches a command line, which may end in CRLF or just LF */
+static int is_command(const char *line, size_t len, const char *cmd)
+{
+    size_t cmd_len = strlen(cmd);
+
+    len = line_length(line, len);
+    return len == cmd_len && memcmp(line, cmd, cmd_len) == 0;
+}
+
+/* Matches a command with one argument, eg. "NICK name", and returns where it starts */
+static int is_command_arg(const char *line, size_t len, const char *cmd, const char **arg, size_t *arg_len)
+{
+    size_t cmd_len = strlen(cmd);
+
+    len = line_length(line, len);
+    if (len <= cmd_len + 1 || memcmp(line, cmd, cmd_len) != 0 || line[cmd_len] != ' ')
+        return 0;
+    *arg = line + cmd_len + 1;
+    *arg_len = len - cmd_len - 1;
+    return 1;
+}
+
+/*
+ * Matches a join command like "JOIN" with an optional room name, the
+ * command alone enters the default room which has an empty name.
+ */
+static int is_join(const char *line, size_t len, const char *cmd, const char **room, size_t *room_len)
+{
+    if (is_command(line, len, cmd)) {
+        *room = line;
+        *room_len = 0;
+        return 1;
+    }
+    return is_command_arg(line, len, cmd, room, room_len) && room_valid(*room, *room_len);
+}
+
+typedef struct replay {
+    client_t *cl;
+    msgbuf_t *range;                /* File range not yet queued, grows while records are adjacent */
+    unsigned long segment;
+} replay_t;
+
+static void client_replay_range(replay_t *replay)
+{
+    if (replay->range) {
+        client_send(replay->cl, replay->range);
+        msgbuf_unref(replay->range);
+        replay->range = NULL;
+    }
+}
+
+/* Text clients get file ranges for sendfile(), binary clients frames copied from the log */
+void client_replay_callback(const history_record_t *rec, int fd, const char *text, void *data)
+{
+    replay_t *replay = (replay_t *)data;
+    client_t *cl = replay->cl;
+    msgbuf_t *buf;
+
+    stats_add(&cl->loop->stats, STATS_REPLAYED, 1);
+    if (cl->binary) {                                               /* "label: payload\n" */
+        if ((buf = message_new(&cl->loop->slab, 1, 0, rec->room, rec->room_len, text, rec->label_len, rec->sender,
+                text + rec->label_len + 2, rec->len - rec->label_len - 3))) {
+            client_send(cl, buf);
+            msgbuf_unref(buf);
+        }
+        return;
+    }
+    if (replay->range && replay->segment == rec->segment
+            && replay->range->offset + (off_t)replay->range->len == (off_t)rec->offset) {
+        replay->range->len += rec->len;
+        return;
+    }
+    client_replay_range(replay);
+    if ((fd = dup(fd)) == -1)                                       /* The segment may be gone before it is sent */
+        return;
+    if (!(replay->range = msgbuf_new_file(NULL, fd, rec->offset, rec->len))) {
+        close(fd);
+        return;
+    }
+    replay->segment = rec->segment;
+}
+
+/*
+ * Queue the history of the room just joined behind the ACK. It is sent
+ * from the output queue like everything else, taking at most half of
+ * what is left of it.
+ */
+static void client_replay(client_t *cl)
+{
+    room_t *room = cl->member.room;
+    size_t room_left = cl->out.bytes < outq_high ? (outq_high - cl->out.bytes) / 2 : 0;
+    replay_t replay;
+
+    replay.cl = cl;
+    replay.range = NULL;
+    cl->history_seq = history_replay(&history, room->name, room->len, cl->history_since,
+            cl->history_since ? (size_t)-1 : cl->history_last, room_left, client_replay_callback, &replay);
+    client_replay_range(&replay);
+}
+
+/* Enter a room, leaving the previous one */
+static void client_join(client_t *cl, const char *room, size_t room_len)
+{
+    room_leave(&cl->loop->rooms, &cl->member);
+    if (!room_join(&cl->loop->rooms, room, room_len, &cl->member)) {
+        LOG_ERROR(("Thread %ld: ERROR Out of memory, client %s can't join room '%.*s'\n", pthread_self(), cl->name, (int)room_len, room));
+        cl->state = CLIENT_ERROR;
+        return;
+    }
+    if (cl->state != CLIENT_JOINED) {
+        cl->state = CLIENT_JOINED;
+        stats_add(&cl->loop->stats, STATS_JOINED, 1);
+    }
+    LOG_INFO(("Thread %ld: Client %s joined room '%.*s'\n", pthread_self(), cl->name, (int)room_len, room));
+    client_send(cl, ack_buf[cl->binary]);
+    if (history_dir)
+        client_replay(cl);
+}
+
+/* Get long room messages compressed from now on, binary clients only */
+static void client_deflate(client_t *cl)
+{
+    if (cl->deflate || !cl->binary)
+        return;
+    cl->deflate = 1;
+    __atomic_add_fetch(&deflate_clients, 1, __ATOMIC_RELAXED);
+    LOG_INFO(("Thread %ld: Client %s gets compressed messages\n", pthread_self(), cl->name));
+}
+
+/*
+ * Switch to binary frames after the ACK, which is still a line. Only
+ * before the first JOIN, so a room may be called BIN or ZIP and the wire
+ * form never changes in the middle of a conversation.
+ */
+static void client_mode(client_t *cl, int deflate)
+{
+    client_send(cl, ack_buf[0]);
+    cl->binary = 1;
+    LOG_INFO(("Thread %ld: Client %s switched to binary frames\n", pthread_self(), cl->name));
+    if (deflate)
+        client_deflate(cl);
+}
+
+/* Name shown to others, the nickname if there is one */
+static const char *client_label(client_t *cl)
+{
+    return cl->nick.len > 0 ? cl->nick.name : cl->name;
+}
+
+static void client_nick(client_t *cl, const char *nick, size_t nick_len)
+{
+    if (nick_register(&nicks, &cl->nick, nick, nick_len) == -1) {
+        LOG_INFO(("Thread %ld: Client %s can't have nickname '%.*s'\n", pthread_self(), cl->name, (int)nick_len, nick));
+        client_send(cl, nick_taken_buf[cl->binary]);
+        return;
+    }
+    LOG_INFO(("Thread %ld: Client %s is now known as %s\n", pthread_self(), cl->name, cl->nick.name));
+    client_send(cl, ack_buf[cl->binary]);
+}
+
+/* "HISTORY n" or "HISTORY SINCE seq" tells what to replay on the next JOIN */
+static void client_history(client_t *cl, const char *arg, size_t len)
+{
+    char number[24];
+    int since = len > 6 && memcmp(arg, "SINCE ", 6) == 0;
+    char *end;
+
+    if (since) {
+        arg += 6;
+        len -= 6;
+    }
+    if (len == 0 || len >= sizeof(number)) {
+        client_send(cl, history_invalid_buf[cl->binary]);
+        return;
+    }
+    memcpy(number, arg, len);
+    number[len] = '\0';
+    if (since)
+        cl->history_since = strtoul(number, &end, 10);
+    else
+        cl->history_last = strtoul(number, &end, 10);
+    if (*end != '\0') {
+        client_send(cl, history_invalid_buf[cl->binary]);
+        return;
+    }
+    if (!since)
+        cl->history_since = 0;
+    client_send(cl, ack_buf[cl->binary]);
+}
+
+/*
+ * Log a message to a room and deliver it on all shards, which relay it
+ * to their peers, compressing it first if it is worth it. Drops the
+ * reference to the message.
+ */
+static void loop_publish(loop_t *loop, message_t *msg)
+{
+    msgbuf_t *buf = msg->buf;
+
+    if (history_dir) {                                              /* The log keeps the text form */
+        unsigned long start = buf->trace ? trace_now() : 0;
+
+        if (buf->binary && !(msg->alt = message_translate(loop, buf)))
+            LOG_ERROR(("Thread %ld: ERROR Out of memory, message is not logged\n", pthread_self()));
+        else if ((buf->seq = history_append(&history, buf->topic, buf->topic_len, (msg->alt ? msg->alt : buf)->data,
+                (msg->alt ? msg->alt : buf)->len, buf->label_len, buf->sender)) == 0)
+            LOG_ERROR(("Thread %ld: ERROR Unable to log message\n", pthread_self()));
+        if (msg->alt)
+            msg->alt->seq = buf->seq;
+        if (buf->trace)
+            trace_record(&loop->trace, "log", TRACE_SLICE, buf->trace, start, trace_now(), buf->seq);
+    }
+    message_deflate(loop, buf);                                     /* Before other shards see it */
+    loop_broadcast(loop, msg);
+    loop_forward(loop, buf);
+    msgbuf_unref(buf);                                              /* Recipients hold their own references */
+}
+
+/* Send a message to the members of the client's room on all shards and nodes */
+static void client_broadcast(client_t *cl, const char *payload, size_t len)
+{
+    const char *label = client_label(cl);
+    room_t *room = cl->member.room;
+    unsigned long parsed = trace_every ? trace_now() : 0;
+    message_t msg;
+
+    if (!(msg.buf = message_new(&cl->loop->slab, cl->binary, 0, room->name, room->len,
+            label, strlen(label), cl->id, payload, len))) {                 /* Format once for all recipients */
+        LOG_ERROR(("Thread %ld: ERROR Out of memory, dropping message\n", pthread_self()));
+        return;
+    }
+    message_sample(cl->loop, msg.buf, cl->read_at ? cl->read_at : parsed);
+    if (msg.buf->trace) {                                           /* From reading the input to parsing the line */
+        trace_record(&cl->loop->trace, "input", TRACE_WAIT, msg.buf->trace, msg.buf->read_at, parsed, cl->id);
+        trace_record(&cl->loop->trace, "format", TRACE_SLICE, msg.buf->trace, parsed, trace_now(), len);
+    }
+    msg.buf->origin = node_id << 8 | cl->loop->index;
+    msg.buf->origin_seq = ++cl->loop->relay_seq;
+    msg.sock = cl->sock;
+    msg.alt = NULL;
+    LOG_TRACE(("Thread %ld: Client %s sent message '%.*s'\n", pthread_self(), cl->name, (int)len, payload));
+    stats_add(&cl->loop->stats, STATS_MSGS_IN, 1);
+    loop_publish(cl->loop, &msg);
+}
+
+/*
+ * A message a peer relayed, delivered here and relayed on to the other
+ * peers, unless it came over another link before.
+ */
+static void client_relayed(client_t *cl, unsigned long sender, const char *payload, size_t len)
+{
+    loop_t *loop = cl->loop;
+    unsigned long parsed = trace_every ? trace_now() : 0;
+    message_t msg;
+    relay_t r;
+
+    if (relay_decode(&r, sender, payload, len) == -1 || !room_valid(r.room, r.room_len)) {
+        LOG_WARN(("Thread %ld: Peer %s relayed a malformed message\n", pthread_self(), cl->name));
+        return;
+    }
+    if (r.origin >> 8 == node_id || relay_seen(&relayed, r.origin, r.seq)) {
+        stats_add(&loop->stats, STATS_RELAY_DUPLICATES, 1);
+        return;
+    }
+    if (!(msg.buf = message_new(&loop->slab, r.binary, 0, r.room, r.room_len, r.label, r.label_len, r.sender, r.payload, r.len))) {
+        LOG_ERROR(("Thread %ld: ERROR Out of memory, dropping message\n", pthread_self()));
+        return;
+    }
+    message_sample(loop, msg.buf, cl->read_at ? cl->read_at : parsed);
+    if (msg.buf->trace) {
+        trace_record(&loop->trace, "input", TRACE_WAIT, msg.buf->trace, msg.buf->read_at, parsed, cl->id);
+        trace_record(&loop->trace, "format", TRACE_SLICE, msg.buf->trace, parsed, trace_now(), r.len);
+    }
+    msg.buf->origin = r.origin;
+    msg.buf->origin_seq = r.seq;
+    msg.buf->via = cl;
+    msg.sock = -1;
+    msg.alt = NULL;
+    LOG_TRACE(("Thread %ld: Peer %s relayed message '%.*s'\n", pthread_self(), cl->name, (int)r.len, r.payload));
+    stats_add(&loop->stats, STATS_RELAYED_IN, 1);
+    loop_publish(loop, &msg);
+}
+
+/*
+ * Send a message to a single client, wherever it is. Only its shard may
+ * touch it, so it is handed over like a broadcast but to that shard
+ * alone.
+ */
+static void client_direct(client_t *cl, const char *to, size_t to_len, const char *payload, size_t len)
+{
+    const char *label = client_label(cl);
+    msgbuf_t *buf;
+    int shard;
+
+    if (nick_lookup(&nicks, to, to_len, NULL, &shard) == -1) {
+        client_send(cl, nick_unknown_buf[cl->binary]);
+        return;
+    }
+    if (!(buf = message_new(&cl->loop->slab, cl->binary, 1, to, to_len, label, strlen(label), cl->id, payload, len))) {
+        LOG_ERROR(("Thread %ld: ERROR Out of memory, dropping message\n", pthread_self()));
+        return;
+    }
+    LOG_TRACE(("Thread %ld: Client %s sent direct message to %.*s\n", pthread_self(), cl->name, (int)to_len, to));
+    stats_add(&cl->loop->stats, STATS_MSGS_IN, 1);
+    stats_add(&cl->loop->stats, STATS_DIRECT, 1);
+    if (shard == cl->loop->index)
+        loop_direct(cl->loop, buf);
+    else
+        loop_push(cl->loop, &loops[shard], buf);
+    msgbuf_unref(buf);
+}
+
+/* Reply with the counters of all shards, terminated by an END line */
+static void client_stats(client_t *cl)
+{
+    const stats_t *shards[SERVER_MAX_LOOPS];
+    msgbuf_t *buf;
+    unsigned long overflows = 0, writes = 0, written = 0;
+    int i, clients = 0, rooms = 0;
+    size_t len;
+
+    if (!(buf = msgbuf_new(NULL, SERVER_STATS_SIZE))) {
+        LOG_ERROR(("Thread %ld: ERROR Out of memory, no stats for client %s\n", pthread_self(), cl->name));
+        return;
+    }
+    for (i = 0; i < loop_count; i++) {
+        clients += registry_size(&loops[i].clients);
+        overflows += __atomic_load_n(&loops[i].overflows, __ATOMIC_RELAXED);
+        rooms += __atomic_load_n(&loops[i].rooms.count, __ATOMIC_RELAXED);
+        writes += __atomic_load_n(&loops[i].stats.counters[STATS_WRITES], __ATOMIC_RELAXED);
+        written += __atomic_load_n(&loops[i].stats.counters[STATS_WRITTEN], __ATOMIC_RELAXED);
+        shards[i] = &loops[i].stats;
+    }
+    len = snprintf(buf->data, SERVER_STATS_SIZE, "kidcat_shards %d\nkidcat_clients %d\nkidcat_rooms %d\nkidcat_shard_queue_overflows %lu\nkidcat_history_seq %lu\n"
+            "kidcat_messages_per_write %.2f\n", loop_count, clients, rooms, overflows,
+            __atomic_load_n(&history.seq, __ATOMIC_RELAXED), writes ? (double)written / writes : 0.0);
+    len += stats_format(shards, loop_count, buf->data + len, SERVER_STATS_SIZE - len);
+    if (len + 5 > SERVER_STATS_SIZE)
+        len = SERVER_STATS_SIZE - 5;                                /* Truncated, but still terminated */
+    memcpy(buf->data + len, "END\r\n", 5);
+    buf->len = len + 5;
+    client_send(cl, buf);
+    msgbuf_unref(buf);
+}
+
+static void client_handle(client_t *cl, char *line, size_t len)
+{
+    const char *room, *arg;
+    size_t room_len, arg_len, to_len;
+
+    switch (cl->state) {                                            /* This little state-machine decides on */
+        case CLIENT_ACCEPTED:                                       /* client status how to handle input */
+        case CLIENT_JOINED:
+            if (cl->state == CLIENT_ACCEPTED && is_command(line, len, "MODE BIN")) {  /* Binary frames from now on */
+                client_mode(cl, 0);
+            } else if (cl->state == CLIENT_ACCEPTED && is_command(line, len, "MODE ZIP")) {  /* Long messages compressed too */
+                client_mode(cl, 1);
+            } else if (is_join(line, len, "JOIN", &room, &room_len)) {  /* Enter or switch rooms */
+                client_join(cl, room, room_len);
+            } else if (is_command(line, len, "QUIT")) {
+                LOG_INFO(("Thread %ld: Client %s %s\n", pthread_self(), cl->name,
+                        cl->state == CLIENT_JOINED ? "leaved conversation" : "leaves connection"));
+                cl->state = CLIENT_QUIT;
+                stats_add(&cl->loop->stats, STATS_QUIT, 1);
+                client_send(cl, ack_buf[0]);
+            } else if (is_command_arg(line, len, "NICK", &arg, &arg_len)) {
+                client_nick(cl, arg, arg_len);
+            } else if (is_command(line, len, "STATS")) {
+                client_stats(cl);
+            } else if (is_command(line, len, "PING")) {
+                client_send(cl, pong_buf[0]);
+            } else if (is_command(line, len, "PONG")) {
+                ;                                                   /* Being input is all it takes */
+            } else if (is_command_arg(line, len, "HISTORY", &arg, &arg_len)) {
+                client_history(cl, arg, arg_len);
+            } else if (cl->state == CLIENT_ACCEPTED && is_command_arg(line, len, "PEER", &arg, &arg_len)) {
+                client_link(cl, strtoul(arg, NULL, 10), NULL);     /* Another node dialed in */
+            } else if (cl->state == CLIENT_ACCEPTED) {
+                LOG_WARN(("Thread %ld: Client %s sent unknown command '%.*s'\n", pthread_self(), cl->name, (int)len, line));
+            } else if (is_command_arg(line, len, "MSG", &arg, &arg_len)) {
+                for (to_len = 0; to_len < arg_len && arg[to_len] != ' '; to_len++)
+                    ;
+                if (to_len == arg_len)
+                    client_send(cl, nick_unknown_buf[0]);
+                else
+                    client_direct(cl, arg, to_len, arg + to_len + 1, arg_len - to_len - 1);
+            } else {
+                client_broadcast(cl, line, line_length(line, len));
+            }
+            break;
+        case CLIENT_PEER:                                           /* Speaks binary frames */
+        case CLIENT_ERROR:
+        case CLIENT_QUIT:
+        case CLIENT_CLOSED:
+            break;
+    }
+}
+
+/* Frames are commands or messages by type, messages only once the client joined a room */
+static void client_handle_binary(client_t *cl, int type, unsigned long sender, char *payload, size_t len)
+{
+    size_t to_len;
+
+    if (cl->state == CLIENT_ACCEPTED && (type == FRAME_MSG || type == FRAME_DIRECT)) {
+        LOG_WARN(("Thread %ld: Client %s sent a message before joining a room\n", pthread_self(), cl->name));
+        return;
+    }
+
+    if (cl->state == CLIENT_PEER) {                                 /* Links only relay and keep alive */
+        if (type == FRAME_RELAY)
+            client_relayed(cl, sender, payload, len);
+        else if (type == FRAME_PING)
+            client_send(cl, pong_buf[1]);
+        else if (type != FRAME_PONG)
+            LOG_WARN(("Thread %ld: Peer %s sent unexpected frame type %d\n", pthread_self(), cl->name, type));
+        return;
+    }
+    switch (type) {
+        case FRAME_MSG:
+            client_broadcast(cl, payload, len);
+            break;
+        case FRAME_DIRECT:                                          /* Nickname length and nickname first */
+            to_len = len > 0 ? (unsigned char)payload[0] : 0;
+            if (len < 1 + to_len)
+                client_send(cl, nick_unknown_buf[1]);
+            else
+                client_direct(cl, payload + 1, to_len, payload + 1 + to_len, len - 1 - to_len);
+            break;
+        case FRAME_JOIN:
+            if (room_valid(payload, len))
+                client_join(cl, payload, len);
+            else
+                client_send(cl, room_invalid_buf[1]);
+            break;
+        case FRAME_NICK:
+            client_nick(cl, payload, len);
+            break;
+        case FRAME_DEFLATE:                                         /* Asks for compressed messages */
+            client_deflate(cl);
+            client_send(cl, ack_buf[1]);
+            break;
+        case FRAME_PING:
+            client_send(cl, pong_buf[1]);
+            break;
+        case FRAME_PONG:
+            break;
+        case FRAME_QUIT:
+            LOG_INFO(("Thread %ld: Client %s leaved conversation\n", pthread_self(), cl->name));
+            cl->state = CLIENT_QUIT;
+            stats_add(&cl->loop->stats, STATS_QUIT, 1);
+            client_send(cl, ack_buf[1]);
+            break;
+        default:
+            LOG_WARN(("Thread %ld: Client %s sent unknown frame type %d\n", pthread_self(), cl->name, type));
+    }
+}
+
+/* Pause or go on reading from a client */
+static void client_watch(client_t *cl, int throttled)
+{
+    loop_t *loop = cl->loop;
+    struct epoll_event ev;
+
+    cl->throttled = throttled;
+    if (loop->uring) {
+        if (throttled && cl->receiving)
+            uring_cancel(&loop->ring, uring_data(cl, LOOP_RECV));   /* Data still delivered goes to the frame buffer */
+        else if (!throttled && !cl->receiving && client_receive(cl) == -1)
+            cl->state = CLIENT_ERROR;
+    } else {
+        ev.events = (throttled ? 0 : EPOLLIN) | (cl->out.count > 0 && !cl->shm ? EPOLLOUT : 0);
+        ev.data.ptr = cl;
+        epoll_ctl(loop->epfd, EPOLL_CTL_MOD, cl->sock, &ev);
+    }
+}
+
+/*
+ * Pause the input of a client that went over its rate limits for wait
+ * microseconds, rounded up to the next tick. Its socket isn't read
+ * meanwhile, so TCP flow control slows the sender down.
+ */
+static void client_throttle(client_t *cl, unsigned long wait)
+{
+    unsigned long tick_us = SERVER_TIMER_TICK * 1000UL;
+
+    LOG_DEBUG(("Thread %ld: Client %s over its rate limits, pausing input for %lu us\n", pthread_self(), cl->name, wait));
+    stats_add(&cl->loop->stats, STATS_THROTTLED, 1);
+    wheel_add(&cl->loop->timers, &cl->resume, (clock_us() + wait + tick_us - 1) / tick_us);
+    client_watch(cl, 1);
+}
+
+/* Microseconds until the rate limits admit a frame of size bytes or 0, its tokens are taken then */
+static unsigned long client_admit(client_t *cl, size_t size, unsigned long now)
+{
+    unsigned long msgs = bucket_wait(&cl->msg_rate, 1, now), bytes = bucket_wait(&cl->byte_rate, size, now);
+
+    if (msgs > 0 || bytes > 0)
+        return msgs > bytes ? msgs : bytes;
+    bucket_take(&cl->msg_rate, 1);
+    bucket_take(&cl->byte_rate, size);
+    return 0;
+}
+
+/*
+ * Handle what the input completed, as far as the share of the client in
+ * this round and its rate limits allow. Clients get their share in turns
+ * (deficit round robin): what is left waits in the frame buffer for the
+ * next round, or for the resume timer if the client is throttled.
+ */
+static void client_input(client_t *cl)
+{
+    unsigned long oversized = cl->in.oversized, sender, now = 0, wait;
+    char *line;
+    size_t len, size;
+    int type, binary;
+
+    cl->active = cl->loop->tick;                                    /* Checked once the timer fires */
+    cl->pinged = 0;
+    if (cl->ready || cl->throttled)                                 /* Its turn comes */
+        return;
+    if (rate_msgs > 0 || rate_bytes > 0)
+        now = clock_us();
+    cl->deficit += input_quantum;
+    while (client_open(cl)) {
+        if ((binary = cl->binary)) {                                /* May change with every line */
+            if (!frame_next_binary(&cl->in, &type, &sender, &line, &len))
+                break;
+            size = FRAME_HEADER_SIZE + len;
+        } else {
+            if (!frame_next(&cl->in, &line, &len))
+                break;
+            size = len;
+        }
+        if (input_quantum > 0 && size > cl->deficit) {              /* Share used up, the others go first */
+            frame_unget(&cl->in);
+            client_ready(cl);
+            break;
+        }
+        if (now && cl->state != CLIENT_PEER && (wait = client_admit(cl, size, now)) > 0) {  /* Links carry many clients */
+            frame_unget(&cl->in);
+            client_throttle(cl, wait);
+            break;
+        }
+        if (input_quantum > 0)
+            cl->deficit -= size;
+        if (binary)
+            client_handle_binary(cl, type, sender, line, len);
+        else
+            client_handle(cl, line, len);
+    }
+    if (!cl->ready)
+        cl->deficit = 0;                                            /* No credit saved up while there is no input */
+    if (cl->in.oversized != oversized)
+        LOG_WARN(("Thread %ld: Client %s sent %s longer than %lu bytes, discarded\n", pthread_self(), cl->name,
+                cl->binary ? "frames" : "lines", (unsigned long)(cl->binary ? sizeof(cl->inbuf) : cl->in.max)));
+}
+
+/*
+ * Keep input the frame buffer has no room for, behind what was kept
+ * before. Returns -1 if out of memory or the client sent more than
+ * SERVER_SPILL_MAX bytes ahead of its rate limits.
+ */
+static int client_spill(client_t *cl, const char *data, size_t len)
+{
+    size_t size = cl->spill_size ? cl->spill_size : sizeof(cl->inbuf);
+    char *spill;
+
+    if (cl->spill_len + len > SERVER_SPILL_MAX)
+        return -1;
+    while (size < cl->spill_len + len)
+        size *= 2;
+    if (size != cl->spill_size) {
+        if (!(spill = (char *)realloc(cl->spill, size)))
+            return -1;
+        cl->spill = spill;
+        cl->spill_size = size;
+    }
+    memcpy(cl->spill + cl->spill_len, data, len);
+    cl->spill_len += len;
+    stats_add(&cl->loop->stats, STATS_THROTTLE_SPILLED, len);
+    return 0;
+}
+
+/* Handle the input kept aside while the client was throttled, as far as its turn goes */
+static void client_unspill(client_t *cl)
+{
+    size_t fed;
+
+    while (cl->spill_len > 0 && client_open(cl) && !cl->ready && !cl->throttled) {
+        if ((fed = frame_feed(&cl->in, cl->spill, cl->spill_len)) == 0)
+            break;
+        memmove(cl->spill, cl->spill + fed, cl->spill_len - fed);
+        cl->spill_len -= fed;
+        client_input(cl);
+    }
+    if (cl->spill_len == 0 && cl->spill) {
+        free(cl->spill);
+        cl->spill = NULL;
+        cl->spill_size = 0;
+    }
+}
+
+/*
+ * Handle the input of a client: what is in its frame buffer and, for a
+ * local client, what it put into its up ring. A share of the ring per
+ * round, like a read, the rest waits for the next round.
+ */
+static void client_serve(client_t *cl)
+{
+    shm_ring_t *ring;
+    uint64_t one = 1;
+    size_t len, fed;
+    char *data;
+    int pulls;
+
+    client_input(cl);
+    if (!cl->shm) {
+        client_unspill(cl);
+        return;
+    }
+    ring = &cl->shm->up;
+    for (pulls = 0; client_open(cl) && !cl->ready && !cl->throttled; pulls++) {
+        if (!(data = shm_ring_peek(ring, &len))) {
+            if (shm_ring_idle(ring))                                /* Woken once there is more */
+                return;
+            continue;
+        }
+        if (pulls == 2 || (fed = frame_feed(&cl->in, data, len)) == 0) {  /* Twice for the wrap around */
+            client_ready(cl);
+            return;
+        }
+        stats_add(&cl->loop->stats, STATS_BYTES_IN, fed);
+        capture_record(cl->loop->capture, CAPTURE_DATA, cl->id, data, fed);
+        if (trace_every)
+            cl->read_at = trace_now();
+        if (shm_ring_consume(ring, fed) && write(cl->shm->evfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            cl->state = CLIENT_ERROR;                               /* It waits for room */
+        client_input(cl);
+    }
+}
+
+/*
+ * A local client woke its loop through the socket: it put input into its
+ * up ring, or made room in the down ring output waits for.
+ */
+static void client_wakeup(client_t *cl)
+{
+    if (!cl->broken && cl->out.count > 0 && client_flush(cl) == -1) {
+        cl->broken = 1;
+        outq_clear(&cl->out);
+    }
+    if (cl->broken)
+        cl->state = CLIENT_ERROR;
+    client_serve(cl);
+}
+
+static void client_read(client_t *cl)
+{
+    ssize_t read_bytes;
+    size_t len;
+    char wake[64];
+
+    if (cl->shm) {                                                  /* The bytes carry no data, end of file does */
+        if ((read_bytes = read(cl->sock, wake, sizeof(wake))) == 0
+                || (read_bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            cl->state = CLIENT_ERROR;
+        else
+            client_wakeup(cl);
+        return;
+    }
+    if (frame_room(&cl->in) == 0)                                   /* Behind on its input, read on after its turn */
+        return;
+    if ((read_bytes = frame_read(&cl->in, cl->sock)) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return;
+        LOG_ERROR(("Thread %ld: ERROR Unable to read from client\n", pthread_self()));
+        stats_add(&cl->loop->stats, STATS_ERRORS, 1);
+        cl->state = CLIENT_ERROR;
+        return;
+    } else if (read_bytes == 0) {                                   /* Peer went away without saying good bye */
+        cl->state = CLIENT_ERROR;
+        return;
+    }
+    stats_add(&cl->loop->stats, STATS_BYTES_IN, read_bytes);
+    if (cl->loop->capture && cl->state != CLIENT_PEER) {            /* What was just read ends the unparsed input */
+        const char *data = frame_unparsed(&cl->in, &len);
+
+        capture_record(cl->loop->capture, CAPTURE_DATA, cl->id, data + len - read_bytes, read_bytes);
+    }
+    if (trace_every)
+        cl->read_at = trace_now();
+    client_input(cl);
+}
+
+/*
+ * The frame buffer of an io_uring client is full of input waiting for
+ * its turn, yet the kernel delivered more. Serve the client out of turn.
+ * Returns 0 if it is throttled instead, the input is spilled until the
+ * client resumes then, nothing of it is lost.
+ */
+static int client_make_room(client_t *cl)
+{
+    if (!cl->ready)
+        return 0;
+    client_unready(cl);
+    client_input(cl);
+    return 1;
+}
+
+/*
+ * Completion of the multishot receive of a client. The provided buffer
+ * goes back to the kernel once its data was copied into the frame
+ * buffer, the receive is submitted again if the kernel ended it and the
+ * client isn't throttled.
+ */
+static void client_received(client_t *cl, int res, unsigned flags)
+{
+    uring_t *ring = &cl->loop->ring;
+    size_t done, fed;
+    char *data;
+
+    if (!(flags & IORING_CQE_F_MORE)) {
+        cl->pending--;
+        cl->receiving = 0;
+    }
+    if (res > 0) {
+        data = uring_buffer(ring, flags >> IORING_CQE_BUFFER_SHIFT);
+        if (trace_every)
+            cl->read_at = trace_now();
+        if (cl->state != CLIENT_CLOSED && !cl->shm)
+            stats_add(&cl->loop->stats, STATS_BYTES_IN, res);
+        if (client_open(cl) && !cl->shm && cl->state != CLIENT_PEER)
+            capture_record(cl->loop->capture, CAPTURE_DATA, cl->id, data, res);
+        if (cl->shm && client_open(cl))
+            client_wakeup(cl);                                      /* Only woken, the input is in the ring */
+        for (done = 0; done < (size_t)res && !cl->shm && client_open(cl); done += fed) {
+            fed = cl->spill_len > 0 ? 0 : frame_feed(&cl->in, data + done, res - done);  /* Nothing overtakes the spill */
+            if (fed == 0 && (cl->spill_len > 0 || !client_make_room(cl))) {
+                if (client_spill(cl, data + done, res - done) == -1) {
+                    LOG_ERROR(("Thread %ld: ERROR Client %s floods with %lu bytes spilled\n", pthread_self(), cl->name, (unsigned long)cl->spill_len));
+                    cl->state = CLIENT_ERROR;
+                }
+                break;
+            }
+            client_input(cl);
+        }
+        uring_buffer_return(ring, flags >> IORING_CQE_BUFFER_SHIFT);
+    } else if (res == 0) {                                          /* Peer went away without saying good bye */
+        if (cl->state != CLIENT_CLOSED)
+            cl->state = CLIENT_ERROR;
+        return;
+    } else if (res != -ENOBUFS && res != -ECANCELED) {              /* Out of buffers just ends the receive */
+        if (cl->state != CLIENT_CLOSED) {
+            LOG_ERROR(("Thread %ld: ERROR Unable to read from client\n", pthread_self()));
+            stats_add(&cl->loop->stats, STATS_ERRORS, 1);
+            cl->state = CLIENT_ERROR;
+        }
+        return;
+    }
+    if (!(flags & IORING_CQE_F_MORE) && !cl->throttled && client_open(cl) && client_receive(cl) == -1)
+        cl->state = CLIENT_ERROR;
+}
+
+/* Completion of a send or of the poll for writability, goes on with the rest of the queue */
+static void client_sent(client_t *cl, int op, int res)
+{
+    cl->sending = 0;
+    cl->pending--;
+    if (op == LOOP_SEND) {
+        unsigned long sent = cl->out.sent;
+
+        outq_complete(&cl->out, res > 0 ? res : 0);
+        client_traced(cl);
+        stats_add(&cl->loop->stats, STATS_WRITTEN, cl->out.sent - sent);
+        if (res > 0)
+            stats_add(&cl->loop->stats, STATS_BYTES_OUT, res);
+    }
+    if (res < 0 && res != -EAGAIN && res != -ECANCELED && !cl->broken) {
+        if (cl->state != CLIENT_CLOSED)
+            LOG_ERROR(("Thread %ld: ERROR Unable to write to client %s\n", pthread_self(), cl->name));
+        cl->broken = 1;
+    }
+    if (!cl->broken && client_submit(cl) == -1)
+        cl->broken = 1;
+    if (cl->broken) {
+        outq_clear(&cl->out);
+        shutdown(cl->sock, SHUT_RDWR);                              /* The receive ends after what arrived until now */
+    }
+}
+
+#ifdef POOL_STATS
+static void pool_stats(void)
+{
+    char name[32];
+    int i;
+
+    for (i = 0; i < loop_count; i++) {
+        sprintf(name, "clients/%d", i);
+        pool_print(&loops[i].client_pool, name, stdout);
+        sprintf(name, "messages/%d", i);
+        slab_print(&loops[i].slab, name, stdout);
+    }
+}
+#endif
+
+/* Print the queues of a shard, by its own thread as nobody else touches them */
+static void loop_stats(loop_t *loop)
+{
+    __atomic_store_n(&loop->stats_requested, 0, __ATOMIC_RELAXED);
+    fprintf(stdout, "Server: Shard %d has %d clients, lost %lu messages to full queues\n",
+            loop->index, registry_size(&loop->clients), __atomic_load_n(&loop->overflows, __ATOMIC_RELAXED));
+    registry_apply(&loop->clients, client_stats_callback, NULL);
+#ifdef POOL_STATS
+    if (loop->index == 0)
+        pool_stats();
+#endif
+    fflush(stdout);
+}
+
+/*
+ * Write the output held back whose coalescing window is over. Returns
+ * the microseconds until the next window ends or -1 if nothing is held.
+ */
+static long loop_flush(loop_t *loop)
+{
+    unsigned long now;
+    client_t *cl;
+
+    if (!loop->held)
+        return -1;
+    now = clock_us();
+    while ((cl = loop->held) && (long)(cl->flush_at - now) <= 0) {
+        client_unhold(cl);
+        if (!cl->broken && client_flush(cl) == -1) {
+            LOG_ERROR(("Thread %ld: ERROR Unable to write to client %s\n", pthread_self(), cl->name));
+            stats_add(&loop->stats, STATS_ERRORS, 1);
+            cl->broken = 1;
+            outq_clear(&cl->out);
+            shutdown(cl->sock, SHUT_RDWR);                          /* Cleaned up once the loop sees the hangup */
+        }
+    }
+    return cl ? (long)(cl->flush_at - now) : -1;
+}
+
+/*
+ * One round over the clients with input left after their share: each
+ * gets another share, who still has input left after it queues up again
+ * behind the others. Returns 1 if clients are still waiting for a turn.
+ */
+static int loop_schedule(loop_t *loop)
+{
+    client_t *cl, *last = loop->ready_tail;
+
+    while ((cl = loop->ready)) {
+        client_unready(cl);
+        client_serve(cl);
+        if (cl->state == CLIENT_ERROR || cl->state == CLIENT_QUIT)
+            client_close(cl);
+        if (cl == last)                                             /* Who queued up during the round waits */
+            break;
+    }
+    return loop->ready != NULL;
+}
+
+/* A client timer fired, the resume timer of a throttled client or its idle timer */
+static void loop_timer_callback(wheel_timer_t *timer, void *data)
+{
+    client_t *cl = (client_t *)timer->data;
+
+    if (timer != &cl->resume) {
+        client_timer_callback(timer, data);
+        return;
+    }
+    client_watch(cl, 0);
+    client_serve(cl);
+    if (cl->state == CLIENT_ERROR || cl->state == CLIENT_QUIT)
+        client_close(cl);
+}
+
+/*
+ * Expire the timers due by now. Returns the microseconds until the next
+ * tick with work for the wheel or -1 if no timer is armed.
+ */
+static long loop_timers(loop_t *loop)
+{
+    unsigned long now;
+    long next;
+
+    if (loop->timers.count == 0)
+        return -1;
+    now = clock_us();
+    loop->tick = now / (SERVER_TIMER_TICK * 1000UL);
+    wheel_advance(&loop->timers, loop->tick, loop_timer_callback, NULL);
+    if ((next = wheel_next(&loop->timers)) < 0)
+        return -1;
+    return (long)((loop->tick + next) * SERVER_TIMER_TICK * 1000UL - now);
+}
+
+/* Do what is due, returns how long the loop may sleep in microseconds or -1 */
+static long loop_due(loop_t *loop)
+{
+    int waiting = loop_schedule(loop);
+    long flush = loop_flush(loop), timers = loop_timers(loop);
+
+    if (waiting)                                                    /* Only look for new events */
+        return 0;
+    if (flush < 0)
+        return timers;
+    return timers < 0 || flush < timers ? flush : timers;
+}
+
+/* Note the tick after sleeping, for the input about to be handled */
+static void loop_clock(loop_t *loop)
+{
+    if (idle_timeout > 0 || ping_interval > 0)
+        loop->tick = clock_us() / (SERVER_TIMER_TICK * 1000UL);
+}
+
+/* Handle the completions the kernel posted */
+static void loop_complete(loop_t *loop)
+{
+    uring_t *ring = &loop->ring;
+    struct io_uring_cqe *cqe;
+    client_t *cl;
+    unsigned flags;
+    __u64 data;
+    int res, sock;
+
+    while ((cqe = uring_cqe(ring))) {
+        data = cqe->user_data;
+        res = cqe->res;
+        flags = cqe->flags;
+        uring_cqe_seen(ring);
+        cl = (client_t *)uring_ptr(data);
+        switch (uring_tag(data)) {
+            case LOOP_ACCEPT:
+            case LOOP_ACCEPT_LOCAL:
+                sock = uring_tag(data) == LOOP_ACCEPT ? loop->listen_sock : local_sock;
+                if (res >= 0 && sock == local_sock)
+                    client_local(loop, res);
+                else if (res >= 0)
+                    client_accepted(loop, res);
+                else if (res != -EAGAIN && res != -EINTR && res != -ECANCELED)
+                    LOG_ERROR(("Thread %ld: ERROR in accept, bad luck for client\n", pthread_self()));
+                if (!(flags & IORING_CQE_F_MORE)) {
+                    loop->accepting--;
+                    if (!loop->parking && res != -EBADF && res != -EINVAL
+                            && uring_accept_multishot(ring, sock, SOCK_NONBLOCK, uring_data(NULL, uring_tag(data))) == 0)
+                        loop->accepting++;
+                }
+                continue;
+            case LOOP_NOTIFY:
+                loop_drain(loop);
+                if (!(flags & IORING_CQE_F_MORE))
+                    uring_poll_multishot(ring, loop->evfd, POLLIN, uring_data(loop, LOOP_NOTIFY));
+                continue;
+            case LOOP_RECV:
+                client_received(cl, res, flags);
+                break;
+            case LOOP_SEND:
+            case LOOP_WRITABLE:
+                client_sent(cl, uring_tag(data), res);
+                break;
+            default:                                            /* Outcome of a cancellation */
+                continue;
+        }
+        if (cl->state == CLIENT_CLOSED) {
+            if (cl->pending == 0)                               /* The kernel is done with it */
+                registry_remove(&loop->clients, &cl->entry);
+        } else if (cl->state == CLIENT_ERROR || cl->state == CLIENT_QUIT) {
+            client_close(cl);
+        }
+    }
+}
+
+void client_cancel_callback(registry_entry_t *entry, void *data)
+{
+    client_t *cl = (client_t *)entry->data;
+    uring_t *ring = &cl->loop->ring;
+
+    uring_cancel(ring, uring_data(cl, LOOP_RECV));
+    uring_cancel(ring, uring_data(cl, LOOP_SEND));
+    uring_cancel(ring, uring_data(cl, LOOP_WRITABLE));
+}
+
+void client_pending_callback(registry_entry_t *entry, void *data)
+{
+    *(int *)data += ((client_t *)entry->data)->pending;
+}
+
+/*
+ * Stop this shard for a new process taking over and wait for the end of
+ * this one. On io_uring every operation is cancelled and completed first,
+ * so that no data the kernel took on behalf of this process gets lost:
+ * received input lands in the frame buffers, output not sent stays in
+ * the queues.
+ */
+static void loop_park(loop_t *loop)
+{
+    int pending;
+
+    loop->parking = 1;
+    if (loop->uring) {
+        if (loop->accepting) {
+            uring_cancel(&loop->ring, uring_data(NULL, LOOP_ACCEPT));
+            uring_cancel(&loop->ring, uring_data(NULL, LOOP_ACCEPT_LOCAL));
+        }
+        registry_apply(&loop->clients, client_cancel_callback, NULL);
+        while (1) {
+            pending = 0;
+            registry_apply(&loop->clients, client_pending_callback, &pending);
+            if (pending == 0 && !loop->accepting)
+                break;
+            if (uring_enter(&loop->ring, 1, -1) == -1 && errno != EINTR) {
+                LOG_ERROR(("Thread %ld: ERROR in io_uring_enter() syscall\n", pthread_self()));
+                break;
+            }
+            loop_complete(loop);
+        }
+    }
+    LOG_INFO(("Thread %ld: Shard %d parked with %d clients\n", pthread_self(), loop->index, registry_size(&loop->clients)));
+    pthread_mutex_lock(&handoff_mutex);
+    handoff_parked++;
+    pthread_cond_broadcast(&handoff_cond);
+    while (2)                                                       /* Until the process ends */
+        pthread_cond_wait(&handoff_cond, &handoff_mutex);
+}
+
+static void loop_epoll(loop_t *loop)
+{
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    struct timespec ts;
+    int i, count;
+    long timeout;
+
+    while (2) {
+        timeout = loop_due(loop);
+        ts.tv_sec = timeout / 1000000;
+        ts.tv_nsec = timeout % 1000000 * 1000;
+        if ((count = epoll_pwait2(loop->epfd, events, SERVER_MAX_EVENTS, timeout < 0 ? NULL : &ts, NULL)) == -1) {
+            if (errno != EINTR)
+                LOG_ERROR(("Thread %ld: ERROR in epoll_pwait2() syscall\n", pthread_self()));
+            continue;
+        }
+        loop_clock(loop);
+        if (__atomic_load_n(&loop->stats_requested, __ATOMIC_RELAXED))
+            loop_stats(loop);
+        for (i = 0; i < count; i++) {
+            client_t *cl = (client_t *)events[i].data.ptr;
+
+            if (!cl) {                                              /* The listen socket carries no client */
+                client_accept(loop);
+                continue;
+            } else if ((void *)cl == (void *)loop) {                /* Neither does the eventfd */
+                loop_drain(loop);
+                continue;
+            } else if ((void *)cl == (void *)&local_sock) {         /* Nor the socket of local clients */
+                client_accept_local(loop);
+                continue;
+            }
+            if ((events[i].events & (EPOLLHUP | EPOLLERR)) && cl->throttled)
+                cl->state = CLIENT_ERROR;                           /* Not read meanwhile, would be reported over and over */
+            else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                client_read(cl);
+            if (events[i].events & EPOLLOUT) {
+                if (!cl->broken && client_flush(cl) == -1) {
+                    cl->broken = 1;
+                    outq_clear(&cl->out);
+                }
+                if (cl->broken)
+                    cl->state = CLIENT_ERROR;
+            }
+            if (cl->state == CLIENT_ERROR || cl->state == CLIENT_QUIT)
+                client_close(cl);
+        }
+        if (__atomic_load_n(&handoff_requested, __ATOMIC_ACQUIRE))
+            loop_park(loop);
+    }
+}
+
+/*
+ * Event loop on io_uring. Accepts, receives and the eventfd are multishot
+ * operations submitted once, sends are queued while handling completions
+ * and go to the kernel together with the next wait, one system call for
+ * a whole batch of fan-out.
+ */
+static void loop_uring(loop_t *loop)
+{
+    uring_t *ring = &loop->ring;
+    long timeout;
+
+    loop->accepting = uring_accept_multishot(ring, loop->listen_sock, SOCK_NONBLOCK, uring_data(NULL, LOOP_ACCEPT)) == 0;
+    if (local_sock != -1)
+        loop->accepting += uring_accept_multishot(ring, local_sock, SOCK_NONBLOCK, uring_data(NULL, LOOP_ACCEPT_LOCAL)) == 0;
+    uring_poll_multishot(ring, loop->evfd, POLLIN, uring_data(loop, LOOP_NOTIFY));
+    while (2) {
+        timeout = loop_due(loop);
+        if (uring_enter(ring, 1, timeout) == -1) {
+            if (errno != EINTR && errno != ETIME)
+                LOG_ERROR(("Thread %ld: ERROR in io_uring_enter() syscall\n", pthread_self()));
+            continue;
+        }
+        loop_clock(loop);
+        if (__atomic_load_n(&loop->stats_requested, __ATOMIC_RELAXED))
+            loop_stats(loop);
+        loop_complete(loop);
+        if (__atomic_load_n(&handoff_requested, __ATOMIC_ACQUIRE))
+            loop_park(loop);
+    }
+}
+
+/*
+ * Set up a client the old process handed off in the state it left it:
+ * in its room, under its nickname, with the input it didn't handle and
+ * the output it didn't write yet. Links to peer nodes and local clients
+ * with their rings are taken over likewise.
+ */
+static void client_adopt(loop_t *loop, adopt_t *a)
+{
+    client_t *cl = (client_t *)pool_alloc(&loop->client_pool);
+    const char *room = a->data, *nick = room + a->rec.room_len, *in = nick + a->rec.nick_len, *out = in + a->rec.in_len;
+    shm_t *shm = NULL;
+    msgbuf_t *buf;
+    size_t size;
+    int i;
+
+    if (!cl || (a->fds[1] != -1 && !(shm = (shm_t *)malloc(sizeof(shm_t))))) {
+        LOG_ERROR(("Thread %ld: ERROR Out of memory, dropping a client taken over\n", pthread_self()));
+        for (i = 0; i < HANDOFF_FDS_MAX; i++)
+            if (a->fds[i] != -1)
+                close(a->fds[i]);
+        if (cl)
+            pool_free(cl);
+        if (a->peer)
+            __atomic_store_n(&a->peer->up, 0, __ATOMIC_RELEASE);    /* Dialed again */
+        return;
+    }
+    if (shm && shm_adopt(shm, a->fds[1], a->fds[2]) == -1) {
+        LOG_ERROR(("Thread %ld: ERROR Unable to map the rings of a local client taken over\n", pthread_self()));
+        free(shm);
+        close(a->fds[0]);
+        pool_free(cl);
+        return;
+    }
+    cl->sock = a->fds[0];
+    cl->addr = a->rec.addr;
+    cl->socklen = sizeof(cl->addr);
+    client_init(loop, cl);
+    if (cl->state != CLIENT_ACCEPTED) {                             /* Closed already */
+        if (shm) {
+            shm_destroy(shm);
+            free(shm);
+        }
+        if (a->peer)
+            __atomic_store_n(&a->peer->up, 0, __ATOMIC_RELEASE);
+        return;
+    }
+    cl->shm = shm;
+    cl->id = a->rec.id;
+    cl->binary = a->rec.binary;
+    if ((cl->deflate = a->rec.deflate))
+        __atomic_add_fetch(&deflate_clients, 1, __ATOMIC_RELAXED);
+    cl->history_seq = a->rec.history_seq;
+    if (a->rec.nick_len > 0 && nick_register(&nicks, &cl->nick, nick, a->rec.nick_len) == -1)
+        LOG_WARN(("Thread %ld: Client %s lost nickname '%.*s'\n", pthread_self(), cl->name, (int)a->rec.nick_len, nick));
+    if (a->rec.state == CLIENT_JOINED) {
+        if (room_join(&loop->rooms, room, a->rec.room_len, &cl->member))
+            cl->state = CLIENT_JOINED;
+        else
+            cl->state = CLIENT_ERROR;
+    } else if (a->rec.state == CLIENT_PEER) {
+        client_link(cl, a->rec.node, a->peer);
+    }
+    LOG_INFO(("Thread %ld: Took over client %s with %lu bytes of input and %lu bytes of output\n", pthread_self(), cl->name,
+            (unsigned long)a->rec.in_len, (unsigned long)a->rec.out_len));
+    if (a->rec.out_len > 0) {
+        if (!(buf = msgbuf_new(&loop->slab, a->rec.out_len))) {
+            cl->state = CLIENT_ERROR;
+        } else {
+            memcpy(buf->data, out, a->rec.out_len);
+            outq_push(&cl->out, buf, OUTQ_DROP_OLDEST);                 /* Queued even above the high watermark, the queue is empty */
+            if (client_flush(cl) == -1) {
+                cl->broken = 1;
+                outq_clear(&cl->out);
+                shutdown(cl->sock, SHUT_RDWR);
+            }
+            msgbuf_unref(buf);
+        }
+    }
+    if ((size = frame_feed(&cl->in, in, a->rec.in_len)) < a->rec.in_len && client_spill(cl, in + size, a->rec.in_len - size) == -1)
+        cl->state = CLIENT_ERROR;
+    client_serve(cl);
+    if (cl->state == CLIENT_ERROR || cl->state == CLIENT_QUIT)
+        client_close(cl);
+}
+
+void *loop_func(void *arg)
+{
+    loop_t *loop = (loop_t *)arg;
+    adopt_t *a;
+
+    if (loop->cpu >= 0) {
+        cpu_set_t cpus;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(loop->cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+            LOG_ERROR(("Thread %ld: ERROR Unable to pin shard %d to CPU %d\n", pthread_self(), loop->index, loop->cpu));
+    }
+    pool_init(&loop->client_pool, sizeof(client_t));                /* Pools belong to the loop's thread */
+    slab_init(&loop->slab);
+    zip_init(&loop->zip, SERVER_DEFLATE_LEVEL);
+    if (room_table_init(&loop->rooms) == -1) {
+        LOG_ERROR(("Thread %ld: ERROR Out of memory for the rooms of shard %d\n", pthread_self(), loop->index));
+        log_flush(); exit(EXIT_FAILURE);
+    }
+
+    loop->tick = clock_us() / (SERVER_TIMER_TICK * 1000UL);
+    wheel_init(&loop->timers, loop->tick);
+    if (use_uring) {
+        if (uring_init(&loop->ring, SERVER_URING_ENTRIES) == -1
+                || uring_buffers(&loop->ring, SERVER_URING_BUFFERS, SERVER_URING_BUFFER_SIZE) == -1) {
+            LOG_WARN(("Thread %ld: io_uring not available for shard %d, using epoll\n", pthread_self(), loop->index));
+            uring_destroy(&loop->ring);
+        } else {
+            loop->uring = 1;
+        }
+    }
+    while ((a = loop->adopt)) {
+        loop->adopt = a->next;
+        client_adopt(loop, a);
+        free(a);
+    }
+    if (loop->uring)
+        loop_uring(loop);
+    else
+        loop_epoll(loop);
+    return NULL;
+}
+
+/*
+ * Disconnect everybody and exit. Runs on the signal thread or, after a
+ * failed handoff, on the handoff thread, never in a signal handler: it
+ * takes the locks of the log and capture writers.
+ */
+static void server_shutdown(void)
+{
+    int i;
+
+    LOG_INFO(("Server: Disconnect all clients ...\n"));
+    for (i = 0; i < loop_count; i++) {
+        registry_apply(&loops[i].clients, client_quit_callback, NULL);  /* Call quit callback for every registered client */
+        close(loops[i].listen_sock);
+    }
+#ifdef POOL_STATS
+    pool_stats();
+#endif
+    LOG_INFO(("Server: Shutdown ...\n"));
+    fflush(stdout);
+    capture_flush();
+    log_flush();                                                    /* Don't lose what is still in the rings */
+    exit(EXIT_SUCCESS);                                             /* That's it, all threads go out of business */
+}
+
+/*
+ * Write the trace events of all shards to trace_path, on SIGUSR2. Runs on
+ * the signal thread, the shards go on recording meanwhile.
+ */
+static void server_trace(void)
+{
+    trace_t *shards[SERVER_MAX_LOOPS];
+    int i, events;
+
+    if (!trace_every) {
+        LOG_WARN(("Server: Tracing is off, start with -T to trace messages\n"));
+        return;
+    }
+    for (i = 0; i < loop_count; i++)
+        shards[i] = &loops[i].trace;
+    if ((events = trace_dump(shards, loop_count, trace_path)) == -1)
+        LOG_ERROR(("Server: ERROR Unable to write trace to %s\n", trace_path));
+    else
+        LOG_INFO(("Server: Wrote %d trace events to %s\n", events, trace_path));
+}
+
+/*
+ * Waits for SIGINT and SIGTERM, which all other threads block, for
+ * SIGUSR1, on which every shard is woken to print its queues, and for
+ * SIGUSR2, on which the trace is written.
+ */
+void *signal_func(void *arg)
+{
+    sigset_t *sigs = (sigset_t *)arg;
+    uint64_t one = 1;
+    int sig, i;
+
+    while (sigwait(sigs, &sig) != 0 || sig == SIGUSR1 || sig == SIGUSR2) {
+        if (sig == SIGUSR2)
+            server_trace();
+        if (sig != SIGUSR1)
+            continue;
+        for (i = 0; i < loop_count; i++) {
+            __atomic_store_n(&loops[i].stats_requested, 1, __ATOMIC_RELAXED);
+            if (write(loops[i].evfd, &one, sizeof(one)) < 0)
+                LOG_ERROR(("Server: ERROR Unable to wake up shard %d\n", i));
+        }
+    }
+    server_shutdown();
+    return NULL;
+}
+
+typedef struct handoff {
+    int sock;                       /* Connection to the successor */
+    int clients;                    /* Clients handed off so far */
+    int failed;
+} handoff_t;
+
+void client_handoff_callback(registry_entry_t *entry, void *data)
+{
+    client_t *cl = (client_t *)entry->data;
+    handoff_t *h = (handoff_t *)data;
+    handoff_record_t rec;
+    int fds[HANDOFF_FDS_MAX];
+    struct iovec iov[5];
+    ssize_t out_len;
+    char *out;
+
+    if (!client_open(cl) || cl->broken || h->failed)
+        return;                                                     /* Closed with the end of this process */
+    if (!(out = (char *)malloc(cl->out.bytes + 1)) || (out_len = outq_copy(&cl->out, out)) == -1) {
+        LOG_ERROR(("Server: ERROR Unable to hand off the output queued for client %s, disconnecting it\n", cl->name));
+        free(out);
+        return;                                                     /* Rather than losing it unnoticed */
+    }
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = HANDOFF_MAGIC;
+    rec.type = HANDOFF_CLIENT;
+    fds[0] = cl->sock;
+    rec.fds = 1;
+    if (cl->shm) {                                                  /* The rings go on in the same memory */
+        fds[rec.fds++] = cl->shm->fd;
+        fds[rec.fds++] = cl->shm->evfd;
+    }
+    rec.state = cl->state;
+    rec.node = cl->node;
+    rec.dialed = cl->peer != NULL;
+    rec.binary = cl->binary;
+    rec.deflate = cl->deflate;
+    rec.id = cl->id;
+    rec.history_seq = cl->history_seq;
+    rec.addr = cl->addr;
+    iov[0].iov_base = cl->member.room ? cl->member.room->name : NULL;
+    iov[0].iov_len = rec.room_len = cl->member.room ? cl->member.room->len : 0;
+    iov[1].iov_base = cl->nick.name;
+    iov[1].iov_len = rec.nick_len = cl->nick.len;
+    iov[2].iov_base = (void *)frame_unparsed(&cl->in, &iov[2].iov_len);
+    iov[3].iov_base = cl->spill;                                    /* Spilled input goes after what is unparsed */
+    iov[3].iov_len = cl->spill_len;
+    rec.in_len = iov[2].iov_len + iov[3].iov_len;
+    iov[4].iov_base = out;
+    iov[4].iov_len = rec.out_len = out_len;
+    if (handoff_send(h->sock, &rec, fds, iov, 5) == -1) {
+        h->failed = 1;
+    } else {
+        cl->handed_off = 1;
+        h->clients++;
+    }
+    free(out);
+}
+
+/*
+ * Waits for a successor to connect to the handoff socket. Then every
+ * shard is parked, messages still on their way between shards are put
+ * into the queues, and the listen sockets and clients go over to the
+ * successor. This process ends without closing a connection, so clients
+ * don't notice. If the handoff fails they are disconnected as usual.
+ */
+void *handoff_func(void *arg)
+{
+    int listener = (int)(intptr_t)arg, i;
+    handoff_record_t rec;
+    unsigned long start;
+    uint64_t one = 1;
+    handoff_t h;
+    char ack;
+
+    while ((h.sock = accept(listener, NULL, NULL)) == -1) {
+        if (errno != EINTR) {
+            LOG_ERROR(("Server: ERROR in accept() on the handoff socket\n"));
+            return NULL;
+        }
+    }
+    start = clock_us();
+    LOG_INFO(("Server: New process taking over, parking all shards ...\n"));
+    __atomic_store_n(&handoff_requested, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < loop_count; i++)
+        if (write(loops[i].evfd, &one, sizeof(one)) < 0)
+            LOG_ERROR(("Server: ERROR Unable to wake up shard %d\n", i));
+    pthread_mutex_lock(&handoff_mutex);
+    while (handoff_parked < loop_count)
+        pthread_cond_wait(&handoff_cond, &handoff_mutex);
+    pthread_mutex_unlock(&handoff_mutex);
+
+    h.clients = h.failed = 0;
+    for (i = 0; i < loop_count; i++)
+        loop_drain(&loops[i]);                                      /* Nobody else touches the parked shards */
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = HANDOFF_MAGIC;
+    for (i = 0; i < loop_count && !h.failed; i++) {
+        rec.type = HANDOFF_LISTEN;
+        rec.fds = 1;
+        if (handoff_send(h.sock, &rec, &loops[i].listen_sock, NULL, 0) == -1)
+            h.failed = 1;
+        registry_apply(&loops[i].clients, client_handoff_callback, &h);
+    }
+    rec.type = HANDOFF_END;
+    rec.fds = 0;
+    if (h.failed || handoff_send(h.sock, &rec, NULL, NULL, 0) == -1 || handoff_read(h.sock, &ack, 1) == -1) {
+        LOG_ERROR(("Server: ERROR Handoff failed after %d clients\n", h.clients));
+        server_shutdown();                                          /* Disconnects only those not handed off */
+    }
+    LOG_INFO(("Server: Handed off %d clients in %.3f ms, exiting ...\n", h.clients, (clock_us() - start) / 1000.0));
+    fflush(stdout);
+    capture_flush();
+    log_flush();
+    exit(EXIT_SUCCESS);
+}
+
+/*
+ * Take over from the server listening on the handoff socket, if there is
+ * one: its listen sockets replace those of our first shards and its
+ * clients are queued for the shards to adopt once they run. Returns the
+ * number of clients or -1 if no server listens there.
+ */
+static int handoff_take(const char *path)
+{
+    handoff_record_t rec;
+    unsigned long start;
+    int sock, fds[HANDOFF_FDS_MAX], i, clients = 0;
+    loop_t *loop;
+    adopt_t *a;
+    size_t len;
+
+    if ((sock = handoff_connect(path)) == -1)
+        return -1;
+    start = clock_us();
+    LOG_INFO(("Server: Taking over from the server on %s ...\n", path));
+    while (1) {
+        if (handoff_recv(sock, &rec, fds) == -1) {
+            perror("handoff_recv()"); exit(EXIT_FAILURE);
+        }
+        if (rec.type == HANDOFF_END)
+            break;
+        if (rec.type == HANDOFF_LISTEN) {
+            if (handoff_listener_count < loop_count) {
+                handoff_listeners[handoff_listener_count++] = fds[0];
+            } else {
+                LOG_WARN(("Server: Fewer shards than before, connections waiting to be accepted on a listen socket are lost\n"));
+                close(fds[0]);
+            }
+            continue;
+        }
+        len = rec.room_len + rec.nick_len + rec.in_len + rec.out_len;
+        if (!(a = (adopt_t *)malloc(sizeof(adopt_t) + len)) || handoff_read(sock, a->data, len) == -1) {
+            perror("handoff_read()"); exit(EXIT_FAILURE);
+        }
+        if (fds[0] == -1) {
+            free(a);
+            continue;
+        }
+        a->rec = rec;
+        memcpy(a->fds, fds, sizeof(fds));
+        a->peer = NULL;
+        loop = &loops[clients++ % loop_count];                      /* Spread over the shards round robin */
+        for (i = 0; i < peer_count && rec.dialed; i++) {
+            if (peers[i].addr.sin_addr.s_addr == rec.addr.sin_addr.s_addr && peers[i].addr.sin_port == rec.addr.sin_port) {
+                a->peer = &peers[i];                                /* Not dialed again while the link is up */
+                peers[i].up = 1;
+                loop = &loops[i % loop_count];                      /* The shard the peer will be given */
+                break;
+            }
+        }
+        a->next = loop->adopt;
+        loop->adopt = a;
+        if (rec.id > client_ids)                                    /* Sender ids stay unique */
+            client_ids = rec.id;
+    }
+    if (write(sock, "", 1) != 1) {
+        perror("write()"); exit(EXIT_FAILURE);
+    }
+    close(sock);
+    LOG_INFO(("Server: Took over %d clients and %d listen sockets in %.3f ms\n", clients, handoff_listener_count, (clock_us() - start) / 1000.0));
+    return clients;
+}
+
+/*
+ * Keeps a link up to every peer on the command line. Once a connection
+ * is made and this node introduced itself with PEER <node>, the socket
+ * goes to the shard owning the peer, which tells when it is closed.
+ */
+void *peer_func(void *arg)
+{
+    struct timeval timeout = { SERVER_PEER_RETRY, 0 };             /* Bounds connect() as well */
+    char hello[32];
+    uint64_t one = 1;
+    int i, sock, len;
+
+    len = sprintf(hello, "PEER %lu\r\n", node_id);
+    while (3) {
+        for (i = 0; i < peer_count; i++) {
+            peer_t *peer = &peers[i];
+
+            if (__atomic_load_n(&peer->up, __ATOMIC_ACQUIRE))
+                continue;
+            if ((sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+                LOG_ERROR(("Server: ERROR in socket() syscall\n"));
+                continue;
+            }
+            setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            if (connect(sock, (struct sockaddr *)&peer->addr, sizeof(peer->addr)) == -1
+                    || write(sock, hello, len) != len || fcntl(sock, F_SETFL, O_NONBLOCK) == -1) {
+                if (peer->failures++ == 0)                          /* Only once until it is reached again */
+                    LOG_WARN(("Server: Unable to reach peer %s, trying on\n", peer->name));
+                close(sock);
+                continue;
+            }
+            peer->failures = 0;
+            __atomic_store_n(&peer->up, 1, __ATOMIC_RELEASE);
+            __atomic_store_n(&peer->sock, sock, __ATOMIC_RELEASE);
+            if (write(peer->loop->evfd, &one, sizeof(one)) < 0)
+                LOG_ERROR(("Server: ERROR Unable to wake up shard %d\n", peer->loop->index));
+        }
+        sleep(SERVER_PEER_RETRY);
+    }
+    return NULL;
+}
+
+/* Add a peer given as host:port, returns -1 if it can't be resolved */
+static int peer_add(char *spec)
+{
+    struct addrinfo hints, *res;
+    char *port = strrchr(spec, ':');
+    peer_t *peer = &peers[peer_count];
+
+    if (!port || peer_count == SERVER_MAX_PEERS)
+        return -1;
+    *port++ = '\0';
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(spec, port, &hints, &res) != 0)
+        return -1;
+    memcpy(&peer->addr, res->ai_addr, sizeof(peer->addr));
+    freeaddrinfo(res);
+    port[-1] = ':';
+    peer->name = spec;
+    peer->up = 0;
+    peer->sock = -1;
+    peer->failures = 0;
+    peer_count++;
+    return 0;
+}
+
+/* Allow nodes on host to link in, returns -1 if it can't be resolved */
+static int allow_add(const char *host)
+{
+    struct addrinfo hints, *res;
+
+    if (allowed_count == SERVER_MAX_PEERS)
+        return -1;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    if (getaddrinfo(host, NULL, &hints, &res) != 0)
+        return -1;
+    allowed[allowed_count++] = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+    freeaddrinfo(res);
+    return 0;
+}
+
+/* A reply in both wire forms, like "ACK\r\n" or "ERR reason\r\n" for text clients */
+static void reply_init(msgbuf_t *reply[2], int type, const char *word, const char *reason)
+{
+    size_t len = reason ? strlen(reason) : 0;
+
+    reply[0] = msgbuf_new(NULL, strlen(word) + (reason ? 1 + len : 0) + 2);
+    reply[1] = msgbuf_new(NULL, FRAME_HEADER_SIZE + len);
+    if (!reply[0] || !reply[1]) {
+        perror("msgbuf_new()"); exit(EXIT_FAILURE);
+    }
+    if (reason)
+        sprintf(reply[0]->data, "%s %s\r\n", word, reason);
+    else
+        sprintf(reply[0]->data, "%s\r\n", word);
+    reply[1]->binary = 1;
+    frame_header(reply[1]->data, type, 0, len);
+    if (reason)
+        memcpy(reply[1]->data + FRAME_HEADER_SIZE, reason, len);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-t shards] [-c cpu[,cpu...]] [-b backlog] [-w high[:low]] [-p oldest|newest|disconnect]\n"
+            "       [-l error|warn|info|debug|trace] [-H history_dir] [-R replay] [-e epoll|uring]\n"
+            "       [-C usec[:bytes]] [-I idle_seconds] [-P ping_seconds] [-Q quantum] [-L msgs[:bytes]] [-U handoff_socket]\n"
+            "       [-a port] [-N node] [-F host:port[,host:port...]] [-A host[,host...]] [-S local_socket] [-z bytes]\n"
+            "       [-T every[:trace_file]] [-W capture_file]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    static sigset_t thread_sigs;
+    pthread_t signal_tid;
+    int eins_val = 1, opt, i;
+    char *end, *spec;
+
+    while ((opt = getopt(argc, argv, "t:c:b:w:p:l:H:R:e:C:I:P:Q:L:U:a:N:F:A:S:z:T:W:")) != -1) {
+        switch (opt) {
+            case 't':                                               /* Number of shards, one thread each */
+                loop_count = atoi(optarg);
+                if (loop_count < 1 || loop_count > SERVER_MAX_LOOPS) {
+                    fprintf(stderr, "Number of shards must be between 1 and %d\n", SERVER_MAX_LOOPS); exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':                                               /* CPUs to pin the shards to, round robin */
+                for (end = optarg, loop_cpu_count = 0; *end && loop_cpu_count < SERVER_MAX_LOOPS; loop_cpu_count++) {
+                    loop_cpus[loop_cpu_count] = strtol(end, &end, 10);
+                    if (*end == ',')
+                        end++;
+                    else if (*end)
+                        usage(argv[0]);
+                }
+                break;
+            case 'b':                                               /* Listen backlog of every shard */
+                if ((server_backlog = atoi(optarg)) < 1)
+                    usage(argv[0]);
+                break;
+            case 'w':                                               /* Output queue watermarks in bytes */
+                outq_high = strtoul(optarg, &end, 10);
+                outq_low = *end == ':' ? strtoul(end + 1, NULL, 10) : outq_high / 4;
+                if (outq_high == 0 || outq_low > outq_high) {
+                    fprintf(stderr, "Watermarks must satisfy 0 <= low <= high and 0 < high\n"); exit(EXIT_FAILURE);
+                }
+                break;
+            case 'p':                                               /* Slow consumer policy */
+                if (strcmp(optarg, "oldest") == 0)
+                    outq_policy = OUTQ_DROP_OLDEST;
+                else if (strcmp(optarg, "newest") == 0)
+                    outq_policy = OUTQ_DROP_NEWEST;
+                else if (strcmp(optarg, "disconnect") == 0)
+                    outq_policy = OUTQ_DISCONNECT;
+                else
+                    usage(argv[0]);
+                break;
+            case 'l':                                               /* Log level, trace logs every message */
+                if ((log_level = log_parse_level(optarg)) == -1)
+                    usage(argv[0]);
+                break;
+            case 'H':                                               /* Log messages there, replay them on JOIN */
+                history_dir = optarg;
+                break;
+            case 'R':                                               /* Messages replayed unless asked otherwise */
+                history_replay_last = strtoul(optarg, &end, 10);
+                if (*end)
+                    usage(argv[0]);
+                break;
+            case 'C':                                               /* Coalescing window in microseconds */
+                coalesce_window = strtoul(optarg, &end, 10);
+                coalesce_bytes = *end == ':' ? strtoul(end + 1, NULL, 10) : SERVER_COALESCE_BYTES;
+                if (coalesce_window > SERVER_COALESCE_MAX || coalesce_bytes == 0) {
+                    fprintf(stderr, "Coalescing window must be at most %d microseconds\n", SERVER_COALESCE_MAX); exit(EXIT_FAILURE);
+                }
+                break;
+            case 'I':                                               /* Seconds of silence before disconnecting */
+                idle_timeout = strtoul(optarg, &end, 10) * 1000 / SERVER_TIMER_TICK;
+                if (*end)
+                    usage(argv[0]);
+                break;
+            case 'P':                                               /* Seconds of silence before a PING */
+                ping_interval = strtoul(optarg, &end, 10) * 1000 / SERVER_TIMER_TICK;
+                if (*end)
+                    usage(argv[0]);
+                break;
+            case 'Q':                                               /* Input bytes per client and round, 0 for no turns */
+                input_quantum = strtoul(optarg, &end, 10);
+                if (*end)
+                    usage(argv[0]);
+                break;
+            case 'L':                                               /* Input messages and bytes per client and second */
+                rate_msgs = strtoul(optarg, &end, 10);
+                rate_bytes = *end == ':' ? strtoul(end + 1, &end, 10) : 0;
+                if (*end)
+                    usage(argv[0]);
+                break;
+            case 'U':                                               /* Take over from the server there, then wait for a successor */
+                handoff_path = optarg;
+                break;
+            case 'S':                                               /* Clients on this host get shared memory rings there */
+                local_path = optarg;
+                break;
+            case 'T':                                               /* Trace every n-th message, written on SIGUSR2 */
+                trace_every = strtoul(optarg, &end, 10);
+                if (*end == ':' && end[1])
+                    trace_path = end + 1;
+                else if (*end)
+                    usage(argv[0]);
+                break;
+            case 'W':                                               /* Capture the input of all clients, see replay.c */
+                capture_path = optarg;
+                break;
+            case 'z':                                               /* Shortest payload compressed for clients asking for it */
+                deflate_min = strtoul(optarg, &end, 10);
+                if (*end)
+                    usage(argv[0]);
+                break;
+            case 'a':                                               /* Port to listen on */
+                listen_port = strtol(optarg, &end, 10);
+                if (*end || listen_port < 1 || listen_port > 65535)
+                    usage(argv[0]);
+                break;
+            case 'N':                                               /* Node id within the federation */
+                node_id = strtoul(optarg, &end, 10);
+                if (*end || node_id == 0 || node_id > 0xffffffffUL)
+                    usage(argv[0]);
+                break;
+            case 'F':                                               /* Peers to relay messages to and from */
+                for (spec = strtok(optarg, ","); spec; spec = strtok(NULL, ","))
+                    if (peer_add(spec) == -1) {
+                        fprintf(stderr, "Unable to add peer %s, at most %d as host:port\n", spec, SERVER_MAX_PEERS); exit(EXIT_FAILURE);
+                    }
+                break;
+            case 'A':                                               /* Hosts that may link in besides the peers */
+                for (spec = strtok(optarg, ","); spec; spec = strtok(NULL, ","))
+                    if (allow_add(spec) == -1) {
+                        fprintf(stderr, "Unable to allow host %s, at most %d\n", spec, SERVER_MAX_PEERS); exit(EXIT_FAILURE);
+                    }
+                break;
+            case 'e':                                               /* I/O backend, shards fall back to epoll */
+                if (strcmp(optarg, "uring") == 0)
+                    use_uring = 1;
+                else if (strcmp(optarg, "epoll") == 0)
+                    use_uring = 0;
+                else
+                    usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    sigemptyset(&thread_sigs);                                  /* Taken by the signal thread, before any other thread */
+    sigaddset(&thread_sigs, SIGINT);                            /* starts and inherits the mask */
+    sigaddset(&thread_sigs, SIGTERM);
+    sigaddset(&thread_sigs, SIGUSR1);                           /* Dump per client queue statistics */
+    sigaddset(&thread_sigs, SIGUSR2);                           /* Write the trace of sampled messages */
+    pthread_sigmask(SIG_BLOCK, &thread_sigs, NULL);
+    if (log_init() == -1) {
+        perror("log_init()"); exit(EXIT_FAILURE);
+    }
+
+    signal(SIGPIPE, SIG_IGN);                                   /* Broken connections are reported by write() */
+
+    if (loop_count == 0) {                                      /* One shard per core by default */
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        loop_count = cores < 1 ? 1 : cores > SERVER_MAX_LOOPS ? SERVER_MAX_LOOPS : (int)cores;
+    }
+    if (handoff_path)                                           /* Before the history, the old server stopped writing then */
+        handoff_take(handoff_path);
+    if (node_id == 0)                                           /* Unique enough among a few nodes */
+        node_id = ((unsigned long)getpid() * 2654435761UL ^ clock_us()) % 0xffffffffUL + 1;
+    relay_seen_init(&relayed);
+    if (local_path && (local_sock = shm_listen(local_path, server_backlog)) == -1) {
+        perror("shm_listen()"); exit(EXIT_FAILURE);
+    }
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(listen_port);                  /* Set up listen socket */
+    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);            /* Accept any incomming address */
+
+    reply_init(ack_buf, FRAME_ACK, "ACK", NULL);
+    reply_init(ping_buf, FRAME_PING, "PING", NULL);
+    reply_init(pong_buf, FRAME_PONG, "PONG", NULL);
+    reply_init(nick_taken_buf, FRAME_ERROR, "ERR", "nick unavailable");
+    reply_init(nick_unknown_buf, FRAME_ERROR, "ERR", "no such nick");
+    reply_init(room_invalid_buf, FRAME_ERROR, "ERR", "invalid room");
+    reply_init(history_invalid_buf, FRAME_ERROR, "ERR", "invalid history");
+    if (history_dir && history_open(&history, history_dir, SERVER_HISTORY_SEGMENT, SERVER_HISTORY_SEGMENTS, SERVER_HISTORY_RECORDS) == -1) {
+        perror("history_open()"); exit(EXIT_FAILURE);
+    }
+    if (nick_table_init(&nicks) == -1) {
+        perror("nick_table_init()"); exit(EXIT_FAILURE);
+    }
+    if (capture_path && capture_open(capture_path, loop_count) == -1) {
+        perror("capture_open()"); exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < loop_count; i++) {
+        loop_t *loop = &loops[i];
+        struct epoll_event ev;
+        int j;
+
+        loop->index = i;
+        loop->cpu = loop_cpu_count > 0 ? loop_cpus[i % loop_cpu_count] : -1;
+        loop->notified = 0;
+        loop->overflows = 0;
+        loop->stats_requested = 0;
+        loop->link_count = 0;
+        loop->relay_seq = clock_us();                           /* Grows across restarts, peers don't take them for old news */
+        stats_init(&loop->stats);
+        loop->sampled = 0;
+        loop->capture = capture_ring(i);
+        if (trace_every && trace_init(&loop->trace, SERVER_TRACE_EVENTS) == -1) {
+            perror("trace_init()"); exit(EXIT_FAILURE);
+        }
+        registry_init(&loop->clients, client_release);
+        if (!(loop->inbox = (spsc_t *)calloc(loop_count, sizeof(spsc_t)))) {
+            perror("calloc()"); exit(EXIT_FAILURE);
+        }
+        for (j = 0; j < loop_count; j++) {
+            if (j != i && spsc_init(&loop->inbox[j], SERVER_SHARD_QUEUE) == -1) {
+                perror("spsc_init()"); exit(EXIT_FAILURE);
+            }
+        }
+
+        /* Every shard binds its own listener, the kernel spreads connections among them */
+        if (i < handoff_listener_count) {                       /* Keeps the connections waiting to be accepted */
+            loop->listen_sock = handoff_listeners[i];
+        } else {
+            if ((loop->listen_sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
+                perror("socket()"); exit(EXIT_FAILURE);
+            }
+            setsockopt(loop->listen_sock, SOL_SOCKET, SO_REUSEADDR, &eins_val, sizeof(eins_val));
+            setsockopt(loop->listen_sock, SOL_SOCKET, SO_REUSEPORT, &eins_val, sizeof(eins_val));
+            if (bind(loop->listen_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+                close(loop->listen_sock); perror("bind()"); exit(EXIT_FAILURE);
+            }
+            if (listen(loop->listen_sock, server_backlog) == -1) {
+                close(loop->listen_sock); perror("listen()"); exit(EXIT_FAILURE);
+            }
+        }
+
+        if ((loop->epfd = epoll_create1(0)) == -1) {
+            perror("epoll_create1()"); exit(EXIT_FAILURE);
+        }
+        if ((loop->evfd = eventfd(0, EFD_NONBLOCK)) == -1) {
+            perror("eventfd()"); exit(EXIT_FAILURE);
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->listen_sock, &ev) == -1) {
+            perror("epoll_ctl()"); exit(EXIT_FAILURE);
+        }
+        ev.data.ptr = loop;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->evfd, &ev) == -1) {
+            perror("epoll_ctl()"); exit(EXIT_FAILURE);
+        }
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;                   /* Shared by all shards, one of them is woken */
+        ev.data.ptr = &local_sock;
+        if (local_sock != -1 && epoll_ctl(loop->epfd, EPOLL_CTL_ADD, local_sock, &ev) == -1) {
+            perror("epoll_ctl()"); exit(EXIT_FAILURE);
+        }
+    }
+    LOG_INFO(("Server: Node %lu listening on %d with %d shards on %s ...\n", node_id, listen_port, loop_count, use_uring ? "io_uring" : "epoll"));
+    if (peer_count > 0) {                                       /* Links are spread over the shards */
+        pthread_t tid;
+
+        for (i = 0; i < peer_count; i++)
+            peers[i].loop = &loops[i % loop_count];
+        if (pthread_create(&tid, NULL, peer_func, NULL) != 0) {
+            perror("pthread_create()"); exit(EXIT_FAILURE);
+        }
+        pthread_detach(tid);
+    }
+    if (handoff_path) {                                         /* For the next upgrade */
+        pthread_t tid;
+        int listener;
+
+        if ((listener = handoff_listen(handoff_path)) == -1) {
+            perror("handoff_listen()"); exit(EXIT_FAILURE);
+        }
+        if (pthread_create(&tid, NULL, handoff_func, (void *)(intptr_t)listener) != 0) {
+            perror("pthread_create()"); exit(EXIT_FAILURE);
+        }
+        pthread_detach(tid);
+    }
+
+    if (pthread_create(&signal_tid, NULL, signal_func, &thread_sigs) != 0) {  /* Cleanup and housekeeping before we terminate */
+        perror("pthread_create()"); exit(EXIT_FAILURE);
+    }
+    pthread_detach(signal_tid);
+    for (i = 1; i < loop_count; i++) {
+        if ((pthread_create(&loops[i].tid, NULL, loop_func, &loops[i])) != 0) {
+            LOG_ERROR(("Server: ERROR in pthread_create() syscall\n"));
+            log_flush(); exit(EXIT_FAILURE);
         }
+        pthread_detach(loops[i].tid);
     }
+    loops[0].tid = pthread_self();
+    loop_func(&loops[0]);                                       /* The main thread serves the first loop */
     return EXIT_SUCCESS;
 }
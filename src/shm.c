@@ -0,0 +1,307 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE 1
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shm.h"
+
+/* Set up the view of one side, the client produces up and consumes down */
+static void shm_map(shm_t *shm, void *base, size_t len, int client)
+{
+    shm_header_t *header = (shm_header_t *)base;
+
+    shm->_base = base;
+    shm->_len = len;
+    shm->up._shared = &header->up;
+    shm->up._data = (char *)base + sizeof(shm_header_t);
+    shm->down._shared = &header->down;
+    shm->down._data = shm->up._data + header->size;
+    shm->up._size = shm->down._size = header->size;
+    shm->up._pos = client ? header->up.tail : header->up.head;
+    shm->down._pos = client ? header->down.head : header->down.tail;
+}
+
+/*
+ * Create the memory file with rings of at least size bytes, and the
+ * eventfd, for the server side. Returns -1 if that fails.
+ */
+int shm_create(shm_t *shm, size_t size)
+{
+    shm_header_t *header;
+    unsigned long ring = SHM_LINE;
+    size_t len;
+    void *base;
+
+    if (!shm)
+        return -1;
+    while (ring < size)
+        ring <<= 1;
+    len = sizeof(shm_header_t) + 2 * ring;
+    if ((shm->fd = memfd_create("kidcat", MFD_CLOEXEC)) == -1)
+        return -1;
+    if (ftruncate(shm->fd, len) == -1
+            || (base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0)) == MAP_FAILED) {
+        close(shm->fd);
+        return -1;
+    }
+    if ((shm->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        munmap(base, len);
+        close(shm->fd);
+        return -1;
+    }
+    header = (shm_header_t *)base;
+    memset(header, 0, sizeof(*header));
+    header->magic = SHM_MAGIC;
+    header->size = ring;
+    header->up.idle = 1;                            /* Server waits for the first input */
+    shm_map(shm, base, len, 0);
+    return 0;
+}
+
+/* Greet a client with the memory file and the eventfd attached */
+int shm_send(int sock, const shm_t *shm)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    int fds[2];
+
+    if (!shm)
+        return -1;
+    fds[0] = shm->fd;
+    fds[1] = shm->evfd;
+    iov.iov_base = (void *)SHM_GREETING;
+    iov.iov_len = strlen(SHM_GREETING);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)iov.iov_len ? 0 : -1;
+}
+
+/* Map the rings in the memory file fd for one side, both descriptors are closed if that fails */
+static int shm_attach(shm_t *shm, int fd, int evfd, int client)
+{
+    struct stat st;
+    void *base;
+
+    shm->fd = fd;
+    shm->evfd = evfd;
+    if (fstat(shm->fd, &st) == -1 || (size_t)st.st_size < sizeof(shm_header_t)
+            || (base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0)) == MAP_FAILED) {
+        close(shm->fd);
+        close(shm->evfd);
+        return -1;
+    }
+    if (((shm_header_t *)base)->magic != SHM_MAGIC || sizeof(shm_header_t) + 2 * ((shm_header_t *)base)->size != (size_t)st.st_size) {
+        munmap(base, st.st_size);
+        close(shm->fd);
+        close(shm->evfd);
+        return -1;
+    }
+    shm_map(shm, base, st.st_size, client);
+    return 0;
+}
+
+/* Wait for the greeting of the server and map the rings it sent, for the client side */
+int shm_recv(int sock, shm_t *shm)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    char greeting[sizeof(SHM_GREETING)];
+    int fds[2];
+
+    if (!shm)
+        return -1;
+    iov.iov_base = greeting;
+    iov.iov_len = strlen(SHM_GREETING);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != (ssize_t)iov.iov_len || memcmp(greeting, SHM_GREETING, iov.iov_len) != 0
+            || !(cmsg = CMSG_FIRSTHDR(&msg)) || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+        return -1;
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    return shm_attach(shm, fds[0], fds[1], 1);
+}
+
+/*
+ * Map the rings of a client another server process created, for the
+ * server side: a successor taking over. Both rings go on where that
+ * process left them. Returns -1 and closes fd and evfd if that fails.
+ */
+int shm_adopt(shm_t *shm, int fd, int evfd)
+{
+    if (!shm)
+        return -1;
+    return shm_attach(shm, fd, evfd, 0);
+}
+
+void shm_destroy(shm_t *shm)
+{
+    if (!shm)
+        return;
+    munmap(shm->_base, shm->_len);
+    close(shm->fd);
+    close(shm->evfd);
+}
+
+static int shm_address(struct sockaddr_un *addr, const char *path)
+{
+    if (!path || strlen(path) >= sizeof(addr->sun_path))
+        return -1;
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/* Non-blocking socket listening for local clients on path, replacing whatever was bound there */
+int shm_listen(const char *path, int backlog)
+{
+    struct sockaddr_un addr;
+    int sock;
+
+    if (shm_address(&addr, path) == -1 || (sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+        return -1;
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(sock, backlog) == -1) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/* Connect to the server listening on path. Returns -1 if there is none */
+int shm_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    int sock;
+
+    if (shm_address(&addr, path) == -1 || (sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+        return -1;
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/*
+ * Contiguous room for the producer to write to, NULL if the ring is full.
+ * What was written goes to the consumer with shm_ring_commit().
+ */
+char *shm_ring_reserve(shm_ring_t *r, size_t *len)
+{
+    unsigned long used = r->_pos - __atomic_load_n(&r->_shared->head, __ATOMIC_ACQUIRE), off = r->_pos & (r->_size - 1);
+
+    if (used >= r->_size)                           /* Full, or the consumer went astray */
+        return NULL;
+    *len = r->_size - used < r->_size - off ? r->_size - used : r->_size - off;
+    return r->_data + off;
+}
+
+/* Hand n bytes written to the consumer. Returns 1 if it sleeps and must be woken */
+int shm_ring_commit(shm_ring_t *r, size_t n)
+{
+    r->_pos += n;
+    __atomic_store_n(&r->_shared->tail, r->_pos, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&r->_shared->idle, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&r->_shared->idle, 0, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * The producer found the ring full and wants to be woken once there is
+ * room. Returns 0 if there is room by now, so it must not wait.
+ */
+int shm_ring_stall(shm_ring_t *r)
+{
+    __atomic_store_n(&r->_shared->stalled, 1, __ATOMIC_SEQ_CST);
+    if (r->_pos - __atomic_load_n(&r->_shared->head, __ATOMIC_SEQ_CST) < r->_size) {
+        __atomic_store_n(&r->_shared->stalled, 0, __ATOMIC_SEQ_CST);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Contiguous data for the consumer to read, NULL if the ring is empty.
+ * It stays in the ring until shm_ring_consume().
+ */
+char *shm_ring_peek(shm_ring_t *r, size_t *len)
+{
+    unsigned long avail = __atomic_load_n(&r->_shared->tail, __ATOMIC_ACQUIRE) - r->_pos, off = r->_pos & (r->_size - 1);
+
+    if (avail == 0 || avail > r->_size)             /* Empty, or the producer went astray */
+        return NULL;
+    *len = avail < r->_size - off ? avail : r->_size - off;
+    return r->_data + off;
+}
+
+/* Give n bytes read back to the producer. Returns 1 if it waits for room and must be woken */
+int shm_ring_consume(shm_ring_t *r, size_t n)
+{
+    r->_pos += n;
+    __atomic_store_n(&r->_shared->head, r->_pos, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&r->_shared->stalled, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&r->_shared->stalled, 0, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * The consumer found the ring empty and wants to be woken once there is
+ * data. Returns 0 if data came in by now, so it must not sleep.
+ */
+int shm_ring_idle(shm_ring_t *r)
+{
+    __atomic_store_n(&r->_shared->idle, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->_shared->tail, __ATOMIC_SEQ_CST) != r->_pos) {
+        __atomic_store_n(&r->_shared->idle, 0, __ATOMIC_SEQ_CST);
+        return 0;
+    }
+    return 1;
+}
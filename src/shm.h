@@ -0,0 +1,100 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef SHM_H
+#define SHM_H
+
+#include <stddef.h>
+
+/*
+ * Transport for clients on the same host as the server: a memory file
+ * holding two byte rings, up from client to server and down from server
+ * to client, each with one producer and one consumer. Both carry the
+ * same bytes a TCP connection would. A client connects to the server's
+ * Unix socket and gets the memory file and an eventfd with the greeting
+ * SHM_GREETING.
+ *
+ * A consumer that runs out of data says so with shm_ring_idle() before
+ * it sleeps, and a producer that runs out of room with shm_ring_stall().
+ * The other side learns from shm_ring_commit() or shm_ring_consume()
+ * that it has to wake it. The server wakes the client through the
+ * eventfd. The client wakes the server with a byte on the Unix socket,
+ * whose end also tells the server the client went away.
+ */
+#define SHM_MAGIC 0x6b637368UL      /* "kcsh" */
+#define SHM_GREETING "SHM\r\n"
+#define SHM_LINE 64                 /* Keeps what each side writes on cache lines of its own */
+
+/* The shared part of a ring, inside the mapping */
+typedef struct shm_ring_shared {
+    unsigned long head;             /* Bytes taken out, written by the consumer */
+    int idle;                       /* Consumer sleeps until woken */
+    char _pad0[SHM_LINE - sizeof(unsigned long) - sizeof(int)];
+    unsigned long tail;             /* Bytes put in, written by the producer */
+    int stalled;                    /* Producer waits for room */
+    char _pad1[SHM_LINE - sizeof(unsigned long) - sizeof(int)];
+} shm_ring_shared_t;
+
+typedef struct shm_header {
+    unsigned long magic;
+    unsigned long size;             /* Bytes of each ring, a power of two */
+    char _pad[SHM_LINE - 2 * sizeof(unsigned long)];
+    shm_ring_shared_t up, down;
+} shm_header_t;
+
+/* One side's view of a ring, its own position isn't taken from the other side */
+typedef struct shm_ring {
+    shm_ring_shared_t *_shared;
+    char *_data;
+    unsigned long _size;
+    unsigned long _pos;             /* Tail of a producer, head of a consumer */
+} shm_ring_t;
+
+typedef struct shm {
+    void *_base;
+    size_t _len;
+    shm_ring_t up;                  /* Client to server */
+    shm_ring_t down;                /* Server to client */
+    int fd;                         /* Memory file */
+    int evfd;                       /* Wakes the client */
+} shm_t;
+
+int shm_create(shm_t *shm, size_t size);
+int shm_send(int sock, const shm_t *shm);
+int shm_recv(int sock, shm_t *shm);
+int shm_adopt(shm_t *shm, int fd, int evfd);
+void shm_destroy(shm_t *shm);
+
+int shm_listen(const char *path, int backlog);
+int shm_connect(const char *path);
+
+char *shm_ring_reserve(shm_ring_t *r, size_t *len);
+int shm_ring_commit(shm_ring_t *r, size_t n);
+int shm_ring_stall(shm_ring_t *r);
+char *shm_ring_peek(shm_ring_t *r, size_t *len);
+int shm_ring_consume(shm_ring_t *r, size_t n);
+int shm_ring_idle(shm_ring_t *r);
+
+#endif
@@ -0,0 +1,77 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "spsc.h"
+
+#include <stdlib.h>
+
+/* The size is rounded up to a power of two */
+int spsc_init(spsc_t *q, unsigned long size)
+{
+    unsigned long n = 1;
+
+    if (!q)
+        return -1;
+    while (n < size)
+        n <<= 1;
+    if (!(q->_slots = (void **)malloc(n * sizeof(void *))))
+        return -1;
+    q->_head = q->_tail = 0;
+    q->_mask = n - 1;
+    return 0;
+}
+
+void spsc_destroy(spsc_t *q)
+{
+    if (!q)
+        return;
+    free(q->_slots);
+    q->_slots = NULL;
+}
+
+/* Producer side, returns -1 if the queue is full */
+int spsc_push(spsc_t *q, void *item)
+{
+    unsigned long tail = q->_tail;
+
+    if (tail - __atomic_load_n(&q->_head, __ATOMIC_ACQUIRE) > q->_mask)
+        return -1;
+    q->_slots[tail & q->_mask] = item;
+    __atomic_store_n(&q->_tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Consumer side, returns NULL if the queue is empty */
+void *spsc_pop(spsc_t *q)
+{
+    unsigned long head = q->_head;
+    void *item;
+
+    if (head == __atomic_load_n(&q->_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    item = q->_slots[head & q->_mask];
+    __atomic_store_n(&q->_head, head + 1, __ATOMIC_RELEASE);
+    return item;
+}
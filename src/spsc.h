@@ -0,0 +1,51 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef SPSC_H
+#define SPSC_H
+
+#define SPSC_CACHELINE 64
+
+/*
+ * Bounded lock-free queue of pointers between exactly one producer and
+ * one consumer thread. The indexes live on separate cache lines so the
+ * two sides don't bounce a line between them on every operation.
+ */
+typedef struct spsc {
+    unsigned long _head;            /* Next slot to pop, written by the consumer */
+    char _pad0[SPSC_CACHELINE - sizeof(unsigned long)];
+    unsigned long _tail;            /* Next slot to push, written by the producer */
+    char _pad1[SPSC_CACHELINE - sizeof(unsigned long)];
+    unsigned long _mask;
+    void **_slots;
+} spsc_t;
+
+int spsc_init(spsc_t *q, unsigned long size);
+void spsc_destroy(spsc_t *q);
+
+int spsc_push(spsc_t *q, void *item);
+void *spsc_pop(spsc_t *q);
+
+#endif
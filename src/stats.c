@@ -0,0 +1,141 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <string.h>
+
+#include "stats.h"
+
+static const char *counter_names[STATS_COUNTERS] = {
+    "connections_accepted",
+    "connections_joined",
+    "connections_quit",
+    "connections_error",
+    "messages_in",
+    "messages_out",
+    "messages_direct",
+    "messages_translated",
+    "messages_replayed",
+    "bytes_in",
+    "bytes_out",
+    "messages_dropped",
+    "slow_consumers_closed",
+    "write_calls",
+    "messages_written",
+    "pings_sent",
+    "idle_timeouts",
+    "heartbeat_timeouts",
+    "input_deferred",
+    "input_throttled",
+    "bytes_throttled_spilled",
+    "messages_relayed_out",
+    "messages_relayed_in",
+    "relay_duplicates",
+    "local_wakeups",
+    "messages_compressed",
+    "compress_bytes_in",
+    "compress_bytes_out",
+    "compress_cpu_ns",
+    "messages_compressed_out"
+};
+
+static const char *hist_names[STATS_HISTOGRAMS] = {
+    "broadcast_fanout",
+    "client_queue_bytes",
+    "broadcast_ns"
+};
+
+static unsigned long stats_load(const unsigned long *v)
+{
+    return __atomic_load_n(v, __ATOMIC_RELAXED);
+}
+
+void stats_init(stats_t *s)
+{
+    if (s)
+        memset(s, 0, sizeof(stats_t));
+}
+
+/* Bucket i counts values below 2^i */
+void stats_observe(stats_t *s, int hist, unsigned long value)
+{
+    int bucket = 0;
+
+    while (bucket < STATS_BUCKETS - 1 && (value >> bucket) != 0)
+        bucket++;
+    __atomic_store_n(&s->hist[hist][bucket], s->hist[hist][bucket] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->sum[hist], s->sum[hist] + value, __ATOMIC_RELAXED);
+}
+
+/*
+ * Sum up all shards into buf as one "kidcat_<name> <value>" line per
+ * counter and the compression ratio they imply, histograms as cumulative
+ * buckets in the Prometheus text format. Returns the length or size if buf was too small.
+ */
+size_t stats_format(const stats_t **shards, int count, char *buf, size_t size)
+{
+    unsigned long value, hist[STATS_BUCKETS], total, zip_in = 0, zip_out = 0;
+    size_t len = 0;
+    int i, j, k, last;
+
+#define APPEND(args) do { \
+        int n = snprintf args; \
+        if (n < 0 || (size_t)n >= size - len) \
+            return size; \
+        len += n; \
+    } while (0)
+
+    for (i = 0; i < STATS_COUNTERS; i++) {
+        for (j = 0, value = 0; j < count; j++)
+            value += stats_load(&shards[j]->counters[i]);
+        APPEND((buf + len, size - len, "kidcat_%s %lu\n", counter_names[i], value));
+        if (i == STATS_COMPRESS_IN)
+            zip_in = value;
+        else if (i == STATS_COMPRESS_OUT)
+            zip_out = value;
+    }
+    APPEND((buf + len, size - len, "kidcat_compression_ratio %.3f\n", zip_out ? (double)zip_in / zip_out : 1.0));
+    for (i = 0; i < STATS_HISTOGRAMS; i++) {
+        for (k = 0, last = 0; k < STATS_BUCKETS; k++) {
+            for (j = 0, hist[k] = 0; j < count; j++)
+                hist[k] += stats_load(&shards[j]->hist[i][k]);
+            if (hist[k])
+                last = k;
+        }
+        for (k = 0, total = 0; k <= last; k++) {
+            total += hist[k];
+            APPEND((buf + len, size - len, "kidcat_%s_bucket{le=\"%lu\"} %lu\n", hist_names[i], (1UL << k) - 1, total));
+        }
+        APPEND((buf + len, size - len, "kidcat_%s_bucket{le=\"+Inf\"} %lu\n", hist_names[i], total));
+        for (j = 0, value = 0; j < count; j++)
+            value += stats_load(&shards[j]->sum[i]);
+        APPEND((buf + len, size - len, "kidcat_%s_sum %lu\n", hist_names[i], value));
+        APPEND((buf + len, size - len, "kidcat_%s_count %lu\n", hist_names[i], total));
+    }
+#undef APPEND
+    return len;
+}
@@ -0,0 +1,92 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+
+enum stats_counter {
+    STATS_ACCEPTED,                 /* Connections accepted */
+    STATS_JOINED,                   /* Clients that joined the conversation */
+    STATS_QUIT,                     /* Clients that said good bye */
+    STATS_ERRORS,                   /* Connections closed on errors */
+    STATS_MSGS_IN,                  /* Messages received from clients */
+    STATS_MSGS_OUT,                 /* Messages queued for clients */
+    STATS_DIRECT,                   /* Messages sent to a single client */
+    STATS_TRANSLATED,               /* Messages put into the other wire form */
+    STATS_REPLAYED,                 /* Messages replayed from the history */
+    STATS_BYTES_IN,
+    STATS_BYTES_OUT,
+    STATS_DROPPED,                  /* Messages dropped by the slow consumer policy */
+    STATS_SLOW_CLOSED,              /* Clients disconnected by the slow consumer policy */
+    STATS_WRITES,                   /* Write system calls, or sends submitted to io_uring */
+    STATS_WRITTEN,                  /* Messages written completely */
+    STATS_PINGS,                    /* Heartbeats sent to silent clients */
+    STATS_IDLE_CLOSED,              /* Clients disconnected for being idle too long */
+    STATS_HEARTBEAT_CLOSED,         /* Clients disconnected for not answering a heartbeat */
+    STATS_DEFERRED,                 /* Times a client had input left after its share of a round */
+    STATS_THROTTLED,                /* Times the input of a client was paused over its rate limits */
+    STATS_THROTTLE_SPILLED,         /* Input bytes of throttled clients kept aside for lack of buffer space */
+    STATS_RELAYED_OUT,              /* Messages relayed to peer nodes, once per link */
+    STATS_RELAYED_IN,               /* Messages peer nodes relayed to this one */
+    STATS_RELAY_DUPLICATES,         /* Relayed messages seen before, over another link */
+    STATS_LOCAL_WAKEUPS,            /* Local clients woken for output put into their rings */
+    STATS_COMPRESSED,               /* Messages compressed for the clients asking for it, once each */
+    STATS_COMPRESS_IN,              /* Payload bytes compressed */
+    STATS_COMPRESS_OUT,             /* Bytes they compressed to */
+    STATS_COMPRESS_NS,              /* CPU time spent compressing */
+    STATS_DEFLATED_OUT,             /* Compressed messages queued for clients */
+    STATS_COUNTERS
+};
+
+enum stats_histogram {
+    STATS_FANOUT,                   /* Recipients of a message within a shard */
+    STATS_QUEUE_DEPTH,              /* Queued bytes of a client after queueing a message */
+    STATS_BROADCAST_NS,             /* Time to fan out a message within a shard */
+    STATS_HISTOGRAMS
+};
+
+#define STATS_BUCKETS 64            /* Powers of two */
+
+/*
+ * Counters of one shard. Only the shard's thread writes them, so an
+ * update is a plain relaxed load and store without a locked instruction.
+ * Readers sum up all shards.
+ */
+typedef struct stats {
+    unsigned long counters[STATS_COUNTERS];
+    unsigned long hist[STATS_HISTOGRAMS][STATS_BUCKETS];
+    unsigned long sum[STATS_HISTOGRAMS];
+} stats_t;
+
+#define stats_add(s, counter, v) \
+    __atomic_store_n(&(s)->counters[counter], (s)->counters[counter] + (v), __ATOMIC_RELAXED)
+
+void stats_init(stats_t *s);
+void stats_observe(stats_t *s, int hist, unsigned long value);
+size_t stats_format(const stats_t **shards, int count, char *buf, size_t size);
+
+#endif
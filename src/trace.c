@@ -0,0 +1,120 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/* Ring of at least size events */
+int trace_init(trace_t *t, size_t size)
+{
+    unsigned long n = 2 * TRACE_SLACK;
+
+    while (n < size)
+        n <<= 1;
+    if (!(t->_events = (trace_event_t *)calloc(n, sizeof(trace_event_t))))
+        return -1;
+    t->_mask = n - 1;
+    t->_head = 0;
+    return 0;
+}
+
+void trace_destroy(trace_t *t)
+{
+    if (!t)
+        return;
+    free(t->_events);
+    t->_events = NULL;
+}
+
+unsigned long trace_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+/* Only the thread owning the ring may record, the oldest event makes room */
+void trace_record(trace_t *t, const char *name, int kind, unsigned long id, unsigned long start, unsigned long end, unsigned long arg)
+{
+    trace_event_t *ev = &t->_events[t->_head & t->_mask];
+
+    ev->name = name;
+    ev->kind = kind;
+    ev->id = id;
+    ev->start = start;
+    ev->end = end > start ? end : start;
+    ev->arg = arg;
+    __atomic_store_n(&t->_head, t->_head + 1, __ATOMIC_RELEASE);  /* Published for trace_dump() */
+}
+
+static void trace_write(FILE *out, const trace_event_t *ev, int tid, int pid)
+{
+    if (ev->kind == TRACE_SLICE) {
+        fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"kidcat\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"msg\":%lu,\"arg\":%lu}}",
+                ev->name, ev->start / 1e3, (ev->end - ev->start) / 1e3, pid, tid, ev->id, ev->arg);
+    } else {                                                    /* Begin and end of an async span, keyed by stage and message */
+        fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"b\",\"id\":%lu,\"ts\":%.3f,\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"msg\":%lu,\"arg\":%lu}}",
+                ev->name, ev->name, ev->id, ev->start / 1e3, pid, tid, ev->id, ev->arg);
+        fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"e\",\"id\":%lu,\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+                ev->name, ev->name, ev->id, ev->end / 1e3, pid, tid);
+    }
+}
+
+/*
+ * Write the events of all shards to path, shard i being thread i of the
+ * trace. Returns the number of events written or -1.
+ */
+int trace_dump(trace_t **shards, int count, const char *path)
+{
+    unsigned long head, first, i;
+    int shard, pid = (int)getpid(), written = 0;
+    FILE *out;
+
+    if (!(out = fopen(path, "w")))
+        return -1;
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"kidcat\"}}", pid);
+    for (shard = 0; shard < count; shard++) {
+        trace_t *t = shards[shard];
+
+        fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"shard %d\"}}", pid, shard, shard);
+        head = __atomic_load_n(&t->_head, __ATOMIC_ACQUIRE);
+        first = head > t->_mask + 1 - TRACE_SLACK ? head - (t->_mask + 1 - TRACE_SLACK) : 0;
+        for (i = first; i < head; i++, written++)
+            trace_write(out, &t->_events[i & t->_mask], shard, pid);
+    }
+    fprintf(out, "\n]}\n");
+    if (fclose(out) != 0)
+        return -1;
+    return written;
+}
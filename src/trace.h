@@ -0,0 +1,73 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+
+/*
+ * Sampled tracing of messages through the stages of the server. Every
+ * shard records events into a ring of its own which only its thread
+ * writes, so recording costs a clock read and a few stores. A dump
+ * gathers the rings of all shards into a file in the Chrome trace event
+ * format, which chrome://tracing and Perfetto load. Work a shard does
+ * for a message shows as a slice on the track of the shard. Waits span
+ * the work done for others in between, so each one is an async span of
+ * the message instead and doesn't break the nesting of the slices.
+ *
+ * A dump runs while the shards go on recording. It leaves out the
+ * oldest TRACE_SLACK events of a ring, which a shard may overwrite
+ * meanwhile.
+ */
+#define TRACE_SLACK 256
+
+enum trace_kind {
+    TRACE_SLICE,                    /* Work done by the shard */
+    TRACE_WAIT                      /* Time the message waited for something */
+};
+
+typedef struct trace_event {
+    const char *name;               /* Stage, a string constant */
+    int kind;
+    unsigned long id;               /* Of the message */
+    unsigned long start, end;       /* Nanoseconds on the monotonic clock */
+    unsigned long arg;              /* Meaning depends on the stage */
+} trace_event_t;
+
+typedef struct trace {
+    trace_event_t *_events;
+    unsigned long _mask;            /* Size of the ring, a power of two, minus 1 */
+    unsigned long _head;            /* Events recorded so far */
+} trace_t;
+
+int trace_init(trace_t *t, size_t size);
+void trace_destroy(trace_t *t);
+
+unsigned long trace_now(void);
+void trace_record(trace_t *t, const char *name, int kind, unsigned long id, unsigned long start, unsigned long end, unsigned long arg);
+int trace_dump(trace_t **shards, int count, const char *path);
+
+#endif
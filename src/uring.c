@@ -0,0 +1,300 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE 1
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+/*
+ * Set up rings of entries submissions for use by the calling thread only.
+ * Fails on kernels older than 6.0, which lack some of the multishot
+ * operations used here.
+ */
+int uring_init(uring_t *r, unsigned entries)
+{
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    if (!r)
+        return -1;
+    memset(r, 0, sizeof(uring_t));
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = entries * 4;                 /* Multishot operations complete many times */
+    if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+        r->fd = -1;
+        return -1;
+    }
+#ifdef IORING_FEAT_LINKED_FILE
+    if (!(p.features & IORING_FEAT_LINKED_FILE) || !(p.features & IORING_FEAT_NODROP)) {
+#else
+    if (1) {
+#endif
+        close(r->fd);
+        r->fd = -1;
+        errno = ENOSYS;
+        return -1;
+    }
+    r->_sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->_cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    sq = (char *)mmap(NULL, r->_sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    cq = (char *)mmap(NULL, r->_cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->_sqes = (struct io_uring_sqe *)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    r->_sq_map = sq;
+    r->_cq_map = cq;
+    if (sq == MAP_FAILED || cq == MAP_FAILED || r->_sqes == MAP_FAILED) {
+        uring_destroy(r);
+        return -1;
+    }
+    r->_sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->_sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->_sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->_sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->_sq_entries = p.sq_entries;
+    r->_cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->_cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->_cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->_cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+void uring_destroy(uring_t *r)
+{
+    if (!r || r->fd < 0)
+        return;
+    if (r->_bufs)
+        munmap(r->_bufs, r->_buf_count * sizeof(struct io_uring_buf));
+    free(r->_buf_base);
+    if (r->_sqes && r->_sqes != MAP_FAILED)
+        munmap(r->_sqes, r->_sq_entries * sizeof(struct io_uring_sqe));
+    if (r->_cq_map && r->_cq_map != MAP_FAILED)
+        munmap(r->_cq_map, r->_cq_map_size);
+    if (r->_sq_map && r->_sq_map != MAP_FAILED)
+        munmap(r->_sq_map, r->_sq_map_size);
+    close(r->fd);
+    r->fd = -1;
+}
+
+/* Register count buffers of size bytes as group 0 for multishot receives */
+int uring_buffers(uring_t *r, unsigned count, size_t size)
+{
+    struct io_uring_buf_reg reg;
+    unsigned i;
+
+    if (!r || count == 0 || (count & (count - 1)) != 0)
+        return -1;
+    r->_bufs = (struct io_uring_buf_ring *)mmap(NULL, count * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->_bufs == MAP_FAILED) {
+        r->_bufs = NULL;
+        return -1;
+    }
+    if (!(r->_buf_base = (char *)malloc(count * size)))
+        return -1;
+    r->_buf_count = count;
+    r->_buf_size = size;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)r->_bufs;
+    reg.ring_entries = count;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return -1;
+    for (i = 0; i < count; i++)
+        uring_buffer_return(r, i);
+    return 0;
+}
+
+char *uring_buffer(uring_t *r, unsigned bid)
+{
+    return r->_buf_base + bid * r->_buf_size;
+}
+
+/* Hand a buffer back to the kernel once its data was consumed */
+void uring_buffer_return(uring_t *r, unsigned bid)
+{
+    struct io_uring_buf *buf = &r->_bufs->bufs[r->_buf_tail & (r->_buf_count - 1)];
+
+    buf->addr = (unsigned long)uring_buffer(r, bid);
+    buf->len = r->_buf_size;
+    buf->bid = bid;
+    __atomic_store_n(&r->_bufs->tail, ++r->_buf_tail, __ATOMIC_RELEASE);
+}
+
+/* Next free submission entry, cleared, or NULL if the ring is full even after submitting */
+struct io_uring_sqe *uring_sqe(uring_t *r)
+{
+    unsigned tail = *r->_sq_tail, index;
+    struct io_uring_sqe *sqe;
+
+    if (tail - __atomic_load_n(r->_sq_head, __ATOMIC_ACQUIRE) >= r->_sq_entries) {
+        if (uring_enter(r, 0, -1) == -1)
+            return NULL;
+        if (tail - __atomic_load_n(r->_sq_head, __ATOMIC_ACQUIRE) >= r->_sq_entries)
+            return NULL;
+    }
+    index = tail & *r->_sq_mask;
+    sqe = &r->_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    r->_sq_array[index] = index;
+    __atomic_store_n(r->_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->_sq_pending++;
+    return sqe;
+}
+
+/*
+ * Submit what is pending in one system call, waiting for wait completions
+ * but no longer than timeout microseconds unless it is negative. Fails
+ * with ETIME if the time is up.
+ */
+int uring_enter(uring_t *r, unsigned wait, long timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    int ret;
+
+    if (wait && timeout >= 0) {
+        memset(&arg, 0, sizeof(arg));
+        ts.tv_sec = timeout / 1000000;
+        ts.tv_nsec = timeout % 1000000 * 1000;
+        arg.ts = (unsigned long)&ts;
+        ret = syscall(__NR_io_uring_enter, r->fd, r->_sq_pending, wait, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                &arg, sizeof(arg));
+    } else {
+        ret = syscall(__NR_io_uring_enter, r->fd, r->_sq_pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    }
+    if (ret < 0)
+        return -1;
+    r->_sq_pending -= (unsigned)ret < r->_sq_pending ? (unsigned)ret : r->_sq_pending;
+    return ret;
+}
+
+struct io_uring_cqe *uring_cqe(uring_t *r)
+{
+    unsigned head = *r->_cq_head;
+
+    if (head == __atomic_load_n(r->_cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &r->_cqes[head & *r->_cq_mask];
+}
+
+void uring_cqe_seen(uring_t *r)
+{
+    __atomic_store_n(r->_cq_head, *r->_cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_accept_multishot(uring_t *r, int fd, int flags, __u64 data)
+{
+    struct io_uring_sqe *sqe = uring_sqe(r);
+
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = flags;
+    sqe->user_data = data;
+    return 0;
+}
+
+/* Receive into provided buffers until the connection ends or buffers run out */
+int uring_recv_multishot(uring_t *r, int fd, __u64 data)
+{
+    struct io_uring_sqe *sqe = uring_sqe(r);
+
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = data;
+    return 0;
+}
+
+int uring_sendmsg(uring_t *r, int fd, const void *msg, int flags, __u64 data)
+{
+    struct io_uring_sqe *sqe = uring_sqe(r);
+
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | flags;
+    sqe->user_data = data;
+    return 0;
+}
+
+int uring_poll_multishot(uring_t *r, int fd, unsigned events, __u64 data)
+{
+    struct io_uring_sqe *sqe = uring_sqe(r);
+
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = data;
+    return 0;
+}
+
+int uring_poll(uring_t *r, int fd, unsigned events, __u64 data)
+{
+    struct io_uring_sqe *sqe = uring_sqe(r);
+
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = data;
+    return 0;
+}
+
+/* Cancel the operation submitted with user data target, its completion reports -ECANCELED */
+int uring_cancel(uring_t *r, __u64 target)
+{
+    struct io_uring_sqe *sqe = uring_sqe(r);
+
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = 0;                         /* Nobody waits for the cancellation itself */
+    return 0;
+}
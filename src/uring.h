@@ -0,0 +1,77 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+/*
+ * Minimal io_uring binding on raw system calls: one submission and one
+ * completion ring, plus a ring of provided receive buffers. Submissions
+ * are batched until uring_enter(). Only the thread owning the ring may
+ * use it.
+ */
+typedef struct uring {
+    int fd;
+    unsigned *_sq_head, *_sq_tail, *_sq_mask, *_sq_array;
+    struct io_uring_sqe *_sqes;
+    unsigned _sq_entries, _sq_pending;
+    unsigned *_cq_head, *_cq_tail, *_cq_mask;
+    struct io_uring_cqe *_cqes;
+    void *_sq_map, *_cq_map;
+    size_t _sq_map_size, _cq_map_size;
+    struct io_uring_buf_ring *_bufs;    /* Provided buffers, group 0 */
+    char *_buf_base;
+    unsigned _buf_count, _buf_tail;
+    size_t _buf_size;
+} uring_t;
+
+/* Operations are tagged in the low bits of the user data pointer */
+#define URING_TAG_BITS 3
+#define uring_data(ptr, tag) ((__u64)(unsigned long)(ptr) | (tag))
+#define uring_ptr(data) ((void *)(unsigned long)((data) & ~(((__u64)1 << URING_TAG_BITS) - 1)))
+#define uring_tag(data) ((int)((data) & (((__u64)1 << URING_TAG_BITS) - 1)))
+
+int uring_init(uring_t *r, unsigned entries);
+void uring_destroy(uring_t *r);
+int uring_buffers(uring_t *r, unsigned count, size_t size);
+
+struct io_uring_sqe *uring_sqe(uring_t *r);
+int uring_enter(uring_t *r, unsigned wait, long timeout);
+struct io_uring_cqe *uring_cqe(uring_t *r);
+void uring_cqe_seen(uring_t *r);
+char *uring_buffer(uring_t *r, unsigned bid);
+void uring_buffer_return(uring_t *r, unsigned bid);
+
+int uring_accept_multishot(uring_t *r, int fd, int flags, __u64 data);
+int uring_recv_multishot(uring_t *r, int fd, __u64 data);
+int uring_sendmsg(uring_t *r, int fd, const void *msg, int flags, __u64 data);
+int uring_poll_multishot(uring_t *r, int fd, unsigned events, __u64 data);
+int uring_poll(uring_t *r, int fd, unsigned events, __u64 data);
+int uring_cancel(uring_t *r, __u64 target);
+
+#endif
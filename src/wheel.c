@@ -0,0 +1,153 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <string.h>
+
+#include "wheel.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+void wheel_init(wheel_t *w, unsigned long now)
+{
+    if (!w)
+        return;
+    memset(w, 0, sizeof(wheel_t));
+    w->now = now;
+}
+
+void wheel_timer_init(wheel_timer_t *t, void *data)
+{
+    if (!t)
+        return;
+    t->expires = 0;
+    t->data = data;
+    t->_next = NULL;
+    t->_pprev = NULL;
+}
+
+/* Link a timer into the slot covering its expiry as seen from the current tick */
+static void wheel_place(wheel_t *w, wheel_timer_t *t)
+{
+    unsigned long delta = t->expires - w->now;
+    wheel_timer_t **slot;
+    int level;
+
+    for (level = 0; level < WHEEL_LEVELS - 1; level++)
+        if (delta < 1UL << (WHEEL_BITS * (level + 1)))
+            break;
+    if (delta >= 1UL << (WHEEL_BITS * WHEEL_LEVELS))            /* Too far ahead, park it in the last slot reachable */
+        slot = &w->_slots[level][((w->now >> (WHEEL_BITS * level)) - 1) & WHEEL_MASK];
+    else
+        slot = &w->_slots[level][(t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    if ((t->_next = *slot))
+        t->_next->_pprev = &t->_next;
+    t->_pprev = slot;
+    *slot = t;
+}
+
+/*
+ * Arm a timer for the tick expires, rearming it if it is armed already.
+ * Ticks that passed already fire with the next one processed.
+ */
+void wheel_add(wheel_t *w, wheel_timer_t *t, unsigned long expires)
+{
+    if (!w || !t)
+        return;
+    wheel_del(w, t);
+    t->expires = (long)(expires - w->now) < 0 ? w->now : expires;
+    wheel_place(w, t);
+    w->count++;
+}
+
+void wheel_del(wheel_t *w, wheel_timer_t *t)
+{
+    if (!w || !t || !t->_pprev)
+        return;
+    if ((*t->_pprev = t->_next))
+        t->_next->_pprev = t->_pprev;
+    t->_next = NULL;
+    t->_pprev = NULL;
+    w->count--;
+}
+
+/* Move the timers of a higher level slot down to where they belong now */
+static void wheel_cascade(wheel_t *w, int level, int index)
+{
+    wheel_timer_t *t = w->_slots[level][index], *next;
+
+    w->_slots[level][index] = NULL;
+    for (; t; t = next) {
+        next = t->_next;
+        wheel_place(w, t);
+    }
+}
+
+/*
+ * Process every tick up to and including now, calling callback for each
+ * timer expiring. The timer is disarmed before, the callback may arm it
+ * again or any other timer.
+ */
+void wheel_advance(wheel_t *w, unsigned long now, wheel_callback_t callback, void *data)
+{
+    wheel_timer_t *expired, *t;
+    unsigned long tick;
+    int level;
+
+    if (!w)
+        return;
+    while ((long)(now - w->now) >= 0) {
+        tick = w->now;
+        for (level = 1; level < WHEEL_LEVELS && ((tick >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK) == 0; level++)
+            wheel_cascade(w, level, (tick >> (WHEEL_BITS * level)) & WHEEL_MASK);
+        w->now = tick + 1;                                          /* Timers armed by callbacks go after this tick */
+        if ((expired = w->_slots[0][tick & WHEEL_MASK])) {         /* Detached, a timer may be armed into this slot again */
+            w->_slots[0][tick & WHEEL_MASK] = NULL;
+            expired->_pprev = &expired;
+        }
+        while ((t = expired)) {
+            wheel_del(w, t);
+            callback(t, data);
+        }
+    }
+}
+
+/*
+ * Ticks after the last one processed until the wheel has work to do, at
+ * a cascade if nothing expires before. Returns -1 if no timer is armed.
+ */
+long wheel_next(const wheel_t *w)
+{
+    unsigned long i, left;
+
+    if (!w || w->count == 0)
+        return -1;
+    if ((w->now & WHEEL_MASK) == 0)                                 /* Cascades with the next tick */
+        return 1;
+    left = WHEEL_SLOTS - (w->now & WHEEL_MASK);
+    for (i = 0; i < left; i++)
+        if (w->_slots[0][(w->now + i) & WHEEL_MASK])
+            return i + 1;
+    return left + 1;
+}
@@ -0,0 +1,66 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef WHEEL_H
+#define WHEEL_H
+
+/*
+ * Hierarchical timing wheel. Time advances in ticks, the first level has
+ * one slot per tick and every further level one slot per full turn of
+ * the level below. Arming and disarming a timer are O(1), expiring costs
+ * O(1) per timer plus moving it down one level per cascade at most.
+ * Callers embed a wheel_timer_t wherever they need a timer. The wheel is
+ * not thread-safe.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4              /* 2^24 ticks ahead at most, later ones are cascaded again */
+
+typedef struct wheel_timer {
+    unsigned long expires;          /* Tick to fire at */
+    void *data;
+    struct wheel_timer *_next;
+    struct wheel_timer **_pprev;    /* Link pointing to this timer, NULL if not armed */
+} wheel_timer_t;
+
+typedef struct wheel {
+    unsigned long now;              /* Next tick to process */
+    unsigned long count;            /* Armed timers */
+    wheel_timer_t *_slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} wheel_t;
+
+typedef void (*wheel_callback_t)(wheel_timer_t *timer, void *data);
+
+void wheel_init(wheel_t *w, unsigned long now);
+void wheel_timer_init(wheel_timer_t *t, void *data);
+
+void wheel_add(wheel_t *w, wheel_timer_t *t, unsigned long expires);
+void wheel_del(wheel_t *w, wheel_timer_t *t);
+void wheel_advance(wheel_t *w, unsigned long now, wheel_callback_t callback, void *data);
+long wheel_next(const wheel_t *w);
+
+#define wheel_armed(t) ((t)->_pprev != NULL)
+
+#endif
@@ -0,0 +1,85 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <string.h>
+
+#include "zip.h"
+
+void zip_init(zip_t *z, int level)
+{
+    memset(z, 0, sizeof(zip_t));
+    z->_level = level;
+}
+
+void zip_destroy(zip_t *z)
+{
+    if (!z || !z->_ready)
+        return;
+    deflateEnd(&z->_stream);
+    z->_ready = 0;
+}
+
+/*
+ * Compress len bytes of src into dst as one complete raw deflate stream.
+ * Returns the compressed length or -1 if it doesn't fit into size bytes,
+ * so passing len as size leaves out what wouldn't get any shorter.
+ */
+ssize_t zip_compress(zip_t *z, const char *src, size_t len, char *dst, size_t size)
+{
+    z_stream *s = &z->_stream;
+
+    if (!z->_ready) {
+        if (deflateInit2(s, z->_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return -1;
+        z->_ready = 1;
+    } else if (deflateReset(s) != Z_OK) {
+        return -1;
+    }
+    s->next_in = (Bytef *)src;
+    s->avail_in = (uInt)len;
+    s->next_out = (Bytef *)dst;
+    s->avail_out = (uInt)size;
+    if (deflate(s, Z_FINISH) != Z_STREAM_END)
+        return -1;
+    return (ssize_t)(size - s->avail_out);
+}
+
+/*
+ * Inflate one message compressed by zip_compress() with s, which was set
+ * up by inflateInit2() with -15 window bits. Returns the length or -1 if
+ * the data is corrupt or doesn't fit into size bytes.
+ */
+ssize_t zip_inflate(z_stream *s, const char *src, size_t len, char *dst, size_t size)
+{
+    if (inflateReset(s) != Z_OK)
+        return -1;
+    s->next_in = (Bytef *)src;
+    s->avail_in = (uInt)len;
+    s->next_out = (Bytef *)dst;
+    s->avail_out = (uInt)size;
+    if (inflate(s, Z_FINISH) != Z_STREAM_END)
+        return -1;
+    return (ssize_t)(size - s->avail_out);
+}
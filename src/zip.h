@@ -0,0 +1,53 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef ZIP_H
+#define ZIP_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <zlib.h>
+
+/*
+ * Messages compressed one by one with raw deflate, without a zlib header
+ * or checksum, so that the compressed bytes stand alone and may be sent
+ * to any number of clients. A client inflates every message with a fresh
+ * or reset stream. The deflate state is allocated on first use and
+ * reset for each message, which is far cheaper than setting it up every
+ * time.
+ */
+typedef struct zip {
+    z_stream _stream;
+    int _level;
+    int _ready;                     /* Stream was initialized */
+} zip_t;
+
+void zip_init(zip_t *z, int level);
+void zip_destroy(zip_t *z);
+
+ssize_t zip_compress(zip_t *z, const char *src, size_t len, char *dst, size_t size);
+ssize_t zip_inflate(z_stream *s, const char *src, size_t len, char *dst, size_t size);
+
+#endif
@@ -0,0 +1,226 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE 1
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "list.h"
+#include "registry.h"
+
+/*
+ * Contended adds, removes and walks of the client registry against the
+ * list_t it replaced. Every writer keeps its share of the clients in the
+ * set and replaces one picked at random per step, like a client leaving
+ * and another one joining, while the walkers keep broadcasting to all.
+ */
+#define BENCH_MAX_THREADS 64
+
+static int writers = 4, walkers = 4, clients = 1000, steps = 100000;
+static int done;
+static list_t list;
+static registry_t reg;
+static void *memory[BENCH_MAX_THREADS];  /* Entries of each writer */
+static unsigned long walks[BENCH_MAX_THREADS], visits[BENCH_MAX_THREADS];
+static pthread_barrier_t started, finished;
+
+static double bench_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Picks the slot of the client to replace next */
+static int bench_pick(unsigned long *seed, int share)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return (int)((*seed >> 16) % share);
+}
+
+static void *list_writer(void *arg)
+{
+    int share = clients / writers, i, slot;
+    list_item_t *items = (list_item_t *)malloc((share + steps) * sizeof(list_item_t)), **live;
+    unsigned long seed = (unsigned long)(long)arg;
+
+    live = (list_item_t **)malloc(share * sizeof(list_item_t *));
+    for (i = 0; i < share; i++) {
+        live[i] = &items[i];
+        list_add(&list, live[i]);
+    }
+    pthread_barrier_wait(&started);
+    for (i = 0; i < steps; i++) {
+        slot = bench_pick(&seed, share);
+        list_remove(&list, live[slot]);
+        live[slot] = &items[share + i];
+        list_add(&list, live[slot]);
+    }
+    pthread_barrier_wait(&finished);
+    for (i = 0; i < share; i++)
+        list_remove(&list, live[i]);
+    free(live);
+    return items;
+}
+
+static void *registry_writer(void *arg)
+{
+    int share = clients / writers, i, slot;
+    registry_entry_t *entries = (registry_entry_t *)malloc((share + steps) * sizeof(registry_entry_t)), **live;
+    unsigned long seed = (unsigned long)(long)arg;
+
+    live = (registry_entry_t **)malloc(share * sizeof(registry_entry_t *));
+    for (i = 0; i < share; i++) {
+        live[i] = &entries[i];
+        registry_add(&reg, live[i]);
+    }
+    pthread_barrier_wait(&started);
+    for (i = 0; i < steps; i++) {
+        slot = bench_pick(&seed, share);
+        registry_remove(&reg, live[slot]);
+        live[slot] = &entries[share + i];               /* Never reused, so nothing to release */
+        registry_add(&reg, live[slot]);
+    }
+    pthread_barrier_wait(&finished);
+    for (i = 0; i < share; i++)
+        registry_remove(&reg, live[i]);
+    free(live);
+    return entries;
+}
+
+static void visit_item(list_item_t *item, void *data)
+{
+    (void)item;
+    (*(unsigned long *)data)++;
+}
+
+static void visit_entry(registry_entry_t *entry, void *data)
+{
+    (void)entry;
+    (*(unsigned long *)data)++;
+}
+
+/* Walk until the writers are done */
+static void *list_walker(void *arg)
+{
+    int i = (int)(long)arg;
+
+    pthread_barrier_wait(&started);
+    while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+        list_apply(&list, visit_item, &visits[i]);
+        walks[i]++;
+    }
+    return NULL;
+}
+
+static void *registry_walker(void *arg)
+{
+    int i = (int)(long)arg;
+
+    pthread_barrier_wait(&started);
+    while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+        registry_apply(&reg, visit_entry, &visits[i]);
+        walks[i]++;
+    }
+    return NULL;
+}
+
+static void bench(const char *name, void *(*writer)(void *), void *(*walker)(void *))
+{
+    pthread_t writer_tids[BENCH_MAX_THREADS], walker_tids[BENCH_MAX_THREADS];
+    unsigned long total = 0, visited = 0;
+    double start, took;
+    int i;
+
+    done = 0;
+    pthread_barrier_init(&started, NULL, writers + walkers + 1);
+    pthread_barrier_init(&finished, NULL, writers + 1);
+    for (i = 0; i < walkers; i++) {
+        walks[i] = visits[i] = 0;
+        pthread_create(&walker_tids[i], NULL, walker, (void *)(long)i);
+    }
+    for (i = 0; i < writers; i++)
+        pthread_create(&writer_tids[i], NULL, writer, (void *)(long)(i + 1));
+    pthread_barrier_wait(&started);                     /* Everybody is in */
+    start = bench_now();
+    pthread_barrier_wait(&finished);
+    took = bench_now() - start;
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < writers; i++)
+        pthread_join(writer_tids[i], &memory[i]);
+    for (i = 0; i < walkers; i++) {
+        pthread_join(walker_tids[i], NULL);
+        total += walks[i];
+        visited += visits[i];
+    }
+    pthread_barrier_destroy(&started);
+    pthread_barrier_destroy(&finished);
+    printf("%-10s %8.3f s %12.0f joins+leaves/s %10.0f walks/s of %lu clients\n", name, took,
+           (double)writers * steps / took, total / took, total ? visited / total : 0);
+}
+
+/* Once nothing refers to the entries anymore */
+static void bench_free(void)
+{
+    int i;
+
+    for (i = 0; i < writers; i++)
+        free(memory[i]);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "w:r:c:s:")) != -1) {
+        switch (opt) {
+            case 'w': writers = atoi(optarg); break;
+            case 'r': walkers = atoi(optarg); break;
+            case 'c': clients = atoi(optarg); break;
+            case 's': steps = atoi(optarg); break;
+            default: writers = 0;
+        }
+    }
+    if (writers < 1 || writers > BENCH_MAX_THREADS || walkers < 0 || walkers > BENCH_MAX_THREADS
+            || clients < writers || steps < 1) {
+        fprintf(stderr, "Usage: %s [-w writers] [-r walkers] [-c clients] [-s steps]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    printf("%d writers replacing %d times each, %d walkers, %d clients\n", writers, steps, walkers, clients);
+    list_init(&list);
+    bench("list", list_writer, list_walker);
+    list_destroy(&list);
+    bench_free();
+    registry_init(&reg, NULL);
+    bench("registry", registry_writer, registry_walker);
+    registry_destroy(&reg);                             /* Releases what is left in limbo */
+    bench_free();
+    return EXIT_SUCCESS;
+}
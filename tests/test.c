@@ -0,0 +1,69 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test.h"
+
+static int failed = 0;
+
+int test_check(int ok, const char *what, const char *file, int line)
+{
+    if (!ok) {
+        fprintf(stderr, "%s:%d: Check failed: %s\n", file, line, what);
+        failed++;
+    }
+    return ok;
+}
+
+int main(void)
+{
+    struct {
+        const char *name;
+        void (*run)(void);
+    } tests[] = {
+        { "bucket", test_bucket },
+        { "frame", test_frame },
+        { "outq", test_outq },
+        { "registry", test_registry },
+        { "relay", test_relay },
+        { "wheel", test_wheel },
+        { "zip", test_zip }
+    };
+    unsigned int i;
+    int before;
+
+    for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        before = failed;
+        tests[i].run();
+        printf("%-10s %s\n", tests[i].name, failed == before ? "ok" : "FAILED");
+    }
+    if (failed > 0) {
+        printf("%d checks failed\n", failed);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
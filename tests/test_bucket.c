@@ -0,0 +1,49 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "bucket.h"
+#include "test.h"
+
+void test_bucket(void)
+{
+    bucket_t b;
+
+    bucket_init(&b, 1000, 10, 5000);                    /* A token per millisecond */
+    CHECK(bucket_wait(&b, 10, 5000) == 0);              /* Starts full */
+    bucket_take(&b, 10);
+    CHECK(bucket_wait(&b, 1, 5000) == 1001);
+    CHECK(bucket_wait(&b, 1, 5999) > 0);
+    CHECK(bucket_wait(&b, 1, 6001) == 0);
+    CHECK(bucket_wait(&b, 5, 6001) > 0);
+    CHECK(bucket_wait(&b, 100, 1000000) == 0);          /* Never more than the burst is asked for */
+    bucket_take(&b, 100);
+    CHECK(b.tokens == 0);
+    bucket_wait(&b, 1, 100000000);
+    CHECK(b.tokens == 10);                              /* A long pause doesn't save up more */
+
+    bucket_init(&b, 0, 1, 0);                           /* Unlimited */
+    bucket_take(&b, 1000);
+    CHECK(bucket_wait(&b, 1000, 0) == 0);
+}
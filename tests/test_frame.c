@@ -0,0 +1,140 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <string.h>
+#include <unistd.h>
+
+#include "frame.h"
+#include "test.h"
+
+static int next_is(frame_t *f, const char *expected)
+{
+    char *line;
+    size_t len;
+
+    return frame_next(f, &line, &len) && len == strlen(expected) && memcmp(line, expected, len) == 0;
+}
+
+/* Lines come out whole, however the input was cut */
+static void test_frame_lines(void)
+{
+    frame_t f;
+    char buf[64], *line;
+    size_t len;
+
+    frame_init(&f, sizeof(buf), buf, sizeof(buf));
+    CHECK(!frame_next(&f, &line, &len));
+    CHECK(frame_feed(&f, "hel", 3) == 3);
+    CHECK(!frame_next(&f, &line, &len));
+    frame_feed(&f, "lo\r\nwor", 7);
+    CHECK(next_is(&f, "hello\r\n"));
+    CHECK(!frame_next(&f, &line, &len));
+    frame_feed(&f, "ld\nPING\r\nbye\n", 13);
+    CHECK(next_is(&f, "world\n"));
+    CHECK(next_is(&f, "PING\r\n"));
+    frame_unget(&f);
+    CHECK(next_is(&f, "PING\r\n"));
+    CHECK(next_is(&f, "bye\n"));
+    CHECK(!frame_next(&f, &line, &len));
+    CHECK(frame_room(&f) == sizeof(buf));
+}
+
+/* Lines longer than max are skipped up to their end, with or without it in the buffer */
+static void test_frame_oversized(void)
+{
+    frame_t f;
+    char buf[32], *line;
+    size_t len;
+
+    frame_init(&f, 8, buf, sizeof(buf));
+    frame_feed(&f, "0123456789\nok\n", 14);
+    CHECK(next_is(&f, "ok\n"));
+    CHECK(f.oversized == 1);
+    frame_feed(&f, "abcdefghij", 10);
+    CHECK(!frame_next(&f, &line, &len));
+    frame_feed(&f, "klm\nhi\n", 7);
+    CHECK(next_is(&f, "hi\n"));
+    CHECK(f.oversized == 2);
+    CHECK(frame_feed(&f, "0123456789012345678901234567890123456789", 40) == sizeof(buf));
+}
+
+static void test_frame_read(void)
+{
+    frame_t f;
+    char buf[64], *line;
+    size_t len;
+    int fds[2];
+
+    if (!CHECK(pipe(fds) == 0))
+        return;
+    frame_init(&f, sizeof(buf), buf, sizeof(buf));
+    CHECK(write(fds[1], "one\ntw", 6) == 6);
+    CHECK(frame_read(&f, fds[0]) == 6);
+    CHECK(next_is(&f, "one\n"));
+    CHECK(!frame_next(&f, &line, &len));
+    CHECK(write(fds[1], "o\n", 2) == 2);
+    close(fds[1]);
+    CHECK(frame_read(&f, fds[0]) == 2);
+    CHECK(next_is(&f, "two\n"));
+    CHECK(frame_read(&f, fds[0]) == 0);
+    close(fds[0]);
+}
+
+static void test_frame_binary(void)
+{
+    frame_t f;
+    char buf[32], wire[64], *payload;
+    unsigned long sender;
+    size_t len;
+    int type;
+
+    frame_init(&f, sizeof(buf), buf, sizeof(buf));
+    frame_header(wire, FRAME_MSG, 70000, 5);
+    memcpy(wire + FRAME_HEADER_SIZE, "hello", 5);
+    frame_feed(&f, wire, 8);
+    CHECK(!frame_next_binary(&f, &type, &sender, &payload, &len));
+    frame_feed(&f, wire + 8, FRAME_HEADER_SIZE + 5 - 8);
+    CHECK(frame_next_binary(&f, &type, &sender, &payload, &len));
+    CHECK(type == FRAME_MSG && sender == 70000 && len == 5 && memcmp(payload, "hello", 5) == 0);
+
+    frame_header(wire, FRAME_MSG, 1, 40);               /* Larger than the buffer */
+    memset(wire + FRAME_HEADER_SIZE, 'x', 40);
+    frame_feed(&f, wire, 30);
+    CHECK(!frame_next_binary(&f, &type, &sender, &payload, &len));
+    frame_feed(&f, wire + 30, FRAME_HEADER_SIZE + 40 - 30);
+    frame_header(wire, FRAME_PING, 2, 0);
+    frame_feed(&f, wire, FRAME_HEADER_SIZE);
+    CHECK(frame_next_binary(&f, &type, &sender, &payload, &len));
+    CHECK(type == FRAME_PING && sender == 2 && len == 0);
+    CHECK(f.oversized == 1);
+}
+
+void test_frame(void)
+{
+    test_frame_lines();
+    test_frame_oversized();
+    test_frame_read();
+    test_frame_binary();
+}
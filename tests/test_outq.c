@@ -0,0 +1,131 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <sys/socket.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "msgbuf.h"
+#include "outq.h"
+#include "test.h"
+
+static slab_t slab;
+
+static msgbuf_t *message(const char *text)
+{
+    msgbuf_t *buf = msgbuf_new(&slab, strlen(text));
+
+    memcpy(buf->data, text, strlen(text));
+    return buf;
+}
+
+/* Queue a fresh message, the queue holding the only reference afterwards */
+static int push(outq_t *q, const char *text, outq_policy_t policy)
+{
+    msgbuf_t *buf = message(text);
+    int ret = outq_push(q, buf, policy);
+
+    msgbuf_unref(buf);
+    return ret;
+}
+
+static void test_outq_order(void)
+{
+    outq_t q;
+    char out[512], expected[512];
+    int i;
+
+    outq_init(&q, 4096, 1024);
+    expected[0] = '\0';
+    for (i = 0; i < 3 * OUTQ_INLINE; i++) {             /* Grows past the inline ring */
+        CHECK(push(&q, i % 2 ? "odd\n" : "even\n", OUTQ_DROP_NEWEST) == 0);
+        strcat(expected, i % 2 ? "odd\n" : "even\n");
+    }
+    CHECK(q.count == 3 * OUTQ_INLINE && q.bytes == strlen(expected));
+    CHECK(outq_copy(&q, out) == (ssize_t)strlen(expected) && memcmp(out, expected, q.bytes) == 0);
+    CHECK(outq_take(&q, out, 7) == 7);                  /* Stops within a message */
+    CHECK(q.count == 3 * OUTQ_INLINE - 1 && q.bytes == strlen(expected) - 7);
+    CHECK(outq_take(&q, out + 7, sizeof(out)) == (ssize_t)strlen(expected) - 7);
+    CHECK(memcmp(out, expected, strlen(expected)) == 0);
+    CHECK(q.count == 0 && q.bytes == 0 && q.sent == 3 * OUTQ_INLINE);
+    outq_destroy(&q);
+}
+
+static void test_outq_policies(void)
+{
+    outq_t q;
+    char out[64];
+
+    outq_init(&q, 10, 4);
+    CHECK(push(&q, "aaaa", OUTQ_DROP_NEWEST) == 0);
+    CHECK(push(&q, "bbbb", OUTQ_DROP_NEWEST) == 0);
+    CHECK(push(&q, "cccc", OUTQ_DROP_NEWEST) == 1);     /* Above the high watermark */
+    CHECK(q.congested && q.drops == 1 && q.count == 2);
+    CHECK(push(&q, "dd", OUTQ_DISCONNECT) == -1);
+    CHECK(push(&q, "eeee", OUTQ_DROP_OLDEST) == 1);     /* Congested until below the low one */
+    CHECK(q.drops == 2 && q.count == 2);
+    CHECK(outq_copy(&q, out) == 8 && memcmp(out, "bbbbeeee", 8) == 0);
+    outq_take(&q, out, 2);
+    CHECK(q.congested);
+    outq_take(&q, out, 2);
+    CHECK(!q.congested);
+    CHECK(push(&q, "ffff", OUTQ_DISCONNECT) == 0);
+    outq_destroy(&q);
+    CHECK(q.count == 0 && q.bytes == 0);
+}
+
+/* A partly written head is neither dropped nor sent twice */
+static void test_outq_write(void)
+{
+    struct iovec iov[OUTQ_IOV_MAX];
+    outq_t q;
+    char out[64];
+    int fds[2];
+
+    if (!CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0))
+        return;
+    outq_init(&q, 12, 12);
+    push(&q, "hello\n", OUTQ_DROP_OLDEST);
+    push(&q, "world\n", OUTQ_DROP_OLDEST);
+    CHECK(outq_prepare(&q, iov, OUTQ_IOV_MAX) == 2 && q.pinned == 2);
+    outq_complete(&q, 3);
+    CHECK(push(&q, "again\n", OUTQ_DROP_OLDEST) == 1);
+    CHECK(q.count == 2 && q.bytes == 9);                /* Dropped "world" behind the partial head */
+    CHECK(outq_write(&q, fds[1]) == 9);
+    CHECK(read(fds[0], out, sizeof(out)) == 9 && memcmp(out, "lo\nagain\n", 9) == 0);
+    CHECK(q.count == 0 && q.sent == 2);
+    outq_destroy(&q);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+void test_outq(void)
+{
+    slab_init(&slab);
+    test_outq_order();
+    test_outq_policies();
+    test_outq_write();
+    slab_destroy(&slab);
+}
@@ -0,0 +1,304 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "registry.h"
+#include "test.h"
+
+#define REGISTRY_ENTRIES 1000
+
+#define STRESS_ENTRIES 200000
+#define STRESS_PINNED 16                /* Never removed while the walks run */
+#define STRESS_LIVE 64                  /* Removable entries in the registry at a time */
+#define STRESS_WALKERS 3
+
+enum { ENTRY_LIVE = 1, ENTRY_RETIRED, ENTRY_RELEASED };
+
+static int *states;
+static int released, stress_done, bad_visits, bad_walks;
+
+static void release_entry(registry_entry_t *entry)
+{
+    int *state = (int *)entry->data;
+
+    if (__atomic_load_n(state, __ATOMIC_SEQ_CST) != ENTRY_RETIRED)
+        __atomic_add_fetch(&bad_visits, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(state, ENTRY_RELEASED, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&released, 1, __ATOMIC_SEQ_CST);
+}
+
+static void count_entry(registry_entry_t *entry, void *data)
+{
+    (void)entry;
+    (*(int *)data)++;
+}
+
+/* Cut the links of every entry outside [keep_from, keep_to], saving them first */
+static void registry_cut(registry_entry_t *entries, registry_entry_t *saved, int count, int keep_from, int keep_to)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        saved[i] = entries[i];
+        if (i < keep_from || i > keep_to)
+            entries[i]._next = entries[i]._prev = NULL;
+    }
+}
+
+static void registry_mend(registry_entry_t *entries, registry_entry_t *saved, int count, int keep_from, int keep_to)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+        if (i < keep_from || i > keep_to)
+            entries[i] = saved[i];
+}
+
+/*
+ * Adding and removing touch the entry and its neighbours only, whatever
+ * the size. Every other link is cut before, a walk would crash on it.
+ */
+static void test_registry_constant(void)
+{
+    static registry_entry_t entries[REGISTRY_ENTRIES + 1], saved[REGISTRY_ENTRIES];
+    registry_t reg;
+    int i, mid = REGISTRY_ENTRIES / 2, count = 0;
+
+    registry_init(&reg, NULL);
+    for (i = 0; i < REGISTRY_ENTRIES; i++)              /* Walked from the last one down */
+        registry_add(&reg, &entries[i]);
+
+    registry_cut(entries, saved, REGISTRY_ENTRIES, REGISTRY_ENTRIES - 1, REGISTRY_ENTRIES - 1);
+    registry_add(&reg, &entries[REGISTRY_ENTRIES]);
+    registry_mend(entries, saved, REGISTRY_ENTRIES, REGISTRY_ENTRIES - 1, REGISTRY_ENTRIES - 1);
+    CHECK(entries[REGISTRY_ENTRIES]._next == &entries[REGISTRY_ENTRIES - 1]);
+    CHECK(entries[REGISTRY_ENTRIES - 1]._prev == &entries[REGISTRY_ENTRIES]);
+
+    registry_cut(entries, saved, REGISTRY_ENTRIES, mid - 1, mid + 1);
+    registry_remove(&reg, &entries[mid]);
+    registry_mend(entries, saved, REGISTRY_ENTRIES, mid - 1, mid + 1);
+    CHECK(entries[mid + 1]._next == &entries[mid - 1] && entries[mid - 1]._prev == &entries[mid + 1]);
+
+    registry_apply(&reg, count_entry, &count);
+    CHECK(count == REGISTRY_ENTRIES && registry_size(&reg) == REGISTRY_ENTRIES);
+    registry_destroy(&reg);
+}
+
+static void test_registry_basics(void)
+{
+    registry_t reg;
+    registry_entry_t entries[3];
+    int count = 0;
+
+    registry_init(&reg, NULL);
+    CHECK(registry_size(&reg) == 0);
+    registry_apply(&reg, count_entry, &count);
+    CHECK(count == 0);
+    registry_add(&reg, &entries[0]);
+    registry_add(&reg, &entries[1]);
+    registry_add(&reg, &entries[2]);
+    registry_remove(&reg, &entries[1]);
+    CHECK(registry_size(&reg) == 2);
+    registry_apply(&reg, count_entry, &count);
+    CHECK(count == 2);
+    registry_remove(&reg, &entries[0]);
+    registry_remove(&reg, &entries[2]);
+    CHECK(registry_size(&reg) == 0);
+    registry_destroy(&reg);
+}
+
+typedef struct walk {
+    int pinned[STRESS_PINNED];          /* Visits of the entries never removed */
+} walk_t;
+
+static void visit_entry(registry_entry_t *entry, void *data)
+{
+    int *state = (int *)entry->data;
+
+    if (__atomic_load_n(state, __ATOMIC_SEQ_CST) == ENTRY_RELEASED)
+        __atomic_add_fetch(&bad_visits, 1, __ATOMIC_SEQ_CST);
+    if (state - states < STRESS_PINNED)
+        ((walk_t *)data)->pinned[state - states]++;
+}
+
+static void *walk_func(void *arg)
+{
+    registry_t *reg = (registry_t *)arg;
+    walk_t walk;
+    int i;
+
+    while (!__atomic_load_n(&stress_done, __ATOMIC_SEQ_CST)) {
+        for (i = 0; i < STRESS_PINNED; i++)
+            walk.pinned[i] = 0;
+        registry_apply(reg, visit_entry, &walk);
+        for (i = 0; i < STRESS_PINNED; i++)
+            if (walk.pinned[i] != 1)
+                __atomic_add_fetch(&bad_walks, 1, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+static void stress_remove(registry_t *reg, registry_entry_t *entry)
+{
+    __atomic_store_n((int *)entry->data, ENTRY_RETIRED, __ATOMIC_SEQ_CST);
+    registry_remove(reg, entry);
+}
+
+/* Walks running while entries come and go see every entry that stays, and none released */
+static void test_registry_concurrent(void)
+{
+    registry_t reg;
+    registry_entry_t *entries = (registry_entry_t *)malloc(STRESS_ENTRIES * sizeof(registry_entry_t));
+    registry_entry_t *live[STRESS_LIVE];
+    pthread_t walkers[STRESS_WALKERS];
+    unsigned long seed = 1;
+    int i, next;
+
+    states = (int *)calloc(STRESS_ENTRIES, sizeof(int));
+    released = stress_done = bad_visits = bad_walks = 0;
+    registry_init(&reg, release_entry);
+    for (i = 0; i < STRESS_ENTRIES; i++)
+        entries[i].data = &states[i];
+    for (next = 0; next < STRESS_PINNED + STRESS_LIVE; next++) {
+        states[next] = ENTRY_LIVE;
+        registry_add(&reg, &entries[next]);
+        if (next >= STRESS_PINNED)
+            live[next - STRESS_PINNED] = &entries[next];
+    }
+    for (i = 0; i < STRESS_WALKERS; i++)
+        pthread_create(&walkers[i], NULL, walk_func, &reg);
+    for (; next < STRESS_ENTRIES; next++) {             /* Replace one at random, anywhere in the list */
+        seed = seed * 1103515245 + 12345;
+        i = (int)((seed >> 16) % STRESS_LIVE);
+        stress_remove(&reg, live[i]);
+        states[next] = ENTRY_LIVE;
+        registry_add(&reg, &entries[next]);
+        live[i] = &entries[next];
+    }
+    __atomic_store_n(&stress_done, 1, __ATOMIC_SEQ_CST);
+    for (i = 0; i < STRESS_WALKERS; i++)
+        pthread_join(walkers[i], NULL);
+
+    for (i = 0; i < STRESS_LIVE; i++)
+        stress_remove(&reg, live[i]);
+    for (i = 0; i < STRESS_PINNED; i++)
+        stress_remove(&reg, &entries[i]);
+    CHECK(registry_size(&reg) == 0);
+    registry_destroy(&reg);
+    CHECK(bad_visits == 0);
+    CHECK(bad_walks == 0);
+    CHECK(released == STRESS_ENTRIES);                  /* Nothing is held back once the walks are gone */
+    free(states);
+    free(entries);
+}
+
+static pthread_mutex_t hold_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hold_cond = PTHREAD_COND_INITIALIZER;
+static int holding, hold_go, hold_visits[6];
+
+/* Stops on the first entry until told to go on */
+static void hold_entry(registry_entry_t *entry, void *data)
+{
+    int *state = (int *)entry->data;
+
+    (void)data;
+    if (__atomic_load_n(state, __ATOMIC_SEQ_CST) == ENTRY_RELEASED)
+        __atomic_add_fetch(&bad_visits, 1, __ATOMIC_SEQ_CST);
+    hold_visits[state - states]++;
+    pthread_mutex_lock(&hold_mutex);
+    if (!holding) {
+        holding = 1;
+        pthread_cond_broadcast(&hold_cond);
+        while (!hold_go)
+            pthread_cond_wait(&hold_cond, &hold_mutex);
+    }
+    pthread_mutex_unlock(&hold_mutex);
+}
+
+static void *hold_func(void *arg)
+{
+    registry_apply((registry_t *)arg, hold_entry, NULL);
+    return NULL;
+}
+
+/* An entry removed under a running walk is released once that walk is done, not before */
+static void test_registry_release(void)
+{
+    registry_t reg;
+    registry_entry_t entries[6];
+    pthread_t walker;
+    int i;
+
+    states = (int *)calloc(6, sizeof(int));
+    released = bad_visits = holding = hold_go = 0;
+    registry_init(&reg, release_entry);
+    for (i = 0; i < 5; i++) {                           /* Walked from 4 down to 0 */
+        entries[i].data = &states[i];
+        states[i] = ENTRY_LIVE;
+        hold_visits[i] = 0;
+        registry_add(&reg, &entries[i]);
+    }
+    pthread_create(&walker, NULL, hold_func, &reg);
+    pthread_mutex_lock(&hold_mutex);
+    while (!holding)
+        pthread_cond_wait(&hold_cond, &hold_mutex);
+    pthread_mutex_unlock(&hold_mutex);
+
+    stress_remove(&reg, &entries[4]);                   /* The one the walk stands on */
+    stress_remove(&reg, &entries[3]);
+    entries[5].data = &states[5];
+    states[5] = ENTRY_LIVE;
+    registry_add(&reg, &entries[5]);                    /* Writers try to release as they go */
+    stress_remove(&reg, &entries[2]);
+    CHECK(__atomic_load_n(&released, __ATOMIC_SEQ_CST) == 0);
+
+    pthread_mutex_lock(&hold_mutex);
+    hold_go = 1;
+    pthread_cond_broadcast(&hold_cond);
+    pthread_mutex_unlock(&hold_mutex);
+    pthread_join(walker, NULL);
+    CHECK(released == 1);                               /* The walk released its epoch on its way out */
+    CHECK(bad_visits == 0);
+    CHECK(hold_visits[1] == 1 && hold_visits[0] == 1);  /* Went on past the removed entries */
+    CHECK(hold_visits[5] == 0);
+
+    stress_remove(&reg, &entries[0]);                   /* Releases the next one */
+    CHECK(released == 3);
+    stress_remove(&reg, &entries[1]);
+    stress_remove(&reg, &entries[5]);
+    registry_destroy(&reg);
+    CHECK(released == 6);
+    free(states);
+}
+
+void test_registry(void)
+{
+    test_registry_basics();
+    test_registry_constant();
+    test_registry_concurrent();
+    test_registry_release();
+}
@@ -0,0 +1,51 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "relay.h"
+#include "test.h"
+
+void test_relay(void)
+{
+    static relay_seen_t t;
+    unsigned long origin;
+
+    relay_seen_init(&t);
+    CHECK(relay_seen(&t, 1, 5) == 0);
+    CHECK(relay_seen(&t, 1, 5) == 1);
+    CHECK(relay_seen(&t, 2, 5) == 0);                   /* Origins count separately */
+    CHECK(relay_seen(&t, 1, 3) == 0);                   /* Late, but within the window */
+    CHECK(relay_seen(&t, 1, 3) == 1);
+    CHECK(relay_seen(&t, 1, 4) == 0);
+    CHECK(relay_seen(&t, 1, 5 + RELAY_WINDOW) == 0);
+    CHECK(relay_seen(&t, 1, 5) == 1);                   /* Fell out of the window */
+    CHECK(relay_seen(&t, 1, 6) == 0);
+    CHECK(relay_seen(&t, 1, 6 + RELAY_WINDOW + 1) == 0);
+    CHECK(relay_seen(&t, 1, 6 + RELAY_WINDOW) == 0);
+
+    for (origin = 100; origin < 100 + RELAY_ORIGINS; origin++)
+        relay_seen(&t, origin, 1);                      /* Pushes out origin 2, heard of least recently */
+    CHECK(relay_seen(&t, 2, 5) == 0);
+    CHECK(relay_seen(&t, 100 + RELAY_ORIGINS - 1, 1) == 1);
+}
@@ -0,0 +1,94 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stddef.h>
+
+#include "test.h"
+#include "wheel.h"
+
+#define WHEEL_TIMERS 7
+
+static unsigned long fired_at[WHEEL_TIMERS];
+static int fired[WHEEL_TIMERS];
+
+/* Notes the tick a timer fired at, rearms the periodic one */
+static void on_expire(wheel_timer_t *t, void *data)
+{
+    wheel_t *w = (wheel_t *)data;
+    int i = (int)(long)t->data;
+
+    fired[i]++;
+    fired_at[i] = w->now - 1;
+    if (i == 0 && fired[i] < 10)
+        wheel_add(w, t, w->now - 1 + 10);
+}
+
+void test_wheel(void)
+{
+    unsigned long expires[WHEEL_TIMERS] = { 10, 1, 63, 64, 65, 4097, 300000 };
+    wheel_timer_t timers[WHEEL_TIMERS], extra;
+    unsigned long tick, start = 1000;
+    long next;
+    wheel_t w;
+    int i;
+
+    wheel_init(&w, start);
+    CHECK(wheel_next(&w) == -1);
+    for (i = 0; i < WHEEL_TIMERS; i++) {
+        wheel_timer_init(&timers[i], (void *)(long)i);
+        fired[i] = 0;
+        wheel_add(&w, &timers[i], start + expires[i]);
+    }
+    wheel_timer_init(&extra, (void *)(long)1);
+    wheel_add(&w, &extra, start + 20);
+    wheel_del(&w, &extra);
+    CHECK(!wheel_armed(&extra));
+    CHECK(w.count == WHEEL_TIMERS);
+
+    for (tick = start; tick <= start + 300000; tick++) {
+        wheel_advance(&w, tick, on_expire, &w);
+        for (i = 1; i < WHEEL_TIMERS; i++)              /* Never early */
+            if (fired[i] && fired_at[i] != start + expires[i])
+                break;
+        if (!CHECK(i == WHEEL_TIMERS))
+            break;
+    }
+    for (i = 1; i < WHEEL_TIMERS; i++)
+        CHECK(fired[i] == 1);
+    CHECK(fired[0] == 10 && fired_at[0] == start + 100);
+    CHECK(w.count == 0);
+
+    wheel_add(&w, &timers[1], w.now + 37);              /* Sleeping as long as told gets there */
+    for (i = 0; i < 5 && wheel_armed(&timers[1]); i++) {
+        next = wheel_next(&w);
+        CHECK(next > 0);
+        wheel_advance(&w, w.now - 1 + next, on_expire, &w);
+    }
+    CHECK(!wheel_armed(&timers[1]) && fired[1] == 2);
+
+    wheel_add(&w, &timers[2], w.now - 50);              /* In the past, fires with the next tick */
+    wheel_advance(&w, w.now, on_expire, &w);
+    CHECK(fired[2] == 2);
+}
@@ -0,0 +1,59 @@
+/*
+    Copyright 2008  Sascha Pelicke <sasch.pe@gmx.de>
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <string.h>
+
+#include "test.h"
+#include "zip.h"
+
+void test_zip(void)
+{
+    const char *text = "alice: hello hello hello hello hello hello hello hello hello\n";
+    char packed[256], again[256], plain[256], noise[64];
+    ssize_t len, size;
+    z_stream s;
+    zip_t z;
+    int i;
+
+    zip_init(&z, Z_BEST_SPEED);
+    memset(&s, 0, sizeof(s));
+    if (!CHECK(inflateInit2(&s, -15) == Z_OK))
+        return;
+    len = zip_compress(&z, text, strlen(text), packed, strlen(text));
+    CHECK(len > 0 && len < (ssize_t)strlen(text));
+    size = zip_inflate(&s, packed, len, plain, sizeof(plain));
+    CHECK(size == (ssize_t)strlen(text) && memcmp(plain, text, size) == 0);
+    CHECK(zip_compress(&z, text, strlen(text), again, sizeof(again)) == len);  /* Each message stands alone */
+    CHECK(memcmp(packed, again, len) == 0);
+    CHECK(zip_inflate(&s, again, len, plain, sizeof(plain)) == (ssize_t)strlen(text));
+
+    CHECK(zip_inflate(&s, packed, len, plain, 10) == -1);
+    CHECK(zip_inflate(&s, packed, len / 2, plain, sizeof(plain)) == -1);
+    for (i = 0; i < (int)sizeof(noise); i++)
+        noise[i] = (char)(i * 151 + 7);
+    CHECK(zip_compress(&z, noise, sizeof(noise), packed, sizeof(noise)) == -1);  /* Wouldn't get shorter */
+    inflateEnd(&s);
+    zip_destroy(&z);
+}